@@ -13,13 +13,19 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <ctype.h>
 #include <assert.h>
 #include <sys/time.h>
+#include <math.h>
 #include "bcm_host.h"
+#include "stage_prof.h"
+#include "frame_pool.h"
+#include "frame_pacer.h"
 
 // Parameters
 #define GRP_W DW
 #define GRP_H DH
+#define GRP_VSCALE DH_SCALE // screen lines per line, before fitting the layer to the screen
 
 // Utility macros
 //--------------------------------------------------------------------------------
@@ -30,6 +36,7 @@
 // Prototypes
 //--------------------------------------------------------------------------------
 int64_t timemillis(void);
+int64_t timemicros(void);
 void vsync(void);
 int MGL_Init();
 void draw_and_vsync(void);
@@ -41,6 +48,41 @@ void finalize(void);
 uint32_t rgb(int r, int g, int b);
 uint32_t rgba(int r, int g, int b, int a);
 void bgcolor(uint32_t c);
+void MGL_Present(void);
+int MGL_SetRefresh(float hz, int allow_mode_change);
+
+// Layers: one dispmanx element (and resource) each, updated together on vsync
+#define MGL_LAYER_MAX 4
+typedef struct MGL_layer MGL_layer_t;
+MGL_layer_t *MGL_AddLayer(int x, int y, int w, int h);
+void MGL_PresentLayer(MGL_layer_t *layer);
+frame_pool_t *MGL_LayerPool(MGL_layer_t *layer);
+void MGL_SetLayerIdle(MGL_layer_t *layer, int idle);
+void MGL_SetLayerPacing(MGL_layer_t *layer, double src_hz);
+uint32_t MGL_LayerColor(MGL_layer_t *layer, uint8_t c);
+int MGL_SetLayerPalette(MGL_layer_t *layer, const uint8_t map[256]);
+
+// Overlay: a small text element above all layers, with its own resource
+int MGL_OverlayInit(int cols, int rows);
+void MGL_OverlayShow(int show);
+void MGL_OverlayPrint(int row, const char *text);
+void MGL_OverlayFlush(void);
+
+// Frame pacing counters (see MGL_GetPacing)
+typedef struct {
+    uint64_t vsyncs;      // display vsyncs since start
+    uint64_t presented;   // frames handed over by MGL_Present()
+    uint64_t repeated;    // vsyncs without a new frame (previous one shown again)
+    uint64_t dropped;     // presented frames replaced before being shown
+    uint64_t rate_vsyncs; // vsyncs since MGL_ResetDisplayRate()
+    int64_t rate_us;      // time of the first vsync after MGL_ResetDisplayRate()
+    int64_t last_us;      // time of the latest vsync
+    int64_t first_us;     // time the first presented frame was on screen
+    uint64_t copied;      // bytes copied to display memory (uploads)
+    uint64_t exhausted;   // every buffer was held (display, subscribers): a queued frame or this one was not shown
+} MGL_pacing_t;
+void MGL_GetPacing(MGL_pacing_t *pacing);
+void MGL_ResetDisplayRate(void);
 
 //================================================================================
 /////////////////////////////   end header file   ////////////////////////////////
@@ -63,16 +105,20 @@ int64_t timemillis() {
     return (now.tv_sec * 1000L) + (now.tv_usec / 1000L);
 }
 
+// get monotonic time in microseconds
+int64_t timemicros() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000000LL) + (now.tv_nsec / 1000L);
+}
+
 //================================================================================
 // dispmanx
 //================================================================================
 typedef struct {
     DISPMANX_DISPLAY_HANDLE_T display;
     DISPMANX_MODEINFO_T info;
-    void *image;
     DISPMANX_UPDATE_HANDLE_T update;
-    DISPMANX_RESOURCE_HANDLE_T resource;
-    DISPMANX_ELEMENT_HANDLE_T element;
     uint32_t vc_image_ptr;
 
 } RECT_VARS_T;
@@ -87,40 +133,227 @@ int vram_pitch;
 int aligned_height;
 
 // VRAM
+// Each layer has a frame pool: the application draws into layer->vram,
+// MGL_PresentLayer() queues it in the pacer of the layer (and publishes it to
+// the subscribers of the pool) and continues with a free frame, and the vsync
+// callback shows the frame the pacer says is due. Four frames are held by the
+// display (drawn, shown and two queued), the rest are for the subscribers.
+#define MGL_FRAMES 6
 typedef uint8_t col_t;
-col_t *vram;
+struct MGL_layer {
+    int bpp;   // bytes per pixel of vram (always 1 here)
+    int pitch; // bytes per line of vram
+    DISPMANX_RESOURCE_HANDLE_T resource;
+    DISPMANX_ELEMENT_HANDLE_T element;
+    VC_RECT_T place;     // screen rectangle; width 0 for automatic layout
+    frame_pool_t pool;   // frames of the layer
+    frame_t *frame;      // frame being drawn
+    col_t *vram;         // its data
+    frame_pacer_t pacer; // presented frames not shown yet
+    frame_t *shown;      // frame in the resource
+    int idle;            // showing a static frame; repeats are not counted
+    MGL_pacing_t pacing;
+};
+static MGL_layer_t layers[MGL_LAYER_MAX];
+static int layer_num = 0;
+static pthread_mutex_t vram_mtx = PTHREAD_MUTEX_INITIALIZER;
+col_t *vram; // vram of the first layer
 
 //================================================================================
 // Renderer
 //================================================================================
 void dispmanx_vsync_callback(DISPMANX_UPDATE_HANDLE_T u, void *dat) {
+    int64_t now = timemicros();
+    int pending[MGL_LAYER_MAX];
+    int updated = 0;
+
+    // Take the frame of each layer that is due, if any
+    pthread_mutex_lock(&vram_mtx);
+    for (int i = 0; i < layer_num; i++) {
+        MGL_layer_t *l = &layers[i];
+        int dropped;
+        frame_t *f = frame_pacer_take(&l->pacer, now, &dropped);
+        pending[i] = (f != NULL);
+        l->pacing.dropped += dropped;
+        if (pending[i]) {
+            frame_release(l->shown);
+            l->shown = f;
+            l->pacing.copied += vram_pitch * height; // uploaded below
+            updated++;
+        } else if (!l->idle) {
+            l->pacing.repeated++;
+        }
+        if (!l->pacing.rate_vsyncs++) {
+            l->pacing.rate_us = now;
+        }
+        l->pacing.vsyncs++;
+        l->pacing.last_us = now;
+    }
+    pthread_mutex_unlock(&vram_mtx);
+
+    // Nothing new to show; the resources still hold the previous frames.
+    if (!updated) {
+        return;
+    }
+
+    // One update for all layers
+    PROF_BEGIN(t);
     vars.update = vc_dispmanx_update_start(/* priority */ 10);
     assert(vars.update);
 
     vc_dispmanx_rect_set(&dst_rect, 0, 0, width, height);
-    int ret = vc_dispmanx_resource_write_data(vars.resource, type, vram_pitch, vars.image, &dst_rect);
-    assert(ret == 0);
+    for (int i = 0; i < layer_num; i++) {
+        if (pending[i]) {
+            int ret = vc_dispmanx_resource_write_data(layers[i].resource, type, vram_pitch, layers[i].shown->data, &dst_rect);
+            assert(ret == 0);
+        }
+    }
 
-    ret = vc_dispmanx_update_submit_sync(vars.update);
+    int ret = vc_dispmanx_update_submit_sync(vars.update);
     assert(ret == 0);
+    PROF_END(t, PROF_UPLOAD);
+
+    if (!layers[0].pacing.first_us && pending[0] && !layers[0].idle) {
+        layers[0].pacing.first_us = timemicros();
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Hand the finished vram over to the display and the subscribers, and continue
+// with a free frame. The pacer decides on which vsync it is shown. If the
+// subscribers hold all the other frames, the oldest queued frame that nobody
+// else holds is drawn over instead, or else the frame is not presented and the
+// application draws over it again.
+//--------------------------------------------------------------------------------
+void MGL_PresentLayer(MGL_layer_t *l) {
+    pthread_mutex_lock(&vram_mtx);
+    frame_t *next = frame_pool_get(&l->pool);
+    if (next == NULL && (next = frame_pacer_reclaim(&l->pacer)) != NULL) {
+        l->pacing.dropped++; // not shown yet and it will not be: reuse it
+    }
+    if (next == NULL) {
+        pthread_mutex_unlock(&vram_mtx);
+        return;
+    }
+    frame_t *done = l->frame;
+    frame_ref(done); // published below, outside the lock
+    l->pacing.dropped += frame_pacer_push(&l->pacer, done, timemicros());
+    l->frame = next;
+    l->vram = (col_t *)next->data;
+    l->pacing.presented++;
+    if (l == &layers[0]) {
+        vram = l->vram;
+    }
+    pthread_mutex_unlock(&vram_mtx);
+
+    frame_pool_publish(&l->pool, done);
+    frame_release(done);
+}
+
+// Frames of the layer, e.g. to subscribe to them
+frame_pool_t *MGL_LayerPool(MGL_layer_t *l) { return &l->pool; }
+
+void MGL_Present() { MGL_PresentLayer(&layers[0]); }
+
+// Pixel value of an 8bpp color in the vram of the layer
+uint32_t MGL_LayerColor(MGL_layer_t *l, uint8_t c) { return c; }
+
+//--------------------------------------------------------------------------------
+// Show byte i of the layer as 8bpp color map[i], e.g. to display raw samples
+// as they are. Call after MGL_Start().
+//--------------------------------------------------------------------------------
+int MGL_SetLayerPalette(MGL_layer_t *l, const uint8_t map[256]) {
+    uint16_t palette[256]; // RGB565
+    for (int i = 0; i < 256; i++) {
+        int c = map[i];
+        int r = (c / 36) * 51, g = (c / 6 % 6) * 51, b = (c % 6) * 51;
+        palette[i] = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+    }
+    return (vc_dispmanx_resource_set_palette(l->resource, palette, 0, sizeof(palette)) == 0) ? 0 : -1;
+}
+
+// Mark the layer as showing a static frame (e.g. "no signal")
+void MGL_SetLayerIdle(MGL_layer_t *l, int idle) {
+    pthread_mutex_lock(&vram_mtx);
+    l->idle = idle;
+    pthread_mutex_unlock(&vram_mtx);
+}
+
+// Pacing of the first layer
+void MGL_GetPacing(MGL_pacing_t *p) {
+    pthread_mutex_lock(&vram_mtx);
+    *p = layers[0].pacing;
+    p->exhausted = __atomic_load_n(&layers[0].pool.exhausted, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&vram_mtx);
+}
+
+// Restart the display refresh measurement (e.g. after a mode or clock change)
+void MGL_ResetDisplayRate() {
+    pthread_mutex_lock(&vram_mtx);
+    for (int i = 0; i < layer_num; i++) {
+        layers[i].pacing.rate_vsyncs = 0;
+    }
+    pthread_mutex_unlock(&vram_mtx);
 }
 
 //================================================================================
 // Initializer
 //================================================================================
+//--------------------------------------------------------------------------------
+// Add a layer before MGL_Start(). Layers are stacked from 2000 upwards in the
+// order they are added. Without any, MGL_Start() adds one full-screen layer.
+//--------------------------------------------------------------------------------
+MGL_layer_t *MGL_AddLayer(int x, int y, int w, int h) {
+    if (layer_num >= MGL_LAYER_MAX) {
+        return NULL;
+    }
+    MGL_layer_t *l = &layers[layer_num++];
+    memset(l, 0, sizeof(*l));
+    vc_dispmanx_rect_set(&l->place, x, y, w, h);
+    return l;
+}
+
+// Screen rectangle of a layer for the current display size. Layers without a
+// placement share the screen side by side.
+static void dispmanx_layout(VC_RECT_T *rect, int index) {
+    if (layers[index].place.width) {
+        *rect = layers[index].place;
+        return;
+    }
+
+    int area_width = vars.info.width / layer_num;
+    float scale = MIN((float)(vars.info.height - 0) / (height * GRP_VSCALE), (float)area_width / width);
+    float dst_height = height * GRP_VSCALE * scale;
+    float dst_width = width * scale;
+
+    vc_dispmanx_rect_set(rect, area_width * index + (area_width - dst_width) / 2, (vars.info.height - dst_height) / 2, dst_width, dst_height);
+}
+
 int MGL_dispmanx_Init() {
     vram_pitch = ALIGN_UP(width * sizeof(*vram), 32); // bytes of a line
     aligned_height = ALIGN_UP(height, 16);
 
     int ret;
 
+    if (layer_num == 0) {
+        MGL_AddLayer(0, 0, 0, 0);
+    }
+
     // Make VRAM
     int vram_size_n = GRP_W * GRP_H;
-    vram = calloc(sizeof(*vram), vram_size_n);
-    if (!vram) {
-        fprintf(stderr, "MGL: Cannot allocate vram (%dbytes)\n", sizeof(*vram) * vram_size_n);
-        return -1;
+    for (int i = 0; i < layer_num; i++) {
+        MGL_layer_t *l = &layers[i];
+        l->bpp = sizeof(*vram);
+        l->pitch = width * sizeof(*vram);
+        if (frame_pool_init(&l->pool, MGL_FRAMES, sizeof(*vram) * vram_size_n, NULL) < 0) {
+            fprintf(stderr, "MGL: Cannot allocate vram (%dbytes x %d)\n", sizeof(*vram) * vram_size_n, MGL_FRAMES);
+            return -1;
+        }
+        l->shown = frame_pool_get(&l->pool);
+        l->frame = frame_pool_get(&l->pool);
+        l->vram = (col_t *)l->frame->data;
     }
+    vram = layers[0].vram;
 
     // Init Dispmanx
     bcm_host_init();
@@ -134,41 +367,41 @@ int MGL_dispmanx_Init() {
     assert(ret == 0);
     printf("Dispmanx: Display is %d x %d\n", vars.info.width, vars.info.height);
 
-    // Create resource
-    vars.image = vram;
-    vars.resource = vc_dispmanx_resource_create(type, width, height, &vars.vc_image_ptr);
-    assert(vars.resource);
-
-    // Write image to the resource
-    vc_dispmanx_rect_set(&dst_rect, 0, 0, width, height);
-    ret = vc_dispmanx_resource_write_data(vars.resource, type, vram_pitch, vars.image, &dst_rect);
-    assert(ret == 0);
-
     // Start update and get its handle
     vars.update = vc_dispmanx_update_start(/* priority */ 10);
     assert(vars.update);
 
-    // Add element
     // Source Rectangle
     vc_dispmanx_rect_set(&src_rect, 0, 0, width << 16, height << 16);
-    // Screen Rectangle
-    float scale = (float)(vars.info.height - 0) / (height * 2);
-    float dst_height = height * 2 * scale;
-    float dst_width = width * scale;
+    VC_DISPMANX_ALPHA_T alpha = {DISPMANX_FLAGS_ALPHA_FROM_SOURCE | DISPMANX_FLAGS_ALPHA_FIXED_ALL_PIXELS, /*alpha 0->255*/ 255, 0};
 
-    vc_dispmanx_rect_set(&dst_rect, (vars.info.width - dst_width) / 2, (vars.info.height - dst_height) / 1, dst_width, dst_height);
+    for (int i = 0; i < layer_num; i++) {
+        MGL_layer_t *l = &layers[i];
 
-    printf("Dispmanx: screen=(%d,%d) element=(%d,%d)\n", vars.info.width, vars.info.height, width, height);
-    printf("Dispmanx: src=(%d,%d)[%d,%d]\n", src_rect.x, src_rect.y, src_rect.width >> 16, src_rect.height >> 16);
-    printf("Dispmanx: dst=(%d,%d)[%d,%d]\n", dst_rect.x, dst_rect.y, dst_rect.width, dst_rect.height);
+        // Create resource
+        l->resource = vc_dispmanx_resource_create(type, width, height, &vars.vc_image_ptr);
+        assert(l->resource);
 
-    VC_DISPMANX_ALPHA_T alpha = {DISPMANX_FLAGS_ALPHA_FROM_SOURCE | DISPMANX_FLAGS_ALPHA_FIXED_ALL_PIXELS, /*alpha 0->255*/ 255, 0};
+        // Write image to the resource
+        vc_dispmanx_rect_set(&dst_rect, 0, 0, width, height);
+        ret = vc_dispmanx_resource_write_data(l->resource, type, vram_pitch, l->shown->data, &dst_rect);
+        assert(ret == 0);
+
+        // Add element
+        // Screen Rectangle
+        dispmanx_layout(&dst_rect, i);
+
+        printf("Dispmanx: layer %d screen=(%d,%d) element=(%d,%d)\n", 2000 + i, vars.info.width, vars.info.height, width, height);
+        printf("Dispmanx: src=(%d,%d)[%d,%d]\n", src_rect.x, src_rect.y, src_rect.width >> 16, src_rect.height >> 16);
+        printf("Dispmanx: dst=(%d,%d)[%d,%d]\n", dst_rect.x, dst_rect.y, dst_rect.width, dst_rect.height);
+
+        l->element = vc_dispmanx_element_add(vars.update, vars.display,
+                                             2000 + i, // layer
+                                             &dst_rect, l->resource, &src_rect, DISPMANX_PROTECTION_NONE, &alpha,
+                                             NULL, // clamp
+                                             VC_IMAGE_ROT0);
+    }
 
-    vars.element = vc_dispmanx_element_add(vars.update, vars.display,
-                                           2000, // layer
-                                           &dst_rect, vars.resource, &src_rect, DISPMANX_PROTECTION_NONE, &alpha,
-                                           NULL, // clamp
-                                           VC_IMAGE_ROT0);
     // Update
     ret = vc_dispmanx_update_submit_sync(vars.update);
     assert(ret == 0);
@@ -180,6 +413,229 @@ int MGL_dispmanx_Init() {
     return 0;
 }
 
+//================================================================================
+// HDMI refresh rate
+//================================================================================
+#define HDMI_CLOCK_TUNE_MAX 0.01       // max. deviation from the nominal pixel clock (+-1%)
+#define HDMI_CLOCK_TUNE_MIN 0.00002    // closer than this (20ppm) counts as locked
+#define HDMI_RATE_WINDOW_US 5000000    // min. display refresh measurement window
+#define ELEMENT_CHANGE_DEST_RECT (1 << 2)
+static int hdmi_pixel_clock = 0;         // current pixel clock in Hz
+static int hdmi_pixel_clock_nominal = 0; // pixel clock of the mode as set up
+
+// Pixel clock as reported by the firmware ("frequency(29)=148500000")
+static int hdmi_measure_pixel_clock() {
+    char resp[64];
+    if (vc_gencmd(resp, sizeof(resp), "measure_clock pixel") != 0) {
+        return -1;
+    }
+    char *p = strchr(resp, '=');
+    return p ? atoi(p + 1) : -1;
+}
+
+// Switch to the mode of the current resolution whose refresh is closest to hz.
+// Returns 1 if the mode was changed.
+static int hdmi_select_mode(float hz) {
+    TV_DISPLAY_STATE_T state;
+    if (vc_tv_get_display_state(&state) != 0) {
+        return -1;
+    }
+
+    HDMI_RES_GROUP_T groups[] = {HDMI_RES_GROUP_CEA, HDMI_RES_GROUP_DMT};
+    HDMI_RES_GROUP_T best_group = state.display.hdmi.group;
+    uint32_t best_code = state.display.hdmi.mode;
+    float best = fabsf(state.display.hdmi.frame_rate - hz);
+    int best_rate = state.display.hdmi.frame_rate;
+
+    TV_SUPPORTED_MODE_NEW_T modes[128];
+    for (int g = 0; g < sizeof(groups) / sizeof(groups[0]); g++) {
+        int n = vc_tv_hdmi_get_supported_modes_new(groups[g], modes, sizeof(modes) / sizeof(modes[0]), NULL, NULL);
+        for (int i = 0; i < n; i++) {
+            if (modes[i].width != state.display.hdmi.width || modes[i].height != state.display.hdmi.height || modes[i].scan_mode) {
+                continue;
+            }
+            float d = fabsf(modes[i].frame_rate - hz);
+            if (d < best) {
+                best = d;
+                best_group = groups[g];
+                best_code = modes[i].code;
+                best_rate = modes[i].frame_rate;
+            }
+        }
+    }
+
+    if (best_group == state.display.hdmi.group && best_code == state.display.hdmi.mode) {
+        return 0;
+    }
+
+    printf("HDMI: Switching to %s mode %d (%dx%d@%dHz)\n", (best_group == HDMI_RES_GROUP_CEA) ? "CEA" : "DMT", best_code,
+           state.display.hdmi.width, state.display.hdmi.height, best_rate);
+    if (vc_tv_hdmi_power_on_explicit_new(HDMI_MODE_HDMI, best_group, best_code) != 0) {
+        fprintf(stderr, "HDMI: Mode switch failed.\n");
+        return -1;
+    }
+    usleep(500 * 1000); // wait for the display to settle
+
+    // Place the element for the new display size
+    int ret = vc_dispmanx_display_get_info(vars.display, &vars.info);
+    assert(ret == 0);
+    DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start(10);
+    assert(update);
+    for (int i = 0; i < layer_num; i++) {
+        dispmanx_layout(&dst_rect, i);
+        ret = vc_dispmanx_element_change_attributes(update, layers[i].element, ELEMENT_CHANGE_DEST_RECT, 0, 0, &dst_rect, NULL, 0, 0);
+        assert(ret == 0);
+    }
+    ret = vc_dispmanx_update_submit_sync(update);
+    assert(ret == 0);
+
+    return 1;
+}
+
+//--------------------------------------------------------------------------------
+// Bring the display refresh to hz: optionally pick the closest HDMI mode, then
+// fine-tune the pixel clock within HDMI_CLOCK_TUNE_MAX of the nominal clock.
+// Returns 1 if something was changed (call again after a new measurement),
+// 0 if locked or still measuring, and -1 if hz cannot be reached.
+//--------------------------------------------------------------------------------
+int MGL_SetRefresh(float hz, int allow_mode_change) {
+    if (allow_mode_change) {
+        int ret = hdmi_select_mode(hz);
+        if (ret > 0) {
+            hdmi_pixel_clock = hdmi_pixel_clock_nominal = 0;
+            MGL_ResetDisplayRate();
+            return 1;
+        }
+    }
+
+    MGL_pacing_t p;
+    MGL_GetPacing(&p);
+    if (p.rate_vsyncs < 2 || p.last_us - p.rate_us < HDMI_RATE_WINDOW_US) {
+        return 0;
+    }
+    double display_hz = (p.rate_vsyncs - 1) * 1000000.0 / (p.last_us - p.rate_us);
+
+    if (!hdmi_pixel_clock) {
+        hdmi_pixel_clock = hdmi_pixel_clock_nominal = hdmi_measure_pixel_clock();
+    }
+    if (hdmi_pixel_clock <= 0) {
+        return -1;
+    }
+
+    double target = hdmi_pixel_clock * hz / display_hz;
+    if (fabs(target / hdmi_pixel_clock_nominal - 1.0) > HDMI_CLOCK_TUNE_MAX) {
+        return -1;
+    }
+    if (fabs(target / hdmi_pixel_clock - 1.0) < HDMI_CLOCK_TUNE_MIN) {
+        return 0;
+    }
+
+    char resp[64];
+    if (vc_gencmd(resp, sizeof(resp), "hdmi_adjust_clock %d", (int)target) != 0) {
+        return -1;
+    }
+    hdmi_pixel_clock = (int)target;
+    MGL_ResetDisplayRate();
+    return 1;
+}
+
+// Pace the frames of the layer to a source of src_hz that the display is not
+// locked to (see frame_pacer.h), at the display refresh measured since
+// MGL_ResetDisplayRate(). 0, or a display refresh measured for less than
+// HDMI_RATE_WINDOW_US, shows the latest frame on each vsync. Call again with
+// every new measurement.
+void MGL_SetLayerPacing(MGL_layer_t *l, double src_hz) {
+    pthread_mutex_lock(&vram_mtx);
+    MGL_pacing_t *p = &l->pacing;
+    int measured = (p->rate_vsyncs > 1 && p->last_us - p->rate_us >= HDMI_RATE_WINDOW_US);
+    double disp_hz = measured ? (p->rate_vsyncs - 1) * 1000000.0 / (p->last_us - p->rate_us) : 0;
+    frame_pacer_set(&l->pacer, src_hz, disp_hz);
+    pthread_mutex_unlock(&vram_mtx);
+}
+
+//================================================================================
+// Overlay
+//================================================================================
+#include "MGL_overlay.h"
+
+#define OVERLAY_LAYER 2100
+#define ELEMENT_CHANGE_OPACITY (1 << 1)
+
+static struct {
+    DISPMANX_RESOURCE_HANDLE_T resource;
+    DISPMANX_ELEMENT_HANDLE_T element;
+    uint16_t *image;
+    int width, height, pitch;
+    int cols, rows;
+    int shown;
+} overlay;
+
+//--------------------------------------------------------------------------------
+// Create the overlay element (hidden) in the top left corner
+//--------------------------------------------------------------------------------
+int MGL_OverlayInit(int cols, int rows) {
+    overlay.cols = cols;
+    overlay.rows = rows;
+    overlay.width = ALIGN_UP(cols * OVERLAY_CHAR_W + 4, 16);
+    overlay.height = rows * OVERLAY_CHAR_H + 4;
+    overlay.pitch = overlay.width * sizeof(*overlay.image);
+    overlay.image = calloc(overlay.width * overlay.height, sizeof(*overlay.image));
+    if (!overlay.image) {
+        return -1;
+    }
+
+    uint32_t ptr;
+    overlay.resource = vc_dispmanx_resource_create(VC_IMAGE_RGBA16, overlay.width, overlay.height, &ptr);
+    assert(overlay.resource);
+
+    VC_RECT_T src, dst;
+    vc_dispmanx_rect_set(&src, 0, 0, overlay.width << 16, overlay.height << 16);
+    vc_dispmanx_rect_set(&dst, 16, 16, overlay.width * 2, overlay.height * 2);
+    VC_DISPMANX_ALPHA_T alpha = {DISPMANX_FLAGS_ALPHA_FROM_SOURCE, /*alpha 0->255*/ 0, 0};
+
+    DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start(10);
+    assert(update);
+    overlay.element = vc_dispmanx_element_add(update, vars.display, OVERLAY_LAYER, &dst, overlay.resource, &src, DISPMANX_PROTECTION_NONE, &alpha, NULL,
+                                              VC_IMAGE_ROT0);
+    int ret = vc_dispmanx_update_submit_sync(update);
+    assert(ret == 0);
+
+    return 0;
+}
+
+// Show or hide; the capture layers are not touched.
+void MGL_OverlayShow(int show) {
+    if (!overlay.resource || overlay.shown == show) {
+        return;
+    }
+    overlay.shown = show;
+    DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start(10);
+    assert(update);
+    vc_dispmanx_element_change_attributes(update, overlay.element, ELEMENT_CHANGE_OPACITY, 0, show ? 255 : 0, NULL, NULL, 0, 0);
+    vc_dispmanx_update_submit(update, NULL, NULL);
+}
+
+// Draw a text line into the overlay image
+void MGL_OverlayPrint(int row, const char *text) {
+    if (!overlay.image || row >= overlay.rows) {
+        return;
+    }
+    overlay_text(overlay.image, overlay.width, overlay.cols, row, text);
+}
+
+// Upload the overlay image (only when shown)
+void MGL_OverlayFlush() {
+    if (!overlay.resource || !overlay.shown) {
+        return;
+    }
+    VC_RECT_T rect;
+    vc_dispmanx_rect_set(&rect, 0, 0, overlay.width, overlay.height);
+    DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start(10);
+    assert(update);
+    vc_dispmanx_resource_write_data(overlay.resource, VC_IMAGE_RGBA16, overlay.pitch, overlay.image, &rect);
+    vc_dispmanx_update_submit(update, NULL, NULL);
+}
+
 //================================================================================
 // graphics
 //================================================================================
@@ -199,6 +655,9 @@ void gfill(int x1, int y1, int x2, int y2, col_t c) {
     }
 }
 
+// Clear the vram of a layer
+void gclear(MGL_layer_t *l) { memset(l->vram, 0, l->pitch * height); }
+
 //================================================================================
 // MGL
 //================================================================================
@@ -229,22 +688,34 @@ void MGL_Quit() {
 
     vars.update = vc_dispmanx_update_start(10);
     assert(vars.update);
-    ret = vc_dispmanx_element_remove(vars.update, vars.element);
-    assert(ret == 0);
+    if (overlay.resource) {
+        ret = vc_dispmanx_element_remove(vars.update, overlay.element);
+        assert(ret == 0);
+    }
+    for (int i = 0; i < layer_num; i++) {
+        ret = vc_dispmanx_element_remove(vars.update, layers[i].element);
+        assert(ret == 0);
+    }
     ret = vc_dispmanx_update_submit_sync(vars.update);
     assert(ret == 0);
-    ret = vc_dispmanx_resource_delete(vars.resource);
-    assert(ret == 0);
+    for (int i = 0; i < layer_num; i++) {
+        ret = vc_dispmanx_resource_delete(layers[i].resource);
+        assert(ret == 0);
+    }
+    if (overlay.resource) {
+        ret = vc_dispmanx_resource_delete(overlay.resource);
+        assert(ret == 0);
+        free(overlay.image);
+    }
     ret = vc_dispmanx_display_close(vars.display);
     assert(ret == 0);
 
     // Release vram
-    if (vram) {
-        free(vram);
+    for (int i = 0; i < layer_num; i++) {
+        frame_pool_free(&layers[i].pool);
     }
 
     puts("MGL: Quit");
-    exit(0);
 }
 
 //--------------------------------------------------------------------------------
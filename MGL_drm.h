@@ -0,0 +1,1236 @@
+//
+// Minatsu Game Library with DRM/KMS by Minatsu
+//
+// Same interface as MGL_dispmanx.h, shown with atomic page flips. Vblank and
+// page-flip events drive the presentation the way the dispmanx vsync callback
+// does. Runs on vc4-kms-v3d as well as on the vkms virtual driver
+// ("modprobe vkms") of any Linux box.
+//
+// Direct scanout: if the driver can scale one plane per layer (vc4 can), the
+// layer buffers are XRGB8888 dumb buffers that are flipped as they are, so
+// the application draws straight into display memory. Otherwise (vkms, or
+// MGL_DRM_COMPOSE=1 in the environment) the 8bpp layers and the overlay are
+// composed into a full-screen buffer on the primary plane.
+//
+#ifndef __MGL_DRM_H_
+#define __MGL_DRM_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <math.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#include "stage_prof.h"
+#include "frame_pool.h"
+#include "frame_pacer.h"
+
+// Parameters
+#define GRP_W DW
+#define GRP_H DH
+#define GRP_VSCALE DH_SCALE // screen lines per line, before fitting the layer to the screen
+
+// Utility macros
+//--------------------------------------------------------------------------------
+#define ZEROFILL(var) memset(&(var), 0, sizeof(var))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// Prototypes
+//--------------------------------------------------------------------------------
+int64_t timemillis(void);
+int64_t timemicros(void);
+int MGL_Init(void);
+void MGL_Quit(void);
+void finalize(void);
+void MGL_Present(void);
+int MGL_SetRefresh(float hz, int allow_mode_change);
+
+// Layers: composed into the scanout buffer on the vblank after they change
+#define MGL_LAYER_MAX 4
+typedef struct MGL_layer MGL_layer_t;
+MGL_layer_t *MGL_AddLayer(int x, int y, int w, int h);
+void MGL_PresentLayer(MGL_layer_t *layer);
+frame_pool_t *MGL_LayerPool(MGL_layer_t *layer);
+void MGL_SetLayerIdle(MGL_layer_t *layer, int idle);
+void MGL_SetLayerPacing(MGL_layer_t *layer, double src_hz);
+uint32_t MGL_LayerColor(MGL_layer_t *layer, uint8_t c);
+int MGL_SetLayerPalette(MGL_layer_t *layer, const uint8_t map[256]);
+
+// Overlay: a small text box above all layers
+int MGL_OverlayInit(int cols, int rows);
+void MGL_OverlayShow(int show);
+void MGL_OverlayPrint(int row, const char *text);
+void MGL_OverlayFlush(void);
+
+// Frame pacing counters (see MGL_GetPacing)
+typedef struct {
+    uint64_t vsyncs;      // display vsyncs since start
+    uint64_t presented;   // frames handed over by MGL_Present()
+    uint64_t repeated;    // vsyncs without a new frame (previous one shown again)
+    uint64_t dropped;     // presented frames replaced before being shown
+    uint64_t rate_vsyncs; // vsyncs since MGL_ResetDisplayRate()
+    int64_t rate_us;      // time of the first vsync after MGL_ResetDisplayRate()
+    int64_t last_us;      // time of the latest vsync
+    int64_t first_us;     // time the first presented frame was on screen
+    uint64_t copied;      // bytes copied to display memory (uploads, composition)
+    uint64_t exhausted;   // every buffer was held (display, subscribers): a queued frame or this one was not shown
+} MGL_pacing_t;
+void MGL_GetPacing(MGL_pacing_t *pacing);
+void MGL_ResetDisplayRate(void);
+
+//================================================================================
+/////////////////////////////   end header file   ////////////////////////////////
+//================================================================================
+#endif // __MGL_DRM_H_
+#ifdef MGL_IMPLEMENTATION
+
+//================================================================================
+// Utilities
+//================================================================================
+
+// get current time in milliseconds
+int64_t timemillis() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec * 1000L) + (now.tv_usec / 1000L);
+}
+
+// get monotonic time in microseconds
+int64_t timemicros() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000000LL) + (now.tv_nsec / 1000L);
+}
+
+//================================================================================
+// DRM
+//================================================================================
+#define DRM_CARD_MAX 8
+#define OVERLAY_X 16 // overlay position and scale on the screen
+#define OVERLAY_Y 16
+#define OVERLAY_SCALE 2
+
+typedef struct {
+    uint32_t handle;
+    uint32_t fb_id;
+    uint32_t pitch;
+    uint64_t size;
+    uint32_t *map;
+    int overlay; // the overlay was drawn into this buffer
+} drm_fb_t;
+
+typedef struct {
+    int x, y, width, height;
+} drm_rect_t;
+
+static struct {
+    int fd;
+    drmModeConnector *conn;
+    uint32_t crtc_id;
+    int crtc_index;
+    uint32_t plane_id;
+    drmModeModeInfo mode;
+    uint32_t mode_blob;
+    drmModeModeInfo next_mode; // requested by MGL_SetRefresh(), set on the next vblank
+    int mode_change;
+
+    // Property IDs
+    uint32_t conn_crtc_id;
+    uint32_t crtc_mode_id, crtc_active;
+    uint32_t plane_fb_id, plane_crtc_id;
+    uint32_t plane_src_x, plane_src_y, plane_src_w, plane_src_h;
+    uint32_t plane_crtc_x, plane_crtc_y, plane_crtc_w, plane_crtc_h;
+
+    drm_fb_t fb[2]; // composition: full-screen buffers
+    int front;      // buffer on screen, or being flipped to
+    int flip_first; // the pending flip carries the first frame of layer 0
+
+    // Direct scanout: a plane per layer, and one for the overlay
+    int direct;
+    uint32_t planes[MGL_LAYER_MAX + 1]; // primary plane first
+    int plane_num;
+    drm_fb_t osd_fb[2]; // ARGB8888 overlay, double buffered
+    int osd_w, osd_h;
+    int osd_front;
+    int osd_on;
+    pthread_t th;
+    volatile int run;
+} drm = {.fd = -1};
+
+int width = GRP_W, height = GRP_H;
+
+// VRAM
+// Each layer has a frame pool: the application draws into layer->vram,
+// MGL_PresentLayer() queues it in the pacer of the layer (and publishes it to
+// the subscribers of the pool) and continues with a free frame, and the vblank
+// handler shows the frame the pacer says is due. Five frames are held by the
+// display (drawn, shown, flipped to and two queued), the rest are for the
+// subscribers.
+#define MGL_FRAMES 7
+typedef uint8_t col_t;
+struct MGL_layer {
+    int bpp;             // bytes per pixel of vram: 1 (8bpp) or 4 (XRGB8888, direct scanout)
+    int pitch;           // bytes per line of vram
+    drm_rect_t place;    // screen rectangle; width 0 for automatic layout
+    drm_rect_t rect;     // screen rectangle in the current mode, clipped
+    int *xmap;           // source x of each destination x
+    uint32_t *palette;   // 8bpp -> XRGB8888 when composing
+    int dst_height;      // height the layer is scaled to (before clipping)
+    frame_pool_t pool;   // frames of the layer
+    frame_t *frame;      // frame being drawn
+    col_t *vram;         // its data
+    frame_pacer_t pacer; // presented frames not shown yet
+    frame_t *shown;      // frame composed into the scanout buffer, or on screen
+    int idle;            // showing a static frame; repeats are not counted
+    MGL_pacing_t pacing;
+
+    // Direct scanout. The frame on screen is only released once the flip
+    // away from it has completed.
+    uint32_t plane_id;
+    drm_fb_t buf[MGL_FRAMES];
+    frame_t *queued; // committed, on screen after the pending flip
+};
+static MGL_layer_t layers[MGL_LAYER_MAX];
+static int layer_num = 0;
+static pthread_mutex_t vram_mtx = PTHREAD_MUTEX_INITIALIZER;
+col_t *vram; // vram of the first layer
+
+// 8bpp colors: the 6x6x6 web palette of WEB_RGB(), as with dispmanx
+static uint32_t drm_palette[256];
+
+static uint32_t drm_prop(uint32_t obj, uint32_t type, const char *name) {
+    drmModeObjectProperties *props = drmModeObjectGetProperties(drm.fd, obj, type);
+    uint32_t id = 0;
+    for (uint32_t i = 0; props && i < props->count_props && !id; i++) {
+        drmModePropertyRes *prop = drmModeGetProperty(drm.fd, props->props[i]);
+        if (prop && strcmp(prop->name, name) == 0) {
+            id = prop->prop_id;
+        }
+        drmModeFreeProperty(prop);
+    }
+    drmModeFreeObjectProperties(props);
+    return id;
+}
+
+static uint64_t drm_prop_value(uint32_t obj, uint32_t type, const char *name) {
+    drmModeObjectProperties *props = drmModeObjectGetProperties(drm.fd, obj, type);
+    uint64_t value = 0;
+    for (uint32_t i = 0; props && i < props->count_props; i++) {
+        drmModePropertyRes *prop = drmModeGetProperty(drm.fd, props->props[i]);
+        if (prop && strcmp(prop->name, name) == 0) {
+            value = props->prop_values[i];
+        }
+        drmModeFreeProperty(prop);
+    }
+    drmModeFreeObjectProperties(props);
+    return value;
+}
+
+//--------------------------------------------------------------------------------
+// Find a connected output: connector, CRTC and the primary plane of the CRTC
+//--------------------------------------------------------------------------------
+static int drm_find_output() {
+    drmModeRes *res = drmModeGetResources(drm.fd);
+    if (!res) {
+        return -1;
+    }
+
+    for (int i = 0; i < res->count_connectors && !drm.conn; i++) {
+        drmModeConnector *conn = drmModeGetConnector(drm.fd, res->connectors[i]);
+        if (!conn || conn->connection != DRM_MODE_CONNECTED || conn->count_modes == 0) {
+            drmModeFreeConnector(conn);
+            continue;
+        }
+
+        uint32_t encoder_id = conn->encoder_id ? conn->encoder_id : (conn->count_encoders ? conn->encoders[0] : 0);
+        drmModeEncoder *enc = drmModeGetEncoder(drm.fd, encoder_id);
+        if (!enc) {
+            drmModeFreeConnector(conn);
+            continue;
+        }
+        for (int c = 0; c < res->count_crtcs; c++) {
+            if ((enc->crtc_id && res->crtcs[c] == enc->crtc_id) || (!enc->crtc_id && (enc->possible_crtcs & (1 << c)))) {
+                drm.crtc_id = res->crtcs[c];
+                drm.crtc_index = c;
+                break;
+            }
+        }
+        drmModeFreeEncoder(enc);
+        if (!drm.crtc_id) {
+            drmModeFreeConnector(conn);
+            continue;
+        }
+
+        // Preferred mode, or the first one
+        drm.mode = conn->modes[0];
+        for (int m = 0; m < conn->count_modes; m++) {
+            if (conn->modes[m].type & DRM_MODE_TYPE_PREFERRED) {
+                drm.mode = conn->modes[m];
+                break;
+            }
+        }
+        drm.conn = conn;
+    }
+    drmModeFreeResources(res);
+    if (!drm.conn) {
+        return -1;
+    }
+
+    drm.plane_num = 1;
+    drmModePlaneRes *planes = drmModeGetPlaneResources(drm.fd);
+    for (uint32_t i = 0; planes && i < planes->count_planes; i++) {
+        drmModePlane *plane = drmModeGetPlane(drm.fd, planes->planes[i]);
+        if (plane && (plane->possible_crtcs & (1 << drm.crtc_index))) {
+            uint64_t type = drm_prop_value(plane->plane_id, DRM_MODE_OBJECT_PLANE, "type");
+            if (type == DRM_PLANE_TYPE_PRIMARY && !drm.plane_id) {
+                drm.plane_id = drm.planes[0] = plane->plane_id;
+            } else if (type == DRM_PLANE_TYPE_OVERLAY && drm.plane_num < MGL_LAYER_MAX + 1) {
+                drm.planes[drm.plane_num++] = plane->plane_id;
+            }
+        }
+        drmModeFreePlane(plane);
+    }
+    drmModeFreePlaneResources(planes);
+    if (!drm.plane_id) {
+        return -1;
+    }
+
+    drm.conn_crtc_id = drm_prop(drm.conn->connector_id, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID");
+    drm.crtc_mode_id = drm_prop(drm.crtc_id, DRM_MODE_OBJECT_CRTC, "MODE_ID");
+    drm.crtc_active = drm_prop(drm.crtc_id, DRM_MODE_OBJECT_CRTC, "ACTIVE");
+    drm.plane_fb_id = drm_prop(drm.plane_id, DRM_MODE_OBJECT_PLANE, "FB_ID");
+    drm.plane_crtc_id = drm_prop(drm.plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_ID");
+    drm.plane_src_x = drm_prop(drm.plane_id, DRM_MODE_OBJECT_PLANE, "SRC_X");
+    drm.plane_src_y = drm_prop(drm.plane_id, DRM_MODE_OBJECT_PLANE, "SRC_Y");
+    drm.plane_src_w = drm_prop(drm.plane_id, DRM_MODE_OBJECT_PLANE, "SRC_W");
+    drm.plane_src_h = drm_prop(drm.plane_id, DRM_MODE_OBJECT_PLANE, "SRC_H");
+    drm.plane_crtc_x = drm_prop(drm.plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_X");
+    drm.plane_crtc_y = drm_prop(drm.plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_Y");
+    drm.plane_crtc_w = drm_prop(drm.plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_W");
+    drm.plane_crtc_h = drm_prop(drm.plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_H");
+    return 0;
+}
+
+// Open the first card with atomic modesetting and a connected output
+static int drm_open() {
+    for (int i = 0; i < DRM_CARD_MAX; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/dev/dri/card%d", i);
+        drm.fd = open(path, O_RDWR | O_CLOEXEC);
+        if (drm.fd < 0) {
+            continue;
+        }
+        if (drmSetClientCap(drm.fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) == 0 && drmSetClientCap(drm.fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0 &&
+            drm_find_output() == 0) {
+            printf("DRM: Using %s (connector %u, crtc %u, plane %u)\n", path, drm.conn->connector_id, drm.crtc_id, drm.plane_id);
+            return 0;
+        }
+        if (drm.conn) {
+            drmModeFreeConnector(drm.conn);
+            drm.conn = NULL;
+        }
+        drm.crtc_id = drm.plane_id = 0;
+        close(drm.fd);
+        drm.fd = -1;
+    }
+    fprintf(stderr, "DRM: No card with atomic modesetting and a connected display.\n");
+    return -1;
+}
+
+static int drm_fb_create(drm_fb_t *fb, int w, int h, uint32_t format) {
+    struct drm_mode_create_dumb create = {.width = w, .height = h, .bpp = 32};
+    if (drmIoctl(drm.fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0) {
+        return -1;
+    }
+    fb->handle = create.handle;
+    fb->pitch = create.pitch;
+    fb->size = create.size;
+
+    uint32_t handles[4] = {fb->handle}, pitches[4] = {fb->pitch}, offsets[4] = {0};
+    if (drmModeAddFB2(drm.fd, w, h, format, handles, pitches, offsets, &fb->fb_id, 0) < 0) {
+        return -1;
+    }
+
+    struct drm_mode_map_dumb map = {.handle = fb->handle};
+    if (drmIoctl(drm.fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0) {
+        return -1;
+    }
+    fb->map = mmap(NULL, fb->size, PROT_READ | PROT_WRITE, MAP_SHARED, drm.fd, map.offset);
+    if (fb->map == MAP_FAILED) {
+        fb->map = NULL;
+        return -1;
+    }
+    memset(fb->map, 0, fb->size);
+    return 0;
+}
+
+static void drm_fb_destroy(drm_fb_t *fb) {
+    if (fb->map) {
+        munmap(fb->map, fb->size);
+    }
+    if (fb->fb_id) {
+        drmModeRmFB(drm.fd, fb->fb_id);
+    }
+    if (fb->handle) {
+        struct drm_mode_destroy_dumb destroy = {.handle = fb->handle};
+        drmIoctl(drm.fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+    }
+    memset(fb, 0, sizeof(*fb));
+}
+
+// Show fb (w x h) at dst on a plane; a NULL fb disables the plane.
+static void drm_add_plane(drmModeAtomicReq *req, uint32_t plane, drm_fb_t *fb, int w, int h, const drm_rect_t *dst) {
+    drmModeAtomicAddProperty(req, plane, drm.plane_fb_id, fb ? fb->fb_id : 0);
+    drmModeAtomicAddProperty(req, plane, drm.plane_crtc_id, fb ? drm.crtc_id : 0);
+    if (!fb) {
+        return;
+    }
+    drmModeAtomicAddProperty(req, plane, drm.plane_src_x, 0);
+    drmModeAtomicAddProperty(req, plane, drm.plane_src_y, 0);
+    drmModeAtomicAddProperty(req, plane, drm.plane_src_w, (uint64_t)w << 16);
+    drmModeAtomicAddProperty(req, plane, drm.plane_src_h, (uint64_t)h << 16);
+    drmModeAtomicAddProperty(req, plane, drm.plane_crtc_x, dst->x);
+    drmModeAtomicAddProperty(req, plane, drm.plane_crtc_y, dst->y);
+    drmModeAtomicAddProperty(req, plane, drm.plane_crtc_w, dst->width);
+    drmModeAtomicAddProperty(req, plane, drm.plane_crtc_h, dst->height);
+}
+
+// Dumb buffer of a direct scanout layer frame
+static drm_fb_t *drm_layer_fb(MGL_layer_t *l, frame_t *f) {
+    return &l->buf[f - l->pool.frames];
+}
+
+//--------------------------------------------------------------------------------
+// Atomic commit of the planes: the composed buffer fb, or with direct scanout
+// the queued (else shown) buffer of each layer and the overlay. With
+// DRM_MODE_ATOMIC_ALLOW_MODESET the mode is set as well.
+//--------------------------------------------------------------------------------
+static int drm_commit(drm_fb_t *fb, uint32_t flags) {
+    drmModeAtomicReq *req = drmModeAtomicAlloc();
+    if (!req) {
+        return -1;
+    }
+    if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
+        drmModeAtomicAddProperty(req, drm.conn->connector_id, drm.conn_crtc_id, drm.crtc_id);
+        drmModeAtomicAddProperty(req, drm.crtc_id, drm.crtc_mode_id, drm.mode_blob);
+        drmModeAtomicAddProperty(req, drm.crtc_id, drm.crtc_active, 1);
+    }
+    if (!drm.direct) {
+        drm_rect_t screen = {0, 0, drm.mode.hdisplay, drm.mode.vdisplay};
+        drm_add_plane(req, drm.plane_id, fb, screen.width, screen.height, &screen);
+    } else {
+        for (int i = 0; i < layer_num; i++) {
+            MGL_layer_t *l = &layers[i];
+            drm_add_plane(req, l->plane_id, drm_layer_fb(l, l->queued ? l->queued : l->shown), width, height, &l->rect);
+        }
+        drm_rect_t dst = {OVERLAY_X, OVERLAY_Y, drm.osd_w * OVERLAY_SCALE, drm.osd_h * OVERLAY_SCALE};
+        drm_add_plane(req, drm.planes[layer_num], drm.osd_on ? &drm.osd_fb[drm.osd_front] : NULL, drm.osd_w, drm.osd_h, &dst);
+    }
+    int ret = drmModeAtomicCommit(drm.fd, req, flags, NULL);
+    drmModeAtomicFree(req);
+    return ret;
+}
+
+// Set drm.mode (same size as the scanout buffers)
+static int drm_set_mode() {
+    uint32_t old_blob = drm.mode_blob;
+    if (drmModeCreatePropertyBlob(drm.fd, &drm.mode, sizeof(drm.mode), &drm.mode_blob) < 0) {
+        return -1;
+    }
+    int ret = drm_commit(&drm.fb[drm.front], DRM_MODE_ATOMIC_ALLOW_MODESET);
+    if (old_blob) {
+        drmModeDestroyPropertyBlob(drm.fd, old_blob);
+    }
+    return ret;
+}
+
+// Ask for an event on the next vblank
+static void drm_wait_vblank() {
+    drmVBlank vbl;
+    ZEROFILL(vbl);
+    vbl.request.type = DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT | ((drm.crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK);
+    vbl.request.sequence = 1;
+    if (drmWaitVBlank(drm.fd, &vbl) != 0) {
+        perror("DRM: drmWaitVBlank failed");
+    }
+}
+
+//================================================================================
+// Overlay
+//================================================================================
+#include "MGL_overlay.h"
+
+static struct {
+    uint16_t *image; // drawn by MGL_OverlayPrint()
+    uint32_t *argb;  // composed mode: converted by MGL_OverlayFlush(), blended on vblank
+    int width, height;
+    int cols, rows;
+    int shown_flag;
+    int fresh; // direct scanout: a new image in the back plane buffer
+    int dirty; // to be shown on the next vblank
+} overlay;
+
+//--------------------------------------------------------------------------------
+// Create the overlay (hidden) in the top left corner
+//--------------------------------------------------------------------------------
+int MGL_OverlayInit(int cols, int rows) {
+    overlay.cols = cols;
+    overlay.rows = rows;
+    overlay.width = cols * OVERLAY_CHAR_W + 4;
+    overlay.height = rows * OVERLAY_CHAR_H + 4;
+    overlay.image = calloc(overlay.width * overlay.height, sizeof(*overlay.image));
+    if (!overlay.image) {
+        return -1;
+    }
+    if (drm.direct) {
+        // Own plane, scaled by the display
+        for (int i = 0; i < 2; i++) {
+            if (drm_fb_create(&drm.osd_fb[i], overlay.width, overlay.height, DRM_FORMAT_ARGB8888) < 0) {
+                return -1;
+            }
+        }
+        drm.osd_w = overlay.width;
+        drm.osd_h = overlay.height;
+    } else {
+        overlay.argb = calloc(overlay.width * overlay.height, sizeof(*overlay.argb));
+        if (!overlay.argb) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Show or hide; the layers are composed again on the next vblank.
+void MGL_OverlayShow(int show) {
+    pthread_mutex_lock(&vram_mtx);
+    if (overlay.image && overlay.shown_flag != show) {
+        overlay.shown_flag = show;
+        overlay.dirty = 1;
+    }
+    pthread_mutex_unlock(&vram_mtx);
+}
+
+// Draw a text line into the overlay image
+void MGL_OverlayPrint(int row, const char *text) {
+    if (!overlay.image || row >= overlay.rows) {
+        return;
+    }
+    overlay_text(overlay.image, overlay.width, overlay.cols, row, text);
+}
+
+// Convert the overlay image to premultiplied ARGB8888
+static void drm_convert_overlay(uint32_t *dst, int stride) {
+    for (int y = 0; y < overlay.height; y++) {
+        const uint16_t *src = overlay.image + y * overlay.width;
+        for (int x = 0; x < overlay.width; x++) {
+            uint16_t s = src[x];
+            int a = s & 0xf;
+            dst[x] = ((uint32_t)(a * 0x11) << 24) | ((((s >> 12) & 0xf) * a * 0x11 / 15) << 16) | ((((s >> 8) & 0xf) * a * 0x11 / 15) << 8) |
+                     (((s >> 4) & 0xf) * a * 0x11 / 15);
+        }
+        dst += stride;
+    }
+}
+
+// Hand the overlay image over (only when shown). It is converted here, on
+// the caller's thread, once per update: the vblank only blends or flips it.
+void MGL_OverlayFlush() {
+    pthread_mutex_lock(&vram_mtx);
+    if (overlay.image && overlay.shown_flag) {
+        if (drm.direct) {
+            drm_fb_t *fb = &drm.osd_fb[!drm.osd_front];
+            drm_convert_overlay(fb->map, fb->pitch / sizeof(*fb->map));
+            overlay.fresh = 1;
+        } else {
+            drm_convert_overlay(overlay.argb, overlay.width);
+        }
+        overlay.dirty = 1;
+    }
+    pthread_mutex_unlock(&vram_mtx);
+}
+
+// Blend the overlay into the scanout buffer, OVERLAY_SCALE x OVERLAY_SCALE
+static void drm_compose_overlay(drm_fb_t *fb) {
+    int stride = fb->pitch / sizeof(*fb->map);
+    int w = MIN(overlay.width * OVERLAY_SCALE, drm.mode.hdisplay - OVERLAY_X);
+    int h = MIN(overlay.height * OVERLAY_SCALE, drm.mode.vdisplay - OVERLAY_Y);
+    for (int y = 0; y < h; y++) {
+        const uint32_t *src = overlay.argb + (y / OVERLAY_SCALE) * overlay.width;
+        uint32_t *dst = fb->map + (OVERLAY_Y + y) * stride + OVERLAY_X;
+        for (int x = 0; x < w; x++) {
+            uint32_t s = src[x / OVERLAY_SCALE];
+            uint32_t d = dst[x];
+            uint32_t na = 255 - (s >> 24); // premultiplied: out = s + d * (1 - a)
+            na += na >> 7;                 // 0..256, so that a transparent dot keeps d
+            dst[x] = (s & 0xffffff) + ((((d & 0xff00ff) * na) >> 8) & 0xff00ff) + ((((d & 0x00ff00) * na) >> 8) & 0x00ff00);
+        }
+    }
+}
+
+//================================================================================
+// Renderer
+//================================================================================
+// Scale a layer into its screen rectangle (nearest neighbour)
+static void drm_compose_layer(drm_fb_t *fb, MGL_layer_t *l) {
+    int stride = fb->pitch / sizeof(*fb->map);
+    const col_t *last_src = NULL;
+    uint32_t *last_dst = NULL;
+    for (int y = 0; y < l->rect.height; y++) {
+        const col_t *src = (col_t *)l->shown->data + (y * height / l->dst_height) * width;
+        uint32_t *dst = fb->map + (l->rect.y + y) * stride + l->rect.x;
+        if (src == last_src) {
+            // Same source line (vertical scaling): copy the converted one
+            memcpy(dst, last_dst, l->rect.width * sizeof(*dst));
+            continue;
+        }
+        for (int x = 0; x < l->rect.width; x++) {
+            dst[x] = l->palette[src[l->xmap[x]]];
+        }
+        last_src = src;
+        last_dst = dst;
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Direct scanout: flip the planes to the queued layer buffers (and a new
+// overlay image). Nothing is copied.
+//--------------------------------------------------------------------------------
+static void drm_vsync_direct(int overlay_dirty) {
+    int osd_front = drm.osd_front, osd_on = drm.osd_on;
+    if (overlay_dirty) {
+        pthread_mutex_lock(&vram_mtx);
+        drm.osd_on = overlay.shown_flag;
+        if (drm.osd_on && overlay.fresh) {
+            drm.osd_front = !drm.osd_front;
+            overlay.fresh = 0;
+        }
+        pthread_mutex_unlock(&vram_mtx);
+    }
+
+    if (drm_commit(NULL, DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK) < 0) {
+        perror("DRM: Page flip failed");
+        pthread_mutex_lock(&vram_mtx);
+        for (int i = 0; i < layer_num; i++) {
+            MGL_layer_t *l = &layers[i];
+            if (l->queued) {
+                frame_release(l->queued);
+                l->queued = NULL;
+            }
+        }
+        pthread_mutex_unlock(&vram_mtx);
+        drm.osd_front = osd_front;
+        drm.osd_on = osd_on;
+        drm_wait_vblank();
+        return;
+    }
+    drm.flip_first = !layers[0].pacing.first_us && layers[0].queued && !layers[0].idle;
+}
+
+//--------------------------------------------------------------------------------
+// Every vblank (or page flip): take the latest presented frames and, if any
+// is new, compose them into the back buffer and flip to it on the next vblank.
+//--------------------------------------------------------------------------------
+static void drm_vsync() {
+    int64_t now = timemicros();
+    int pending[MGL_LAYER_MAX];
+    int updated = 0;
+
+    // Take the frame of each layer that is due, if any
+    pthread_mutex_lock(&vram_mtx);
+    for (int i = 0; i < layer_num; i++) {
+        MGL_layer_t *l = &layers[i];
+        int dropped;
+        frame_t *f = frame_pacer_take(&l->pacer, now, &dropped);
+        pending[i] = (f != NULL);
+        l->pacing.dropped += dropped;
+        if (pending[i] && drm.direct) {
+            l->queued = f; // flip to it
+        } else if (pending[i]) {
+            frame_release(l->shown);
+            l->shown = f;
+        }
+        if (pending[i]) {
+            updated++;
+        } else if (!l->idle) {
+            l->pacing.repeated++;
+        }
+        if (!l->pacing.rate_vsyncs++) {
+            l->pacing.rate_us = now;
+        }
+        l->pacing.vsyncs++;
+        l->pacing.last_us = now;
+    }
+    int overlay_dirty = overlay.dirty;
+    overlay.dirty = 0;
+    int mode_change = drm.mode_change;
+    drm.mode_change = 0;
+    pthread_mutex_unlock(&vram_mtx);
+
+    if (mode_change) {
+        drm.mode = drm.next_mode;
+        if (drm_set_mode() < 0) {
+            perror("DRM: Mode change failed");
+        }
+    }
+
+    // Nothing new to show; the scanout buffer still holds the previous frames.
+    if (!updated && !overlay_dirty) {
+        drm_wait_vblank();
+        return;
+    }
+
+    if (drm.direct) {
+        drm_vsync_direct(overlay_dirty);
+        return;
+    }
+
+    PROF_BEGIN(t);
+    drm_fb_t *fb = &drm.fb[!drm.front];
+    if (fb->overlay) {
+        // Clear what the overlay covered; the layers are drawn over it again.
+        int stride = fb->pitch / sizeof(*fb->map);
+        for (int y = 0; y < MIN(overlay.height * OVERLAY_SCALE, drm.mode.vdisplay - OVERLAY_Y); y++) {
+            memset(fb->map + (OVERLAY_Y + y) * stride + OVERLAY_X, 0, MIN(overlay.width * OVERLAY_SCALE, drm.mode.hdisplay - OVERLAY_X) * 4);
+        }
+        fb->overlay = 0;
+    }
+    for (int i = 0; i < layer_num; i++) {
+        drm_compose_layer(fb, &layers[i]);
+    }
+    pthread_mutex_lock(&vram_mtx);
+    for (int i = 0; i < layer_num; i++) {
+        layers[i].pacing.copied += (uint64_t)layers[i].rect.width * layers[i].rect.height * sizeof(*fb->map);
+    }
+    if (overlay.shown_flag) {
+        drm_compose_overlay(fb);
+        fb->overlay = 1;
+    }
+    pthread_mutex_unlock(&vram_mtx);
+    PROF_END(t, PROF_UPLOAD);
+
+    if (drm_commit(fb, DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK) < 0) {
+        perror("DRM: Page flip failed");
+        drm_wait_vblank();
+        return;
+    }
+    drm.front = !drm.front;
+    drm.flip_first = !layers[0].pacing.first_us && pending[0] && !layers[0].idle;
+}
+
+static void drm_vblank_handler(int fd, unsigned int seq, unsigned int sec, unsigned int usec, void *data) { drm_vsync(); }
+
+static void drm_page_flip_handler(int fd, unsigned int seq, unsigned int sec, unsigned int usec, void *data) {
+    if (drm.direct) {
+        // The frames flipped away from are free now
+        pthread_mutex_lock(&vram_mtx);
+        for (int i = 0; i < layer_num; i++) {
+            MGL_layer_t *l = &layers[i];
+            if (l->queued) {
+                frame_release(l->shown);
+                l->shown = l->queued;
+                l->queued = NULL;
+            }
+        }
+        pthread_mutex_unlock(&vram_mtx);
+    }
+    if (drm.flip_first) {
+        layers[0].pacing.first_us = timemicros();
+        drm.flip_first = 0;
+    }
+    drm_vsync();
+}
+
+// Event thread: one vblank or page-flip event is outstanding at any time
+static void *drm_run(void *arg) {
+    drmEventContext ev;
+    ZEROFILL(ev);
+    ev.version = 2;
+    ev.vblank_handler = drm_vblank_handler;
+    ev.page_flip_handler = drm_page_flip_handler;
+
+    drm_wait_vblank();
+    while (drm.run) {
+        struct pollfd pfd = {drm.fd, POLLIN, 0};
+        if (poll(&pfd, 1, 100) > 0) {
+            drmHandleEvent(drm.fd, &ev);
+        }
+    }
+    return NULL;
+}
+
+//--------------------------------------------------------------------------------
+// Hand the finished vram over to the display and the subscribers, and continue
+// with a free frame. The pacer decides on which vblank it is shown. If the
+// subscribers hold all the other frames, the oldest queued frame that nobody
+// else holds is drawn over instead, or else the frame is not presented and the
+// application draws over it again.
+//--------------------------------------------------------------------------------
+void MGL_PresentLayer(MGL_layer_t *l) {
+    pthread_mutex_lock(&vram_mtx);
+    frame_t *next = frame_pool_get(&l->pool);
+    if (next == NULL && (next = frame_pacer_reclaim(&l->pacer)) != NULL) {
+        l->pacing.dropped++; // not shown yet and it will not be: reuse it
+    }
+    if (next == NULL) {
+        pthread_mutex_unlock(&vram_mtx);
+        return;
+    }
+    frame_t *done = l->frame;
+    frame_ref(done); // published below, outside the lock
+    l->pacing.dropped += frame_pacer_push(&l->pacer, done, timemicros());
+    l->frame = next;
+    l->vram = (col_t *)next->data;
+    l->pacing.presented++;
+    if (l == &layers[0]) {
+        vram = l->vram;
+    }
+    pthread_mutex_unlock(&vram_mtx);
+
+    frame_pool_publish(&l->pool, done);
+    frame_release(done);
+}
+
+// Frames of the layer, e.g. to subscribe to them
+frame_pool_t *MGL_LayerPool(MGL_layer_t *l) { return &l->pool; }
+
+void MGL_Present() { MGL_PresentLayer(&layers[0]); }
+
+// Mark the layer as showing a static frame (e.g. "no signal")
+void MGL_SetLayerIdle(MGL_layer_t *l, int idle) {
+    pthread_mutex_lock(&vram_mtx);
+    l->idle = idle;
+    pthread_mutex_unlock(&vram_mtx);
+}
+
+// Pixel value of an 8bpp color in the vram of the layer
+uint32_t MGL_LayerColor(MGL_layer_t *l, uint8_t c) { return (l->bpp == 4) ? drm_palette[c] : c; }
+
+//--------------------------------------------------------------------------------
+// Show byte i of the layer as 8bpp color map[i], e.g. to display raw samples
+// as they are. Only when composing; direct scanout layers are XRGB8888.
+//--------------------------------------------------------------------------------
+int MGL_SetLayerPalette(MGL_layer_t *l, const uint8_t map[256]) {
+    if (drm.direct) {
+        return -1;
+    }
+    uint32_t *palette = malloc(sizeof(*palette) * 256);
+    if (!palette) {
+        return -1;
+    }
+    for (int i = 0; i < 256; i++) {
+        palette[i] = drm_palette[map[i]];
+    }
+    pthread_mutex_lock(&vram_mtx);
+    if (l->palette != drm_palette) {
+        free(l->palette);
+    }
+    l->palette = palette;
+    pthread_mutex_unlock(&vram_mtx);
+    return 0;
+}
+
+// Pacing of the first layer
+void MGL_GetPacing(MGL_pacing_t *p) {
+    pthread_mutex_lock(&vram_mtx);
+    *p = layers[0].pacing;
+    p->exhausted = __atomic_load_n(&layers[0].pool.exhausted, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&vram_mtx);
+}
+
+// Restart the display refresh measurement (e.g. after a mode or clock change)
+void MGL_ResetDisplayRate() {
+    pthread_mutex_lock(&vram_mtx);
+    for (int i = 0; i < layer_num; i++) {
+        layers[i].pacing.rate_vsyncs = 0;
+    }
+    pthread_mutex_unlock(&vram_mtx);
+}
+
+//================================================================================
+// Initializer
+//================================================================================
+//--------------------------------------------------------------------------------
+// Add a layer before MGL_Start(). Layers are drawn in the order they are
+// added. Without any, MGL_Start() adds one full-screen layer.
+//--------------------------------------------------------------------------------
+MGL_layer_t *MGL_AddLayer(int x, int y, int w, int h) {
+    if (layer_num >= MGL_LAYER_MAX) {
+        return NULL;
+    }
+    MGL_layer_t *l = &layers[layer_num++];
+    memset(l, 0, sizeof(*l));
+    l->place = (drm_rect_t){x, y, w, h};
+    return l;
+}
+
+// Screen rectangle of a layer for the current mode. Layers without a
+// placement share the screen side by side.
+static void drm_layout(MGL_layer_t *l, int index) {
+    int screen_w = drm.mode.hdisplay, screen_h = drm.mode.vdisplay;
+    if (l->place.width) {
+        l->rect = l->place;
+    } else {
+        int area_width = screen_w / layer_num;
+        float scale = MIN((float)screen_h / (height * GRP_VSCALE), (float)area_width / width);
+        l->rect.width = width * scale;
+        l->rect.height = height * GRP_VSCALE * scale;
+        l->rect.x = area_width * index + (area_width - l->rect.width) / 2;
+        l->rect.y = (screen_h - l->rect.height) / 2;
+    }
+
+    int dst_width = l->rect.width;
+    l->dst_height = l->rect.height;
+
+    // Clip to the screen
+    l->rect.x = MAX(0, MIN(screen_w - 1, l->rect.x));
+    l->rect.y = MAX(0, MIN(screen_h - 1, l->rect.y));
+    l->rect.width = MIN(l->rect.width, screen_w - l->rect.x);
+    l->rect.height = MIN(l->rect.height, screen_h - l->rect.y);
+
+    free(l->xmap);
+    l->xmap = malloc(sizeof(*l->xmap) * l->rect.width);
+    assert(l->xmap);
+    for (int x = 0; x < l->rect.width; x++) {
+        l->xmap[x] = x * width / dst_width;
+    }
+    printf("DRM: layer %d dst=(%d,%d)[%d,%d]\n", index, l->rect.x, l->rect.y, l->rect.width, l->rect.height);
+}
+
+//--------------------------------------------------------------------------------
+// Direct scanout: the frames of each layer are XRGB8888 dumb buffers, each layer on its own
+// plane scaled to its rectangle, plus a plane for the overlay. A test commit
+// tells whether the driver can do it.
+//--------------------------------------------------------------------------------
+static int drm_direct_init() {
+    if (getenv("MGL_DRM_COMPOSE") || drm.plane_num < layer_num + 1) {
+        return -1;
+    }
+
+    drm.direct = 1;
+    for (int i = 0; i < layer_num && drm.direct; i++) {
+        MGL_layer_t *l = &layers[i];
+        l->plane_id = drm.planes[i];
+        uint8_t *maps[MGL_FRAMES];
+        for (int b = 0; b < MGL_FRAMES; b++) {
+            if (drm_fb_create(&l->buf[b], width, height, DRM_FORMAT_XRGB8888) < 0) {
+                drm.direct = 0;
+                break;
+            }
+            maps[b] = (uint8_t *)l->buf[b].map;
+        }
+        if (!drm.direct) {
+            break;
+        }
+        l->bpp = 4;
+        l->pitch = l->buf[0].pitch;
+        frame_pool_init(&l->pool, MGL_FRAMES, (size_t)l->pitch * height, maps);
+        l->shown = frame_pool_get(&l->pool);
+        l->frame = frame_pool_get(&l->pool);
+        l->vram = (col_t *)l->frame->data;
+    }
+    if (drm.direct && drm_commit(NULL, DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET) == 0) {
+        return 0;
+    }
+
+    drm.direct = 0;
+    for (int i = 0; i < layer_num; i++) {
+        MGL_layer_t *l = &layers[i];
+        for (int b = 0; b < MGL_FRAMES; b++) {
+            drm_fb_destroy(&l->buf[b]);
+        }
+        frame_pool_free(&l->pool);
+        l->plane_id = 0;
+        l->frame = l->shown = NULL;
+        l->vram = NULL;
+    }
+    return -1;
+}
+
+int MGL_drm_Init() {
+    if (layer_num == 0) {
+        MGL_AddLayer(0, 0, 0, 0);
+    }
+
+    for (int i = 0; i < 6 * 6 * 6; i++) {
+        drm_palette[i] = ((i / 36) * 51 << 16) | ((i / 6 % 6) * 51 << 8) | (i % 6) * 51;
+    }
+
+    if (drm_open() < 0) {
+        return -1;
+    }
+    printf("DRM: Display is %d x %d @ %d Hz\n", drm.mode.hdisplay, drm.mode.vdisplay, drm.mode.vrefresh);
+
+    for (int i = 0; i < layer_num; i++) {
+        drm_layout(&layers[i], i);
+    }
+    if (drmModeCreatePropertyBlob(drm.fd, &drm.mode, sizeof(drm.mode), &drm.mode_blob) < 0) {
+        perror("DRM: Cannot create mode blob");
+        return -1;
+    }
+
+    if (drm_direct_init() == 0) {
+        puts("DRM: Direct scanout (a scaled plane per layer).");
+    } else {
+        puts("DRM: Composing the layers into one buffer.");
+
+        // Make VRAM
+        int vram_size_n = GRP_W * GRP_H;
+        for (int i = 0; i < layer_num; i++) {
+            MGL_layer_t *l = &layers[i];
+            l->palette = drm_palette;
+            l->bpp = sizeof(*vram);
+            l->pitch = width * sizeof(*vram);
+            if (frame_pool_init(&l->pool, MGL_FRAMES, sizeof(*vram) * vram_size_n, NULL) < 0) {
+                fprintf(stderr, "MGL: Cannot allocate vram (%zubytes x %d)\n", sizeof(*vram) * vram_size_n, MGL_FRAMES);
+                return -1;
+            }
+            l->shown = frame_pool_get(&l->pool);
+            l->frame = frame_pool_get(&l->pool);
+            l->vram = (col_t *)l->frame->data;
+        }
+
+        for (int i = 0; i < 2; i++) {
+            if (drm_fb_create(&drm.fb[i], drm.mode.hdisplay, drm.mode.vdisplay, DRM_FORMAT_XRGB8888) < 0) {
+                perror("DRM: Cannot create dumb buffer");
+                return -1;
+            }
+        }
+    }
+    vram = layers[0].vram;
+
+    drm.front = 0;
+    if (drm_set_mode() < 0) {
+        perror("DRM: Modeset failed");
+        return -1;
+    }
+
+    drm.run = 1;
+    if (pthread_create(&drm.th, NULL, drm_run, NULL) != 0) {
+        perror("DRM: Failed to start event thread");
+        return -1;
+    }
+    return 0;
+}
+
+//================================================================================
+// Display refresh rate
+//================================================================================
+// Unlike the firmware's hdmi_adjust_clock, a KMS clock change is a full
+// modeset (the display may blank), so small errors are left to frame pacing.
+#define KMS_CLOCK_TUNE_MAX 0.01    // max. deviation from the nominal pixel clock (+-1%)
+#define KMS_CLOCK_TUNE_MIN 0.0002  // closer than this (200ppm) counts as locked
+#define KMS_RATE_WINDOW_US 5000000 // min. display refresh measurement window
+static int kms_clock_nominal = 0;  // pixel clock (kHz) of the mode as selected
+
+static double kms_mode_hz(const drmModeModeInfo *m) { return m->clock * 1000.0 / (m->htotal * m->vtotal); }
+
+// Set a mode on the next vblank (from the event thread)
+static void kms_request_mode(const drmModeModeInfo *m) {
+    pthread_mutex_lock(&vram_mtx);
+    drm.next_mode = *m;
+    drm.mode_change = 1;
+    pthread_mutex_unlock(&vram_mtx);
+}
+
+// Switch to the mode of the current resolution whose refresh is closest to hz.
+// Returns 1 if the mode was changed.
+static int kms_select_mode(float hz) {
+    const drmModeModeInfo *best = NULL;
+    double best_d = fabs(kms_mode_hz(&drm.mode) - hz);
+    for (int i = 0; i < drm.conn->count_modes; i++) {
+        const drmModeModeInfo *m = &drm.conn->modes[i];
+        if (m->hdisplay != drm.mode.hdisplay || m->vdisplay != drm.mode.vdisplay || (m->flags & DRM_MODE_FLAG_INTERLACE)) {
+            continue;
+        }
+        double d = fabs(kms_mode_hz(m) - hz);
+        if (d < best_d) {
+            best_d = d;
+            best = m;
+        }
+    }
+    if (!best) {
+        return 0;
+    }
+
+    printf("KMS: Switching to mode %s (%dx%d@%.3fHz)\n", best->name, best->hdisplay, best->vdisplay, kms_mode_hz(best));
+    kms_request_mode(best);
+    return 1;
+}
+
+//--------------------------------------------------------------------------------
+// Bring the display refresh to hz: optionally pick the closest mode, then
+// tune the pixel clock of a user mode within KMS_CLOCK_TUNE_MAX of the nominal
+// clock. Returns 1 if something was changed (call again after a new
+// measurement), 0 if locked or still measuring, and -1 if hz cannot be reached.
+//--------------------------------------------------------------------------------
+int MGL_SetRefresh(float hz, int allow_mode_change) {
+    if (allow_mode_change && kms_select_mode(hz) > 0) {
+        kms_clock_nominal = 0;
+        MGL_ResetDisplayRate();
+        return 1;
+    }
+
+    MGL_pacing_t p;
+    MGL_GetPacing(&p);
+    if (p.rate_vsyncs < 2 || p.last_us - p.rate_us < KMS_RATE_WINDOW_US) {
+        return 0;
+    }
+    double display_hz = (p.rate_vsyncs - 1) * 1000000.0 / (p.last_us - p.rate_us);
+
+    drmModeModeInfo m = drm.mode;
+    if (!kms_clock_nominal) {
+        kms_clock_nominal = m.clock;
+    }
+    double target = m.clock * hz / display_hz;
+    if (fabs(target / kms_clock_nominal - 1.0) > KMS_CLOCK_TUNE_MAX) {
+        return -1;
+    }
+    if (fabs(target / m.clock - 1.0) < KMS_CLOCK_TUNE_MIN) {
+        return 0;
+    }
+
+    m.clock = lround(target);
+    m.vrefresh = lround(kms_mode_hz(&m));
+    m.type = DRM_MODE_TYPE_USERDEF;
+    snprintf(m.name, sizeof(m.name), "%dx%d@%.3f", m.hdisplay, m.vdisplay, kms_mode_hz(&m));
+    printf("KMS: Pixel clock %d -> %d kHz (display %.3f Hz, target %.3f Hz)\n", drm.mode.clock, m.clock, display_hz, hz);
+    kms_request_mode(&m);
+    MGL_ResetDisplayRate();
+    return 1;
+}
+
+// Pace the frames of the layer to a source of src_hz that the display is not
+// locked to (see frame_pacer.h), at the display refresh measured since
+// MGL_ResetDisplayRate(). 0, or a display refresh measured for less than
+// KMS_RATE_WINDOW_US, shows the latest frame on each vblank. Call again with
+// every new measurement.
+void MGL_SetLayerPacing(MGL_layer_t *l, double src_hz) {
+    pthread_mutex_lock(&vram_mtx);
+    MGL_pacing_t *p = &l->pacing;
+    int measured = (p->rate_vsyncs > 1 && p->last_us - p->rate_us >= KMS_RATE_WINDOW_US);
+    double disp_hz = measured ? (p->rate_vsyncs - 1) * 1000000.0 / (p->last_us - p->rate_us) : 0;
+    frame_pacer_set(&l->pacer, src_hz, disp_hz);
+    pthread_mutex_unlock(&vram_mtx);
+}
+
+//================================================================================
+// graphics
+//================================================================================
+#define WEB_RGB(r, g, b) ((MAX(0, MIN(5, r)) * 6 + MAX(0, MIN(5, g))) * 6 + MAX(0, MIN(5, b)))
+
+void gfill(int x1, int y1, int x2, int y2, col_t c) {
+    x1 = MIN(DW - 1, MAX(0, x1));
+    x2 = MIN(DW - 1, MAX(0, x2));
+    y1 = MIN(DH - 1, MAX(0, y1));
+    y2 = MIN(DH - 1, MAX(0, y2));
+
+    for (int y = y1; y <= y2; y++) {
+        col_t *p = &vram[y * DW + x1];
+        for (int x = x1; x <= x2; x++) {
+            *p++ = c;
+        }
+    }
+}
+
+// Clear the vram of a layer
+void gclear(MGL_layer_t *l) { memset(l->vram, 0, l->pitch * height); }
+
+//================================================================================
+// MGL
+//================================================================================
+int MGL_Init() {
+    if (MGL_drm_Init() < 0) {
+        perror("MGL: Failed to init DRM.");
+        return -1;
+    }
+
+    return 0;
+}
+
+//--------------------------------------------------------------------------------
+// Signal handler
+//--------------------------------------------------------------------------------
+void sigintHandler(int sig) {
+    finalize();
+}
+
+//--------------------------------------------------------------------------------
+// Finalizer
+//--------------------------------------------------------------------------------
+void MGL_Quit() {
+    if (drm.run) {
+        drm.run = 0;
+        pthread_join(drm.th, NULL);
+    }
+
+    if (drm.fd >= 0) {
+        for (int i = 0; i < 2; i++) {
+            drm_fb_destroy(&drm.fb[i]);
+            drm_fb_destroy(&drm.osd_fb[i]);
+        }
+        for (int i = 0; i < layer_num; i++) {
+            for (int b = 0; b < MGL_FRAMES; b++) {
+                drm_fb_destroy(&layers[i].buf[b]);
+            }
+        }
+        if (drm.mode_blob) {
+            drmModeDestroyPropertyBlob(drm.fd, drm.mode_blob);
+        }
+        drmModeFreeConnector(drm.conn);
+        close(drm.fd);
+    }
+    free(overlay.image);
+    free(overlay.argb);
+
+    // Release vram (the pool does not own the mapped dumb buffers of direct scanout)
+    for (int i = 0; i < layer_num; i++) {
+        frame_pool_free(&layers[i].pool);
+        free(layers[i].xmap);
+        if (layers[i].palette != drm_palette) {
+            free(layers[i].palette);
+        }
+    }
+
+    puts("MGL: Quit");
+}
+
+//--------------------------------------------------------------------------------
+// Startup
+//--------------------------------------------------------------------------------
+int MGL_Start() {
+    // Adding signal handler
+    puts("MGL: Adding signal handler.");
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigintHandler;
+    if (sigaction(SIGINT, &sa, NULL) < 0) {
+        perror("MGL: Failed to add signal handler.");
+        return 1;
+    }
+
+    if (MGL_Init() < 0) {
+        perror("MGL: Failed to initialize.");
+        exit(1);
+    }
+
+    puts("MGL: Initialized.\n");
+    return 0;
+}
+
+#endif // MGL_IMPLEMENTATION
@@ -0,0 +1,94 @@
+//
+// Text drawing shared by the MGL backends: the 5x7 font, text rows of the
+// statistics overlay (RGBA4444 image) and text in the vram of a layer.
+//
+// Included by MGL_dispmanx.h and MGL_drm.h once MGL_layer_t and
+// MGL_LayerColor() are declared.
+//
+#ifndef __MGL_OVERLAY_H_
+#define __MGL_OVERLAY_H_
+
+#include <ctype.h>
+#include <stdint.h>
+
+#define OVERLAY_CHAR_W 6
+#define OVERLAY_CHAR_H 9
+#define OVERLAY_FG 0xffff // RGBA4444: white, opaque
+#define OVERLAY_BG 0x000a // RGBA4444: black, translucent
+
+// 5x7 font for ' '..'_' (lower case is shown as upper case), one byte per
+// column, LSB is the top row.
+static const uint8_t overlay_font[64][5] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00}, {0x00, 0x00, 0x5f, 0x00, 0x00}, {0x00, 0x07, 0x00, 0x07, 0x00}, {0x14, 0x7f, 0x14, 0x7f, 0x14},
+    {0x24, 0x2a, 0x7f, 0x2a, 0x12}, {0x23, 0x13, 0x08, 0x64, 0x62}, {0x36, 0x49, 0x56, 0x20, 0x50}, {0x00, 0x05, 0x03, 0x00, 0x00},
+    {0x00, 0x1c, 0x22, 0x41, 0x00}, {0x00, 0x41, 0x22, 0x1c, 0x00}, {0x2a, 0x1c, 0x7f, 0x1c, 0x2a}, {0x08, 0x08, 0x3e, 0x08, 0x08},
+    {0x00, 0x50, 0x30, 0x00, 0x00}, {0x08, 0x08, 0x08, 0x08, 0x08}, {0x00, 0x60, 0x60, 0x00, 0x00}, {0x20, 0x10, 0x08, 0x04, 0x02},
+    {0x3e, 0x51, 0x49, 0x45, 0x3e}, {0x00, 0x42, 0x7f, 0x40, 0x00}, {0x42, 0x61, 0x51, 0x49, 0x46}, {0x21, 0x41, 0x45, 0x4b, 0x31},
+    {0x18, 0x14, 0x12, 0x7f, 0x10}, {0x27, 0x45, 0x45, 0x45, 0x39}, {0x3c, 0x4a, 0x49, 0x49, 0x30}, {0x01, 0x71, 0x09, 0x05, 0x03},
+    {0x36, 0x49, 0x49, 0x49, 0x36}, {0x06, 0x49, 0x49, 0x29, 0x1e}, {0x00, 0x36, 0x36, 0x00, 0x00}, {0x00, 0x56, 0x36, 0x00, 0x00},
+    {0x08, 0x14, 0x22, 0x41, 0x00}, {0x14, 0x14, 0x14, 0x14, 0x14}, {0x00, 0x41, 0x22, 0x14, 0x08}, {0x02, 0x01, 0x51, 0x09, 0x06},
+    {0x32, 0x49, 0x79, 0x41, 0x3e}, {0x7e, 0x11, 0x11, 0x11, 0x7e}, {0x7f, 0x49, 0x49, 0x49, 0x36}, {0x3e, 0x41, 0x41, 0x41, 0x22},
+    {0x7f, 0x41, 0x41, 0x22, 0x1c}, {0x7f, 0x49, 0x49, 0x49, 0x41}, {0x7f, 0x09, 0x09, 0x09, 0x01}, {0x3e, 0x41, 0x49, 0x49, 0x7a},
+    {0x7f, 0x08, 0x08, 0x08, 0x7f}, {0x00, 0x41, 0x7f, 0x41, 0x00}, {0x20, 0x40, 0x41, 0x3f, 0x01}, {0x7f, 0x08, 0x14, 0x22, 0x41},
+    {0x7f, 0x40, 0x40, 0x40, 0x40}, {0x7f, 0x02, 0x0c, 0x02, 0x7f}, {0x7f, 0x04, 0x08, 0x10, 0x7f}, {0x3e, 0x41, 0x41, 0x41, 0x3e},
+    {0x7f, 0x09, 0x09, 0x09, 0x06}, {0x3e, 0x41, 0x51, 0x21, 0x5e}, {0x7f, 0x09, 0x19, 0x29, 0x46}, {0x46, 0x49, 0x49, 0x49, 0x31},
+    {0x01, 0x01, 0x7f, 0x01, 0x01}, {0x3f, 0x40, 0x40, 0x40, 0x3f}, {0x1f, 0x20, 0x40, 0x20, 0x1f}, {0x3f, 0x40, 0x38, 0x40, 0x3f},
+    {0x63, 0x14, 0x08, 0x14, 0x63}, {0x07, 0x08, 0x70, 0x08, 0x07}, {0x61, 0x51, 0x49, 0x45, 0x43}, {0x00, 0x7f, 0x41, 0x41, 0x00},
+    {0x02, 0x04, 0x08, 0x10, 0x20}, {0x00, 0x41, 0x41, 0x7f, 0x00}, {0x04, 0x02, 0x01, 0x02, 0x04}, {0x40, 0x40, 0x40, 0x40, 0x40},
+};
+
+// Glyph of a character; '?' for those the font does not have
+static inline const uint8_t *overlay_glyph(char ch) {
+    int c = toupper((unsigned char)ch) - ' ';
+    if (c < 0 || c >= 64) {
+        c = '?' - ' ';
+    }
+    return overlay_font[c];
+}
+
+// Draw a text row into an overlay image (RGBA4444, width pixels per line,
+// a 2 pixel margin), at most cols characters
+static void overlay_text(uint16_t *image, int width, int cols, int row, const char *text) {
+    int y0 = 2 + row * OVERLAY_CHAR_H;
+    for (int y = y0; y < y0 + OVERLAY_CHAR_H; y++) {
+        for (int x = 0; x < width; x++) {
+            image[y * width + x] = OVERLAY_BG;
+        }
+    }
+    for (int i = 0; i < cols && text[i]; i++) {
+        const uint8_t *glyph = overlay_glyph(text[i]);
+        for (int x = 0; x < 5; x++) {
+            for (int y = 0; y < 7; y++) {
+                if (glyph[x] & (1 << y)) {
+                    image[(y0 + 1 + y) * width + 2 + i * OVERLAY_CHAR_W + x] = OVERLAY_FG;
+                }
+            }
+        }
+    }
+}
+
+// Draw text into the vram of a layer with the overlay font, each dot scale x
+// scale pixels
+void gtext(MGL_layer_t *l, int x, int y, int scale, const char *text, col_t c) {
+    uint32_t v = MGL_LayerColor(l, c);
+    for (int i = 0; text[i]; i++) {
+        const uint8_t *glyph = overlay_glyph(text[i]);
+        for (int dx = 0; dx < 5 * scale; dx++) {
+            uint8_t bits = glyph[dx / scale];
+            for (int dy = 0; dy < 7 * scale; dy++) {
+                if (!(bits & (1 << (dy / scale)))) {
+                    continue;
+                }
+                uint8_t *line = l->vram + (y + dy) * l->pitch;
+                int px = x + (i * OVERLAY_CHAR_W * scale) + dx;
+                if (l->bpp == 4) {
+                    ((uint32_t *)line)[px] = v;
+                } else {
+                    line[px] = c;
+                }
+            }
+        }
+    }
+}
+
+#endif // __MGL_OVERLAY_H_
@@ -2,357 +2,1768 @@
 // Digital RGB Display with fx2pipe
 // 27-Mar-2021 by Minatsu (@tksm372)
 //
+#define _GNU_SOURCE
 
 #define SCREEN_WIDTH 1280
 #define SCREEN_HEIGHT 720
-#define DW 640
-#define DH 200
+#include "profile.h"
+#define STAGE_PROF_IMPLEMENTATION
+#include "stage_prof.h"
+#define FRAME_POOL_IMPLEMENTATION
+#include "frame_pool.h"
+#define FRAME_PACER_IMPLEMENTATION
+#include "frame_pacer.h"
 #define MGL_IMPLEMENTATION
+#ifdef MGL_DRM
+#include "MGL_drm.h"
+#else
 #include "MGL_dispmanx.h"
+#endif
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <libusb.h>
 #include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <stdarg.h>
+#define RAW_TAP_IMPLEMENTATION
+#include "raw_tap.h"
+#define RGB_DECODER_IMPLEMENTATION
+#include "rgb_decoder.h"
+#define FX2_USB_IMPLEMENTATION
+#include "fx2_usb.h"
+#define RT_LOG_IMPLEMENTATION
+#include "rt_log.h"
+#include "test_pattern.h"
 
-#define BIT_VSYNC 4
-#define BIT_HSYNC 3
-#define BIT_R 2
-#define BIT_G 1
-#define BIT_B 0
+static int firmware_sel = 0;
 
-// Built-in firmware hex strings.
-static char *firmware[] = {
-#include "firmware/slave_sync_8.inc"
-    NULL};
+//======================================================================
+// Startup timeline
+//======================================================================
+#define TIMELINE_MAX 32
+static struct {
+    char name[48];
+    int64_t us;
+} timeline[TIMELINE_MAX];
+static int timeline_num = 0;
+static pthread_mutex_t timeline_mtx = PTHREAD_MUTEX_INITIALIZER;
 
-#define READ() usb_read()
+void timeline_mark(const char *fmt, ...) {
+    int64_t now = timemicros();
+    pthread_mutex_lock(&timeline_mtx);
+    if (timeline_num < TIMELINE_MAX) {
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(timeline[timeline_num].name, sizeof(timeline[0].name), fmt, ap);
+        va_end(ap);
+        timeline[timeline_num++].us = now;
+    }
+    pthread_mutex_unlock(&timeline_mtx);
+}
+
+// Print the phases in time order, relative to the first mark
+void timeline_report() {
+    pthread_mutex_lock(&timeline_mtx);
+    for (int i = 1; i < timeline_num; i++) {
+        for (int j = i; j > 0 && timeline[j].us < timeline[j - 1].us; j--) {
+            typeof(timeline[0]) tmp = timeline[j];
+            timeline[j] = timeline[j - 1];
+            timeline[j - 1] = tmp;
+        }
+    }
+    puts("\nStartup timeline:");
+    for (int i = 0; i < timeline_num; i++) {
+        printf("  %8.1f ms  %s\n", (timeline[i].us - timeline[0].us) / 1000.0, timeline[i].name);
+    }
+    pthread_mutex_unlock(&timeline_mtx);
+}
 
 //======================================================================
 // USB
 //======================================================================
-#define VID 0x04b4
-#define PID 0x8613
-#define IN_EP (LIBUSB_ENDPOINT_IN | 6)
+#define STAT_EP (LIBUSB_ENDPOINT_IN | 1) // FIFO overflow count from the firmware
+#define STAT_SIZE 64
 #define RX_SIZE (16 * 1024 * 4)
+#ifdef PROFILE_VGA
+#define XFR_NUM 128 // 200 ms at 40 MB/s
+#define RING_ZERO_COPY 1
+#else
 #define XFR_NUM 64
+#define RING_ZERO_COPY 0
+#endif
 #define READ_SIZE (RX_SIZE * XFR_NUM)
-static uint8_t buf[XFR_NUM][RX_SIZE];
-static libusb_device_handle *usb_handle = NULL;
-static struct libusb_transfer *xfr[XFR_NUM];
+#define ISO_PACKET_SIZE (2 * 1024)              // iso_sync_8: two 1024 byte transactions per microframe
+#define ISO_PACKETS (RX_SIZE / ISO_PACKET_SIZE) // microframes per transfer (4ms)
+#define ISO_BCD_DEVICE 0x0100                   // bcdDevice of the renumerated iso_sync_8
+#define RENUM_WAIT_MS 5000
 static volatile int usb_run_flag = 1;
+static volatile int wd_run_flag = 1; // stall watchdog; stopped before the transfers are cancelled
+static volatile int wd_busy = 0;     // the watchdog is recovering a capture
+static int usb_single_thread = 0; // decoder runs in the USB event loop
+#define NOSIGNAL_US 200000           // no transfer completed for this long: no signal (IFCLK stopped)
+
+// What made the stall watchdog recover a capture
+typedef enum { WD_OK, WD_STALL, WD_ERRORS, WD_DRAINED, WD_CAUSES } wd_cause_t;
 
 //----------------------------------------------------------------------
-// USB write RAM
+// Capture pipeline: one FX2 with its transfer pool, decoder and layer
 //----------------------------------------------------------------------
-#define USB_WRITE_RAM_MAX_SIZE 64
-int usb_write_ram(int addr, uint8_t *dat, int size) {
-    assert(usb_handle != NULL);
+#define CAPTURE_MAX MGL_LAYER_MAX
+#define LATENCY_BUCKET_US 250
+#define LATENCY_BUCKETS 256 // the last one collects everything above
+typedef struct {
+    int index;
+    char *path;      // bus-port path ("1-1.3"), NULL for the first FX2 found
+    struct {
+        int x, y, width, height;
+    } place; // screen rectangle; width 0 for automatic layout
+    libusb_device_handle *handle;
+    int iso;                 // isochronous transfers (iso_sync_8)
+    uint8_t (*buf)[RX_SIZE]; // transfer ring (see capture_ring_alloc)
+    int mirrored;            // mapped twice back to back (see ring_alloc)
+    struct libusb_transfer *xfr[XFR_NUM];
+    struct libusb_transfer *stat_xfr;
+    uint8_t stat_buf[STAT_SIZE];
 
-    for (int i = 0; i < size; i += USB_WRITE_RAM_MAX_SIZE) {
-        int len = (size - i > USB_WRITE_RAM_MAX_SIZE) ? USB_WRITE_RAM_MAX_SIZE : size - i;
-        int ret = libusb_control_transfer(usb_handle, LIBUSB_REQUEST_TYPE_VENDOR, 0xa0, addr + i, 0, dat + i, len, 1000);
-        if (ret < 0) {
-            fprintf(stderr, "USB: Write Ram at %04x (len %d) failed.\n", addr + i, len);
-            return -1;
-        }
+    // Completed transfers handed from the USB thread to the decoder thread.
+    // Transfer n completed into slot order[n % XFR_NUM]: the next slot in the
+    // ring, unless the raw tap released a slot before the ones it is writing.
+    pthread_cond_t cond;
+    pthread_mutex_t mtx;
+    uint64_t completed;       // transfers completed
+    int order[XFR_NUM];       // slot per transfer
+    int64_t done_us[XFR_NUM]; // completion time per slot
+    int len[XFR_NUM];         // bytes per slot (iso: what the microframes brought)
+    uint8_t gap[XFR_NUM];     // samples were lost before the slot's (failed transfer or iso packet)
+    pthread_t decode_th;
+
+    rgb_decoder_t decoder;
+    MGL_layer_t *layer;
+    uint64_t last_vsync_pos;
+    uint32_t last_frame_bytes;
+    volatile int no_signal; // showing the "no signal" frame
+    int64_t signal_back_us; // first transfer after the signal returned
+
+    // Statistics
+    volatile uint64_t received_size;   // bytes since the last report
+    uint64_t total_size;               // bytes received since start
+    int64_t total_us;                  // completion time of the latest transfer
+    uint64_t errors;                   // failed transfers
+    uint64_t overruns;                 // decoder fell a whole ring behind
+    volatile uint32_t fifo_overflows;  // FX2 FIFO was full: samples lost on the device
+    uint64_t iso_lost;                 // iso packets with an error status: samples lost on the bus
+    uint32_t latency[LATENCY_BUCKETS]; // completion to decoded, LATENCY_BUCKET_US each
+
+    // Stall watchdog
+    volatile int stalled;            // a transfer ended with EP6 halted
+    volatile int recovering;         // ring transfers coming back are parked, not resubmitted
+    int idle_xfr;                    // ring transfers parked: neither submitted nor held by the tap
+    volatile int stat_idle;          // the overflow report transfer is parked
+    uint32_t fifo_base;              // overflow count before the latest firmware reload
+    uint32_t recoveries[WD_CAUSES];  // by cause
+    uint32_t recovery_ms;            // detection to transfers flowing again, latest
+    uint32_t recovery_ms_max;
+} capture_t;
+static capture_t cap[CAPTURE_MAX];
+static int cap_num = 0;
+static pthread_mutex_t usb_received_size_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+//----------------------------------------------------------------------
+// Mirrored ring: the same memory mapped twice back to back, so any span
+// starting in the first mapping can be read contiguously across the end.
+// Page aligned (O_DIRECT for the raw tap, SIMD loads, cache lines).
+//----------------------------------------------------------------------
+static void *ring_alloc(size_t size) {
+    int fd = memfd_create("fx2-ring", MFD_CLOEXEC);
+    if (fd < 0) {
+        perror("Ring: memfd failed");
+        return NULL;
     }
-    return 0;
+    if (ftruncate(fd, size) < 0) {
+        perror("Ring: memfd failed");
+        close(fd);
+        return NULL;
+    }
+    uint8_t *base = mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("Ring: mmap failed");
+        close(fd);
+        return NULL;
+    }
+    // Both halves over the reservation; on failure the whole of it goes
+    if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        perror("Ring: mmap failed");
+        munmap(base, size * 2);
+        close(fd);
+        return NULL;
+    }
+    close(fd); // the mappings keep the memory
+    return base;
 }
 
 //----------------------------------------------------------------------
-// USB load firmware
+// Transfer ring of a capture. With ring_zero_copy, usbfs memory
+// (libusb_dev_mem_alloc): the controller writes the samples straight into
+// it instead of into a kernel buffer that is copied on completion. It
+// cannot be mapped twice, so the decoder takes it slot by slot. Falls back
+// to the mirrored ring beyond usbfs_memory_mb.
 //----------------------------------------------------------------------
-#define FIRMWARE_MAX_SIZE_PER_LINE 64
-static uint8_t firmware_dat[FIRMWARE_MAX_SIZE_PER_LINE];
-int usb_load_firmware(char *firmware[]) {
-    int ret;
+static int ring_zero_copy = RING_ZERO_COPY;
 
-    // Take the CPU into RESET
-    uint8_t dat = 1;
-    ret = usb_write_ram(0xe600, &dat, sizeof(dat));
-    if (ret < 0) {
-        return -1;
+static int capture_ring_alloc(capture_t *c) {
+#if LIBUSB_API_VERSION >= 0x01000105
+    if (ring_zero_copy) {
+        c->buf = (void *)libusb_dev_mem_alloc(c->handle, READ_SIZE);
+        if (c->buf != NULL) {
+            printf("USB%d: Zero-copy transfer ring (%d KB).\n", c->index, READ_SIZE / 1024);
+            c->mirrored = 0;
+            return 0;
+        }
+        printf("USB%d: No usbfs memory for the transfer ring, using a mirrored ring.\n", c->index);
+    }
+#endif
+    c->buf = ring_alloc(READ_SIZE);
+    c->mirrored = 1;
+    return (c->buf == NULL) ? -1 : 0;
+}
+
+//----------------------------------------------------------------------
+// Close USB
+//----------------------------------------------------------------------
+void usb_close() {
+    // Let a recovery step finish; the cancelled transfers must not start another
+    __atomic_store_n(&wd_run_flag, 0, __ATOMIC_SEQ_CST);
+    for (int ms = 0; ms < 2 * RENUM_WAIT_MS && __atomic_load_n(&wd_busy, __ATOMIC_SEQ_CST); ms += 10) {
+        usleep(10000);
     }
 
-    // Load firmware
-    int size, addr, record_type, tmp_dat;
-    for (int i = 0; firmware[i] != NULL; i++) {
-        char *p = firmware[i] + 1;
-
-        // Extract size
-        ret = sscanf(p, "%2x", &size);
-        assert(ret != 0);
-        assert(size <= FIRMWARE_MAX_SIZE_PER_LINE);
-        p += 2;
-
-        // Extract addr
-        ret = sscanf(p, "%4x", &addr);
-        assert(ret != 0);
-        p += 4;
-
-        // Extract record type
-        ret = sscanf(p, "%2x", &record_type);
-        assert(ret != 0);
-        p += 2;
-
-        // Write program to EZ-USB's RAM (record_type==0).
-        if (record_type == 0) {
-            for (int j = 0; j < size; j++) {
-                ret = sscanf(p, "%2x", &tmp_dat);
-                firmware_dat[j] = tmp_dat & 0xff;
-                assert(ret != 0);
-                p += 2;
+    for (int c = 0; c < cap_num; c++) {
+        for (int i = 0; i < XFR_NUM; i++) {
+            if (cap[c].xfr[i] != NULL) {
+                libusb_cancel_transfer(cap[c].xfr[i]);
             }
+        }
+        if (cap[c].stat_xfr != NULL) {
+            libusb_cancel_transfer(cap[c].stat_xfr);
+        }
+    }
 
-            ret = usb_write_ram(addr, firmware_dat, size);
-            if (ret < 0) {
-                return -1;
+    // Stop USB thread
+    usb_run_flag = 0;
+
+    for (int c = 0; c < cap_num; c++) {
+        if (cap[c].handle != NULL) {
+            libusb_close(cap[c].handle);
+            cap[c].handle = NULL;
+        }
+
+        for (int i = 0; i < XFR_NUM; i++) {
+            if (cap[c].xfr[i] != NULL) {
+                libusb_free_transfer(cap[c].xfr[i]);
+                cap[c].xfr[i] = NULL;
             }
         }
+        if (cap[c].stat_xfr != NULL) {
+            libusb_free_transfer(cap[c].stat_xfr);
+            cap[c].stat_xfr = NULL;
+        }
     }
+}
+
+//----------------------------------------------------------------------
+// Resubmit a transfer. If that fails, or while the watchdog recovers the
+// capture, it is parked until the watchdog submits it again.
+//----------------------------------------------------------------------
+void usb_park(capture_t *c, struct libusb_transfer *xfr) {
+    if (xfr == c->stat_xfr) {
+        c->stat_idle = 1;
+    } else {
+        __atomic_add_fetch(&c->idle_xfr, 1, __ATOMIC_RELEASE);
+    }
+}
 
-    // Take the CPU out of RESET (run)
-    dat = 0;
-    ret = usb_write_ram(0xe600, &dat, sizeof(dat));
+void usb_resubmit(struct libusb_transfer *xfr) {
+    if (!usb_run_flag) {
+        return; // closing: the transfer may already be freed
+    }
+    capture_t *c = xfr->user_data;
+    if (c->recovering && xfr != c->stat_xfr) {
+        usb_park(c, xfr);
+        return;
+    }
+    PROF_BEGIN(t);
+    int ret = libusb_submit_transfer(xfr);
+    PROF_END(t, PROF_SUBMIT);
     if (ret < 0) {
-        return -1;
+        rtlog(RTLOG_SUBMIT_FAILED, c->index, 0);
+        usb_park(c, xfr);
     }
+}
 
-    return 0;
+// Raw tap (first capture only) has written or dropped the slot
+void usb_tap_release(int slot) { usb_resubmit(cap[0].xfr[slot]); }
+
+void capture_signal_lost(capture_t *c);
+void capture_signal_back(capture_t *c, int64_t now);
+
+// Record the time from transfer completion to the end of its decoding
+static inline void capture_latency(capture_t *c, int slot) {
+    int bucket = (timemicros() - c->done_us[slot]) / LATENCY_BUCKET_US;
+    c->latency[MIN(bucket, LATENCY_BUCKETS - 1)]++;
 }
 
 //----------------------------------------------------------------------
-// Close USB
+// Isochronous transfer: move the packets together to the start of the slot
+// and count the failed ones. The samples before a failed packet do not join
+// the ones after it: only those after the last failed packet are kept, and
+// *gap is set. Returns the bytes in the slot.
 //----------------------------------------------------------------------
-void usb_close() {
-    for (int i = 0; i < XFR_NUM; i++) {
-        if (xfr[i] != NULL) {
-            libusb_cancel_transfer(xfr[i]);
+static int usb_iso_collect(capture_t *c, struct libusb_transfer *xfr, int *gap) {
+    int len = 0;
+    for (int i = 0; i < xfr->num_iso_packets; i++) {
+        struct libusb_iso_packet_descriptor *pkt = &xfr->iso_packet_desc[i];
+        if (pkt->status != LIBUSB_TRANSFER_COMPLETED) {
+            c->iso_lost++;
+            *gap = 1;
+            len = 0;
+            continue;
         }
+        if (len != i * ISO_PACKET_SIZE) {
+            memmove(xfr->buffer + len, xfr->buffer + i * ISO_PACKET_SIZE, pkt->actual_length);
+        }
+        len += pkt->actual_length;
     }
+    return len;
+}
 
-    // Stop USB thread
-    usb_run_flag = 0;
-
-    if (usb_handle != NULL) {
-        libusb_close(usb_handle);
-        usb_handle = NULL;
+// Fill a ring transfer for the capture's endpoint type
+static void usb_fill_transfer(capture_t *c, int i, libusb_transfer_cb_fn callback) {
+    if (c->iso) {
+        libusb_fill_iso_transfer(c->xfr[i], c->handle, IN_EP, c->buf[i], RX_SIZE, ISO_PACKETS, callback, c, 0);
+        libusb_set_iso_packet_lengths(c->xfr[i], ISO_PACKET_SIZE);
+    } else {
+        libusb_fill_bulk_transfer(c->xfr[i], c->handle, IN_EP, c->buf[i], RX_SIZE, callback, c, 0 /* no timeout */);
     }
+}
 
-    for (int i = 0; i < XFR_NUM; i++) {
-        if (xfr[i] != NULL) {
-            libusb_free_transfer(xfr[i]);
-        }
+// EP1-IN is bulk with the default descriptors, interrupt with iso_sync_8's
+static void usb_fill_stat_transfer(capture_t *c, libusb_transfer_cb_fn callback) {
+    if (c->iso) {
+        libusb_fill_interrupt_transfer(c->stat_xfr, c->handle, STAT_EP, c->stat_buf, STAT_SIZE, callback, c, 0);
+    } else {
+        libusb_fill_bulk_transfer(c->stat_xfr, c->handle, STAT_EP, c->stat_buf, STAT_SIZE, callback, c, 0);
     }
 }
 
 //----------------------------------------------------------------------
-// USB callback for bulk-in transfer
+// USB callback for bulk-in (or iso-in) transfer
 //----------------------------------------------------------------------
-static pthread_cond_t usb_cond;
-static pthread_mutex_t usb_mtx;
-static volatile uint64_t usb_received_size = 0;
-static pthread_mutex_t usb_received_size_mtx;
-static volatile int usb_trans_pos = 0;
 static int usb_closed_flag = 0;
 void usb_callback(struct libusb_transfer *xfr) {
+    PROF_BEGIN(t);
+    capture_t *c = xfr->user_data;
+    int slot = (xfr->buffer - c->buf[0]) / RX_SIZE;
+    int64_t now = timemicros();
+    int len = c->iso ? 0 : xfr->actual_length;
+    int gap = 0;
+
     switch (xfr->status) {
     case LIBUSB_TRANSFER_COMPLETED:
+        if (c->iso && (len = usb_iso_collect(c, xfr, &gap)) == 0) {
+            break; // no samples in these microframes (IFCLK stopped): the no-signal timeout keeps running
+        }
+        if (!c->total_size) {
+            timeline_mark("FX2 #%d first transfer", c->index);
+        }
         pthread_mutex_lock(&usb_received_size_mtx);
-        usb_received_size += xfr->actual_length;
+        c->received_size += len;
+        c->total_size += len;
+        c->total_us = now;
         pthread_mutex_unlock(&usb_received_size_mtx);
         break;
     case LIBUSB_TRANSFER_ERROR:
-        fprintf(stderr, "USB: transfer error.\n");
+        rtlog(RTLOG_XFER_ERROR, c->index, 0);
+        c->errors++;
+        gap = 1;
         break;
     case LIBUSB_TRANSFER_TIMED_OUT:
-        fprintf(stderr, "USB: transfer timed out.\n");
+        rtlog(RTLOG_XFER_TIMEOUT, c->index, 0);
+        c->errors++;
+        gap = 1;
+        break;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        rtlog(RTLOG_XFER_OVERFLOW, c->index, 0);
+        c->errors++;
+        gap = 1;
+        break;
+    case LIBUSB_TRANSFER_STALL:
+        c->stalled = 1;
+        usb_park(c, xfr);
+        return;
+    case LIBUSB_TRANSFER_CANCELLED:
+    case LIBUSB_TRANSFER_NO_DEVICE:
+    default:
+        usb_park(c, xfr);
+        return;
+    }
+    c->done_us[slot] = now;
+    c->len[slot] = (xfr->status == LIBUSB_TRANSFER_COMPLETED) ? len : 0; // what a failed transfer brought is not decoded
+    c->gap[slot] = gap;
+    if (usb_single_thread) {
+        if (c->no_signal && len) {
+            capture_signal_back(c, now);
+        }
+        if (gap) {
+            rgb_decoder_gap(&c->decoder);
+        }
+        rgb_decoder_feed(&c->decoder, xfr->buffer, c->len[slot]);
+        capture_latency(c, slot);
+    } else {
+        pthread_mutex_lock(&c->mtx);
+        c->order[c->completed % XFR_NUM] = slot;
+        __atomic_add_fetch(&c->completed, 1, __ATOMIC_RELEASE);
+        pthread_cond_signal(&c->cond);
+        pthread_mutex_unlock(&c->mtx);
+    }
+    PROF_END(t, PROF_USB_COMPLETE);
+
+    if (c->index == 0 && tap_is_open()) {
+        // The slot is resubmitted by usb_tap_release() after the write
+        tap_push(slot, (xfr->status == LIBUSB_TRANSFER_COMPLETED) ? len : 0);
+    } else {
+        usb_resubmit(xfr);
+    }
+}
+
+//----------------------------------------------------------------------
+// USB callback for the FIFO overflow count (EP1-IN, 32bit little endian).
+// The firmware sends it only when it has changed.
+//----------------------------------------------------------------------
+void usb_stat_callback(struct libusb_transfer *xfr) {
+    capture_t *c = xfr->user_data;
+
+    switch (xfr->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        if (xfr->actual_length >= 4) {
+            uint8_t *d = xfr->buffer;
+            uint32_t overflows = c->fifo_base + (d[0] | d[1] << 8 | d[2] << 16 | (uint32_t)d[3] << 24);
+            if (overflows != c->fifo_overflows) {
+                rtlog(RTLOG_FIFO_OVERFLOW, c->index, overflows);
+            }
+            c->fifo_overflows = overflows;
+        }
         break;
+    case LIBUSB_TRANSFER_ERROR:
+    case LIBUSB_TRANSFER_TIMED_OUT:
     case LIBUSB_TRANSFER_OVERFLOW:
-        fprintf(stderr, "USB: transfer overflow.\n");
         break;
     case LIBUSB_TRANSFER_CANCELLED:
     case LIBUSB_TRANSFER_NO_DEVICE:
     default:
+        c->stat_idle = 1;
         return;
     }
-    usb_trans_pos = RX_SIZE * (int)xfr->user_data;
-    pthread_cond_signal(&usb_cond);
+    usb_resubmit(xfr);
+}
 
-    if (usb_run_flag) {
-        if (libusb_submit_transfer(xfr) < 0) {
-            fprintf(stderr, "USB: libusb_submit_transfer failed.\n");
-            MGL_Quit();
+//----------------------------------------------------------------------
+// Submit all USB transfers
+//----------------------------------------------------------------------
+void usb_submit_all() {
+    timeline_mark("transfers submitted");
+    for (int c = 0; c < cap_num; c++) {
+        cap[c].total_us = timemicros(); // start of the no-signal timeout
+        for (int i = 0; i < XFR_NUM; i++) {
+            usb_fill_transfer(&cap[c], i, usb_callback);
+            if (libusb_submit_transfer(cap[c].xfr[i]) < 0) {
+                fprintf(stderr, "USB%d: libusb_submit_transfer failed.\n", c);
+                MGL_Quit();
+                exit(1);
+            }
+        }
+        usb_fill_stat_transfer(&cap[c], usb_stat_callback);
+        if (libusb_submit_transfer(cap[c].stat_xfr) < 0) {
+            fprintf(stderr, "USB%d: FIFO overflow reports are not available.\n", c);
+            cap[c].stat_idle = 1;
         }
     }
 }
 
+//----------------------------------------------------------------------
+// Print statistics once a second (on the log thread)
+//----------------------------------------------------------------------
+void usb_report() {
+    static int64_t last = 0;
+    static float avg = 0;
+    static struct rusage last_ru;
+    int64_t cur = timemillis();
+    if (!last) {
+        last = cur;
+        getrusage(RUSAGE_SELF, &last_ru);
+        return;
+    }
+    int64_t msec = cur - last;
+    if (msec <= 1000) {
+        return;
+    }
+
+    uint64_t sizes[CAPTURE_MAX];
+    uint64_t size = 0;
+    pthread_mutex_lock(&usb_received_size_mtx);
+    for (int c = 0; c < cap_num; c++) {
+        sizes[c] = cap[c].received_size;
+        size += sizes[c];
+        cap[c].received_size = 0;
+    }
+    pthread_mutex_unlock(&usb_received_size_mtx);
+
+    // CPU time and context switches of the whole process
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    int64_t cpu_us = (ru.ru_utime.tv_sec - last_ru.ru_utime.tv_sec + ru.ru_stime.tv_sec - last_ru.ru_stime.tv_sec) * 1000000LL +
+                     (ru.ru_utime.tv_usec - last_ru.ru_utime.tv_usec + ru.ru_stime.tv_usec - last_ru.ru_stime.tv_usec);
+    long csw = (ru.ru_nvcsw - last_ru.ru_nvcsw) + (ru.ru_nivcsw - last_ru.ru_nivcsw);
+    last_ru = ru;
+
+    // Report the startup timeline once the first frame is on screen
+    static int startup_reported = 0;
+    MGL_pacing_t pacing;
+    MGL_GetPacing(&pacing);
+    if (!startup_reported && pacing.first_us) {
+        timeline_mark("first frame displayed");
+        pthread_mutex_lock(&timeline_mtx);
+        timeline[timeline_num - 1].us = pacing.first_us;
+        pthread_mutex_unlock(&timeline_mtx);
+        timeline_report();
+        startup_reported = 1;
+    }
+
+    float mbps = size / (msec / 1000.0) / 1024.0 / 1024.0;
+    avg = (!avg) ? mbps : avg * 0.95 + mbps * 0.05;
+    printf("Receiving at %.3f MBps (Avg. %.3f Mbps)", mbps, avg);
+    if (cap_num > 1) {
+        for (int c = 0; c < cap_num; c++) {
+            printf(" [%d] %.3f", c, sizes[c] / (msec / 1000.0) / 1024.0 / 1024.0);
+        }
+    }
+    printf(" CPU %.0f%% %.0f csw/s", cpu_us / (msec * 10.0), csw / (msec / 1000.0));
+    for (int c = 0; c < cap_num; c++) {
+        if (cap[c].overruns || cap[c].fifo_overflows || cap[c].iso_lost) {
+            printf(" Dropped[%d]: host %llu FX2 %u", c, (unsigned long long)cap[c].overruns, cap[c].fifo_overflows);
+            if (cap[c].iso) {
+                printf(" iso %llu", (unsigned long long)cap[c].iso_lost);
+            }
+        }
+    }
+    for (int c = 0; c < cap_num; c++) {
+        const capture_t *cp = &cap[c];
+        if (cp->recoveries[WD_STALL] || cp->recoveries[WD_ERRORS] || cp->recoveries[WD_DRAINED]) {
+            printf(" Recovered[%d]: stall %u errors %u drained %u, last %u ms max %u ms", c, cp->recoveries[WD_STALL], cp->recoveries[WD_ERRORS],
+                   cp->recoveries[WD_DRAINED], cp->recovery_ms, cp->recovery_ms_max);
+        }
+    }
+    if (pacing.exhausted) {
+        printf(" Frame pool exhausted %llu", (unsigned long long)pacing.exhausted);
+    }
+    if (tap_is_open()) {
+        tap_stats_t ts;
+        tap_get_stats(&ts);
+        printf(" Tap: %.1f MB written, %llu dropped", ts.written / 1024.0 / 1024.0, (unsigned long long)ts.dropped_slots);
+    }
+    printf("\r");
+    last = cur;
+}
+
 //----------------------------------------------------------------------
 // USB thread for bulk-in transfer
 //----------------------------------------------------------------------
 static pthread_t usb_th;
 struct timeval tv = {0, 1};
 void *usb_run(void *arg) {
+    pthread_setname_np(pthread_self(), "usb");
     puts("USB: Start receiving VH-RGB signals.");
 
     // Submit USB transfers
-    for (int i = 0; i < XFR_NUM; i++) {
-        libusb_fill_bulk_transfer(xfr[i], usb_handle,
-                                  IN_EP, // Endpoint ID
-                                  buf[i], RX_SIZE, usb_callback, (void *)i, 0 /* no timeout */);
-        if (libusb_submit_transfer(xfr[i]) < 0) {
-            fprintf(stderr, "USB: libusb_submit_transfer failed.\n");
-            MGL_Quit();
+    usb_submit_all();
+    rtlog_set_tick(usb_report);
+
+    // Waiting transfer completion repeatedly
+    while (usb_run_flag) {
+        libusb_handle_events_completed(NULL, &usb_closed_flag);
+    }
+
+    puts("USB: Thread finished.");
+    return NULL;
+}
+
+//----------------------------------------------------------------------
+// Single-thread mode: libusb's pollfds in an epoll loop. usb_callback()
+// feeds each completed transfer to the decoder directly.
+//----------------------------------------------------------------------
+static int usb_epoll_fd = -1;
+
+static void usb_pollfd_added(int fd, short events, void *user_data) {
+    struct epoll_event ev;
+    ZEROFILL(ev);
+    ev.events = ((events & POLLIN) ? EPOLLIN : 0) | ((events & POLLOUT) ? EPOLLOUT : 0);
+    ev.data.fd = fd;
+    if (epoll_ctl(usb_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("USB: epoll_ctl failed");
+    }
+}
+
+static void usb_pollfd_removed(int fd, void *user_data) { epoll_ctl(usb_epoll_fd, EPOLL_CTL_DEL, fd, NULL); }
+
+void usb_event_loop() {
+    puts("USB: Start receiving VH-RGB signals (single thread).");
+
+    usb_epoll_fd = epoll_create1(0);
+    assert(usb_epoll_fd >= 0);
+    const struct libusb_pollfd **fds = libusb_get_pollfds(NULL);
+    assert(fds != NULL);
+    for (int i = 0; fds[i] != NULL; i++) {
+        usb_pollfd_added(fds[i]->fd, fds[i]->events, NULL);
+    }
+    libusb_free_pollfds(fds);
+    libusb_set_pollfd_notifiers(NULL, usb_pollfd_added, usb_pollfd_removed, NULL);
+
+    usb_submit_all();
+    rtlog_set_tick(usb_report);
+
+    struct epoll_event ev[8];
+    struct timeval zero = {0, 0};
+    while (usb_run_flag) {
+        int timeout = NOSIGNAL_US / 1000;
+        struct timeval next;
+        if (libusb_get_next_timeout(NULL, &next) == 1) {
+            timeout = MIN(timeout, next.tv_sec * 1000 + (next.tv_usec + 999) / 1000);
+        }
+        if (epoll_wait(usb_epoll_fd, ev, sizeof(ev) / sizeof(ev[0]), timeout) < 0 && errno != EINTR) {
+            perror("USB: epoll_wait failed");
+            break;
+        }
+        libusb_handle_events_timeout_completed(NULL, &zero, &usb_closed_flag);
+
+        int64_t now = timemicros();
+        for (int c = 0; c < cap_num; c++) {
+            if (!cap[c].no_signal && now - cap[c].total_us >= NOSIGNAL_US) {
+                capture_signal_lost(&cap[c]);
+            }
         }
     }
 
-    // Waiting transfer completion repeatedly
+    puts("USB: Event loop finished.");
+}
+
+//======================================================================
+// Genlock
+//======================================================================
+// The source refresh is the sample clock (USB bytes per second, averaged over
+// a long window) divided by the exact number of samples per frame.
+#define GENLOCK_MIN_WINDOW_US 3000000 // min. measurement window
+#define GENLOCK_REPORT_SEC 10
+static volatile uint32_t src_frame_bytes = 0; // samples from V-Sync to V-Sync
+static int genlock_hdmi = 0;                  // retune the HDMI output to the source
+static pthread_t genlock_th;
+
+void *genlock_run(void *arg) {
+    uint32_t frame_bytes = 0;
+    uint64_t start_size = 0;
+    int64_t start_us = 0;
+    int mode_selected = 0;
+    int sec = 0;
+    MGL_pacing_t last, cur;
+    MGL_GetPacing(&last);
+
+    while (usb_run_flag) {
+        sleep(1);
+
+        // The display follows the first capture
+        pthread_mutex_lock(&usb_received_size_mtx);
+        uint64_t size = cap[0].total_size;
+        int64_t us = cap[0].total_us;
+        pthread_mutex_unlock(&usb_received_size_mtx);
+
+        // Restart the measurement whenever the source timing changes
+        if (src_frame_bytes != frame_bytes) {
+            frame_bytes = src_frame_bytes;
+            start_size = size;
+            start_us = us;
+            continue;
+        }
+        if (!frame_bytes || us - start_us < GENLOCK_MIN_WINDOW_US) {
+            continue;
+        }
+        double src_hz = (size - start_size) * 1000000.0 / (us - start_us) / frame_bytes;
+
+        if (genlock_hdmi) {
+            int ret = MGL_SetRefresh(src_hz, !mode_selected);
+            mode_selected = 1;
+            if (ret < 0) {
+                printf("\nGenlock: Cannot lock HDMI to %.3f Hz, using adaptive frame pacing.\n", src_hz);
+                genlock_hdmi = 0;
+            }
+        }
+
+        // Not locked: hold or drop the frames of the first capture evenly
+        MGL_SetLayerPacing(cap[0].layer, genlock_hdmi ? 0 : src_hz);
+
+        if (++sec < GENLOCK_REPORT_SEC) {
+            continue;
+        }
+        sec = 0;
+        MGL_GetPacing(&cur);
+        double disp_hz = (cur.rate_vsyncs > 1) ? (cur.rate_vsyncs - 1) * 1000000.0 / (cur.last_us - cur.rate_us) : 0;
+        double min = (cur.last_us - last.last_us) / 60000000.0;
+        uint64_t shown = (cur.presented - cur.dropped) - (last.presented - last.dropped);
+        if (min > 0) {
+            printf("\nGenlock: source %.3f Hz (%u samples/frame), display %.3f Hz, repeated %.1f/min, dropped %.1f/min, copied %.0f KB/frame\n",
+                   src_hz, frame_bytes, disp_hz, (cur.repeated - last.repeated) / min, (cur.dropped - last.dropped) / min,
+                   shown ? (cur.copied - last.copied) / 1024.0 / shown : 0.0);
+        }
+        last = cur;
+    }
+
+    return NULL;
+}
+
+//======================================================================
+// Statistics OSD
+//======================================================================
+// Drawn into its own overlay element a few times a second by its own
+// thread; toggled with SIGUSR1. The capture layers are never touched.
+#define OSD_INTERVAL_MS 250
+#define OSD_COLS 60
+static volatile int osd_visible = 0;
+static pthread_t osd_th;
+
+void osd_toggle(int sig) { osd_visible = !osd_visible; }
+
+// Latency percentile (msec) of the histogram difference cur - last
+static float osd_percentile(const uint32_t *cur, const uint32_t *last, float p) {
+    uint64_t total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        total += cur[i] - last[i];
+    }
+    uint64_t sum = 0;
+    for (int i = 0; i < LATENCY_BUCKETS && total; i++) {
+        sum += cur[i] - last[i];
+        if (sum > total * p) {
+            return (i + 1) * LATENCY_BUCKET_US / 1000.0;
+        }
+    }
+    return 0;
+}
+
+void *osd_run(void *arg) {
+    static uint32_t last_latency[CAPTURE_MAX][LATENCY_BUCKETS];
+    uint64_t last_size[CAPTURE_MAX] = {0};
+    uint64_t last_frames[CAPTURE_MAX] = {0};
     int64_t last = timemillis();
-    int64_t cur;
-    int64_t msec;
-    float avg = 0;
+    char line[OSD_COLS + 1];
+
     while (usb_run_flag) {
-        libusb_handle_events_completed(NULL, &usb_closed_flag);
-        cur = timemillis();
-        msec = cur - last;
-        if (msec > 1000) {
+        usleep(OSD_INTERVAL_MS * 1000);
+        MGL_OverlayShow(osd_visible);
+
+        int64_t cur = timemillis();
+        float sec = (cur - last) / 1000.0;
+        int row = 0;
+        for (int i = 0; i < cap_num; i++) {
+            capture_t *c = &cap[i];
             pthread_mutex_lock(&usb_received_size_mtx);
-            int size = usb_received_size;
-            usb_received_size = 0;
+            uint64_t size = c->total_size;
             pthread_mutex_unlock(&usb_received_size_mtx);
+            uint64_t frames = c->decoder.frames;
+            uint32_t latency[LATENCY_BUCKETS];
+            memcpy(latency, c->latency, sizeof(latency));
+
+            if (osd_visible) {
+                snprintf(line, sizeof(line), "USB%d %6.2f MB/s %5.1f fps lost %llu ovr %llu err %llu rec %u", i, (size - last_size[i]) / sec / 1024.0 / 1024.0,
+                         (frames - last_frames[i]) / sec, (unsigned long long)c->decoder.lost, (unsigned long long)(c->overruns + c->fifo_overflows + c->iso_lost),
+                         (unsigned long long)c->errors, c->recoveries[WD_STALL] + c->recoveries[WD_ERRORS] + c->recoveries[WD_DRAINED]);
+                MGL_OverlayPrint(row++, line);
+                snprintf(line, sizeof(line), "     latency p50 %.2f p95 %.2f p99 %.2f ms%s", osd_percentile(latency, last_latency[i], 0.50),
+                         osd_percentile(latency, last_latency[i], 0.95), osd_percentile(latency, last_latency[i], 0.99),
+                         c->decoder.locked ? " lock" : "");
+                MGL_OverlayPrint(row++, line);
+            }
+
+            last_size[i] = size;
+            last_frames[i] = frames;
+            memcpy(last_latency[i], latency, sizeof(latency));
+        }
 
-            float mbps = size / ((cur - last) / 1000.0) / 1024.0 / 1024.0;
-            avg = (!avg) ? mbps : avg * 0.95 + mbps * 0.05;
-            printf("Receiving at %.3f MBps (Avg. %.3f Mbps)\r", mbps, avg);
-            last = cur;
+        if (osd_visible) {
+            MGL_pacing_t p;
+            MGL_GetPacing(&p);
+            double disp_hz = (p.rate_vsyncs > 1) ? (p.rate_vsyncs - 1) * 1000000.0 / (p.last_us - p.rate_us) : 0;
+            snprintf(line, sizeof(line), "HDMI %.2f Hz repeated %llu dropped %llu pool %llu", disp_hz, (unsigned long long)p.repeated,
+                     (unsigned long long)p.dropped, (unsigned long long)p.exhausted);
+            MGL_OverlayPrint(row++, line);
+            MGL_OverlayFlush();
         }
+        last = cur;
     }
 
-    puts("USB: Thread finished.");
+    return NULL;
+}
+
+//======================================================================
+// Decoder
+//======================================================================
+static const col_t decode_col[8] = {0, WEB_RGB(0, 0, 5), WEB_RGB(0, 5, 0), WEB_RGB(0, 5, 5), WEB_RGB(5, 0, 0), WEB_RGB(5, 0, 5), WEB_RGB(5, 5, 0), WEB_RGB(5, 5, 5)};
+static int decode_raw = 0; // raw passthrough: the display palette maps the samples
+
+// V-Sync: measure the frame length; accept it once two frames agree.
+void decode_vsync(rgb_decoder_t *dec) {
+    capture_t *c = dec->user;
+    uint32_t frame_bytes = dec->vsync_pos - c->last_vsync_pos;
+    if (frame_bytes == c->last_frame_bytes && c->index == 0) {
+        src_frame_bytes = frame_bytes;
+    }
+    c->last_frame_bytes = frame_bytes;
+    c->last_vsync_pos = dec->vsync_pos;
+}
+
+// Complete frame: show it and continue with a free vram
+void decode_frame(rgb_decoder_t *dec) {
+    capture_t *c = dec->user;
+    if (dec->frames == 1) {
+        timeline_mark("FX2 #%d first frame decoded", c->index);
+    }
+    if (c->signal_back_us) {
+        rtlog(RTLOG_FIRST_FRAME, c->index, (timemicros() - c->signal_back_us) / 1000);
+        c->signal_back_us = 0;
+    }
+    MGL_PresentLayer(c->layer);
+    dec->fb = c->layer->vram;
+}
+
+void decode_init(capture_t *c) {
+    rgb_decoder_init(&c->decoder, DW, DH, V_PORCH, H_PORCH, decode_col);
+    c->decoder.fb = c->layer->vram;
+    c->decoder.pitch = c->layer->pitch;
+    c->decoder.bpp = c->layer->bpp;
+    for (int i = 0; i < 8; i++) {
+        c->decoder.palette32[i] = MGL_LayerColor(c->layer, decode_col[i]);
+    }
+    c->decoder.gated = firmware_variant[firmware_sel].gated;
+    c->decoder.on_vsync = decode_vsync;
+    c->decoder.on_frame = decode_frame;
+    c->decoder.user = c;
+
+    if (decode_raw) {
+        // The samples go to the display as they are; the palette decodes them
+        uint8_t map[256];
+        for (int i = 0; i < 256; i++) {
+            map[i] = decode_col[i & 7];
+        }
+        if (MGL_SetLayerPalette(c->layer, map) == 0) {
+            c->decoder.raw = 1;
+        } else {
+            printf("Main: Raw passthrough is not available on this display, decoding USB%d.\n", c->index);
+        }
+    }
 }
 
 //----------------------------------------------------------------------
-// Read one "000VHRGB" signal byte via USB
+// Decoder benchmark on a synthetic stream (no USB, no display)
 //----------------------------------------------------------------------
-int read_pos = 0;
-inline static uint8_t usb_read() {
-    while (read_pos == usb_trans_pos) {
-        pthread_cond_wait(&usb_cond, &usb_mtx);
+#define BENCH_FRAMES 120
+
+static uint8_t *bench_stream(const uint8_t *frame, int frame_len, size_t *len) {
+    *len = (size_t)frame_len * BENCH_FRAMES;
+    uint8_t *stream = malloc(*len);
+    assert(stream);
+    for (int i = 0; i < BENCH_FRAMES; i++) {
+        memcpy(stream + (size_t)frame_len * i, frame, frame_len);
+    }
+    return stream;
+}
+
+// Returns -1 if a kernel variant or the gated stream decodes to a different picture than the
+// scalar full stream, or if the selected kernels decode slower than BENCH_MBPS in any mode of it
+int decode_bench() {
+    uint8_t *frame = malloc(4 * 1024 * 1024);
+    uint8_t *gated_frame = malloc(4 * 1024 * 1024);
+    uint8_t *fb = malloc(GRP_W * GRP_H * 4);
+    uint8_t *ref = malloc(GRP_W * GRP_H);
+    uint8_t *ref32 = malloc(GRP_W * GRP_H * 4);
+    assert(frame && gated_frame && fb && ref && ref32);
+    size_t full_len, gated_len;
+    int frame_len = pattern_frame(frame, pattern_random, 0);
+    uint8_t *full = bench_stream(frame, frame_len, &full_len);
+    uint8_t *gated = bench_stream(gated_frame, pattern_gated_frame(frame, gated_frame), &gated_len);
+
+    static const struct {
+        const char *name;
+        int bpp, raw, lock, gated;
+    } modes[] = {
+        {"decode 8bpp", 1, 0, 0, 0},     {"decode 8bpp", 1, 0, 1, 0},     {"decode 32bpp", 4, 0, 0, 0},
+        {"decode 32bpp", 4, 0, 1, 0},    {"raw passthrough", 1, 1, 0, 0}, {"raw passthrough", 1, 1, 1, 0},
+        {"decode 8bpp", 1, 0, 0, 1},     {"decode 32bpp", 4, 0, 0, 1},    {"raw passthrough", 1, 1, 0, 1},
+    };
+    // Every kernel variant this CPU can run; the scalar one decodes the reference pictures
+    const rgb_kernels_t *kernels;
+    double worst_mbps = 0;
+    int worst_mode = 0, differs = 0;
+    for (int k = 0; (kernels = rgb_kernels_get(k)) != NULL; k++) {
+        for (int m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+            rgb_decoder_t dec;
+            rgb_decoder_init(&dec, DW, DH, V_PORCH, H_PORCH, decode_col);
+            dec.kernels = kernels;
+            dec.fb = fb;
+            dec.bpp = modes[m].bpp;
+            dec.pitch = GRP_W * modes[m].bpp;
+            dec.raw = modes[m].raw;
+            dec.lock_lines = modes[m].lock ? RGB_LOCK_LINES : 0;
+            dec.gated = modes[m].gated;
+            uint8_t *stream = modes[m].gated ? gated : full;
+            size_t len = modes[m].gated ? gated_len : full_len;
+            memset(fb, 0, GRP_W * GRP_H * 4);
+
+            int64_t t = timemicros();
+            for (size_t pos = 0; pos < len; pos += RX_SIZE) {
+                rgb_decoder_feed(&dec, stream + pos, MIN(RX_SIZE, len - pos));
+            }
+            t = timemicros() - t;
+            double mbps = len / (double)t;
+            if (kernels == rgb_kernels_best() && !modes[m].gated && (worst_mbps == 0 || mbps < worst_mbps)) {
+                worst_mbps = mbps;
+                worst_mode = m;
+            }
+            printf("Bench: %-6s %-16s %-8s %8.1f MB/s %7.3f ms/frame %8.0f bytes inspected/frame (%llu frames)\n", kernels->name,
+                   modes[m].name, modes[m].gated ? "gated" : modes[m].lock ? "locked" : "scanning", mbps,
+                   t / 1000.0 / MAX(1, dec.frames), dec.inspected / (double)MAX(1, dec.frames), (unsigned long long)dec.frames);
+
+            // The gated stream and the other kernels must decode to the same picture
+            if (modes[m].raw) {
+                continue;
+            }
+            uint8_t *want = (modes[m].bpp == 4) ? ref32 : ref;
+            size_t size = GRP_W * GRP_H * modes[m].bpp;
+            if (k == 0 && !modes[m].gated && !modes[m].lock) {
+                memcpy(want, fb, size);
+            } else if (memcmp(want, fb, size) != 0) {
+                printf("Bench: %s %s %s DIFFERS from the scalar full stream\n", kernels->name, modes[m].name, modes[m].gated ? "gated" : "full");
+                differs++;
+            } else if (k == 0 && modes[m].gated && modes[m].bpp == 1) {
+                printf("Bench: gated stream matches the full stream (%.1f%% of its size)\n", 100.0 * gated_len / full_len);
+            }
+        }
+    }
+    free(frame);
+    free(gated_frame);
+    free(full);
+    free(gated);
+    free(fb);
+    free(ref);
+    free(ref32);
+
+    // One decoder thread per capture: the slowest mode must keep up with the sample rate
+    printf("Bench: %dx%d, headroom at %d MB/s: %.2fx (%s, %s %s)\n", DW, DH, BENCH_MBPS, worst_mbps / BENCH_MBPS, rgb_kernels_best()->name,
+           modes[worst_mode].name, modes[worst_mode].lock ? "locked" : "scanning");
+    if (differs) {
+        printf("Bench: %d modes decode a different picture\n", differs);
     }
-    uint8_t dat = buf[0][read_pos++];
-    read_pos %= READ_SIZE;
-    return dat;
+    return (differs || worst_mbps < BENCH_MBPS) ? -1 : 0;
+}
+
+//----------------------------------------------------------------------
+// No signal: show a static frame once and stop presenting, so nothing is
+// uploaded until the signal returns. Decoding restarts from V-Sync.
+//----------------------------------------------------------------------
+void capture_signal_lost(capture_t *c) {
+    rgb_decoder_t *dec = &c->decoder;
+    static const char text[] = "NO SIGNAL";
+    col_t white = dec->raw ? (1 << BIT_VSYNC | 1 << BIT_HSYNC | 7) : WEB_RGB(5, 5, 5);
+    gclear(c->layer);
+    gtext(c->layer, (DW - (sizeof(text) - 1) * 6 * 4) / 2, (DH - 7 * 4) / 2, 4, text, white);
+    MGL_SetLayerIdle(c->layer, 1);
+    MGL_PresentLayer(c->layer);
+    dec->fb = c->layer->vram;
+    dec->state = RGB_WAIT_VSYNC;
+    c->no_signal = 1;
+    rtlog(RTLOG_NO_SIGNAL, c->index, 0);
+}
+
+void capture_signal_back(capture_t *c, int64_t now) {
+    c->no_signal = 0;
+    c->signal_back_us = now;
+    MGL_SetLayerIdle(c->layer, 0);
+    rtlog(RTLOG_SIGNAL_BACK, c->index, 0);
+}
+
+//----------------------------------------------------------------------
+// Decoder thread: feed the completed transfers in completion order
+//----------------------------------------------------------------------
+void *decode_run(void *arg) {
+    capture_t *c = arg;
+    uint64_t consumed = 0;
+    int64_t data_us = timemicros(); // iso: latest slot with samples
+    if (c->index > 0) {
+        char name[16];
+        snprintf(name, sizeof(name), "decode%d", c->index);
+        pthread_setname_np(pthread_self(), name); // the first one runs on the main thread
+    }
+    while (1) {
+        uint64_t completed;
+        pthread_mutex_lock(&c->mtx);
+        while ((completed = __atomic_load_n(&c->completed, __ATOMIC_ACQUIRE)) == consumed) {
+            if (c->no_signal) {
+                pthread_cond_wait(&c->cond, &c->mtx);
+                continue;
+            }
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_nsec += NOSIGNAL_US * 1000;
+            ts.tv_sec += ts.tv_nsec / 1000000000;
+            ts.tv_nsec %= 1000000000;
+            if (pthread_cond_timedwait(&c->cond, &c->mtx, &ts) == ETIMEDOUT &&
+                __atomic_load_n(&c->completed, __ATOMIC_ACQUIRE) == consumed) {
+                capture_signal_lost(c);
+            }
+        }
+        pthread_mutex_unlock(&c->mtx);
+        if (c->no_signal && !c->iso) {
+            capture_signal_back(c, c->done_us[c->order[consumed % XFR_NUM]]);
+        }
+
+        // The slots behind the newest one are being refilled: skip to the newest
+        if (completed - consumed >= XFR_NUM - 1) {
+            c->overruns++;
+            consumed = completed - 1;
+            c->decoder.state = RGB_WAIT_VSYNC;
+        }
+        PROF_BEGIN(t);
+
+        // Iso transfers complete every 4ms, full or not: slot by slot, and
+        // only empty ones for NOSIGNAL_US mean no signal
+        if (c->iso) {
+            for (; consumed < completed; consumed++) {
+                int slot = c->order[consumed % XFR_NUM];
+                if (c->gap[slot]) {
+                    rgb_decoder_gap(&c->decoder);
+                }
+                if (!c->len[slot]) {
+                    if (!c->no_signal && c->done_us[slot] - data_us >= NOSIGNAL_US) {
+                        capture_signal_lost(c);
+                    }
+                    continue;
+                }
+                data_us = c->done_us[slot];
+                if (c->no_signal) {
+                    capture_signal_back(c, data_us);
+                }
+                rgb_decoder_feed(&c->decoder, c->buf[slot], c->len[slot]);
+                capture_latency(c, slot);
+            }
+            PROF_END(t, PROF_QUEUE_DRAIN);
+            continue;
+        }
+
+        // Transfers in consecutive slots in one go: the mirror makes them
+        // contiguous. A short transfer ends the run, a failed one starts a new one.
+        while (consumed < completed) {
+            int slot = c->order[consumed % XFR_NUM];
+            int len = c->len[slot];
+            int n = 1;
+            if (c->gap[slot]) {
+                rgb_decoder_gap(&c->decoder);
+            }
+            while (c->mirrored && len == n * RX_SIZE && consumed + n < completed) {
+                int next = c->order[(consumed + n) % XFR_NUM];
+                if (next != (slot + n) % XFR_NUM || c->gap[next]) {
+                    break;
+                }
+                len += c->len[next];
+                n++;
+            }
+            rgb_decoder_feed(&c->decoder, c->buf[slot], len);
+            for (int i = 0; i < n; i++) {
+                capture_latency(c, (slot + i) % XFR_NUM);
+            }
+            consumed += n;
+        }
+        PROF_END(t, PROF_QUEUE_DRAIN);
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------
+// Claim the interface and select the capture alternate setting
+//----------------------------------------------------------------------
+int capture_claim(capture_t *c) {
+    if (libusb_set_auto_detach_kernel_driver(c->handle, 1) < 0 || libusb_claim_interface(c->handle, 0) < 0 ||
+        libusb_set_interface_alt_setting(c->handle, 0, 1) < 0) {
+        fprintf(stderr, "USB%d: Cannot claim the interface.\n", c->index);
+        return -1;
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------
+// Download a firmware variant. iso_sync_8 renumerates with its own
+// descriptors: wait for the FX2 to come back at the same port (with a new
+// address) and open it again.
+//----------------------------------------------------------------------
+int capture_load(capture_t *c, int v) {
+    libusb_device *dev = libusb_get_device(c->handle);
+    struct libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(dev, &desc) == 0 && desc.bcdDevice == ISO_BCD_DEVICE && !firmware_variant[v].iso) {
+        fprintf(stderr, "USB%d: The FX2 runs with the iso firmware's descriptors, replug it to use %s.\n", c->index, firmware_variant[v].name);
+        return -1;
+    }
+    if (usb_load_firmware(c->handle, firmware_variant[v].image) < 0) {
+        return -1;
+    }
+    c->iso = firmware_variant[v].iso;
+    if (!c->iso) {
+        return 0;
+    }
+
+    char path[64];
+    usb_device_path(dev, path, sizeof(path));
+    int addr = libusb_get_device_address(dev);
+    libusb_close(c->handle);
+    c->handle = NULL;
+    for (int ms = 0; ms < RENUM_WAIT_MS && c->handle == NULL; ms += 100) {
+        usleep(100000);
+        c->handle = usb_open_device(path);
+        if (c->handle != NULL && libusb_get_device_address(libusb_get_device(c->handle)) == addr) {
+            libusb_close(c->handle); // not disconnected yet
+            c->handle = NULL;
+        }
+    }
+    if (c->handle == NULL) {
+        fprintf(stderr, "USB%d: FX2 did not come back at %s after renumeration.\n", c->index, path);
+        return -1;
+    }
+    return capture_claim(c);
+}
+
+//----------------------------------------------------------------------
+// Open a capture device, load the firmware and allocate its transfers
+//----------------------------------------------------------------------
+int capture_open(capture_t *c) {
+    c->handle = usb_open_device(c->path);
+    if (c->handle == NULL) {
+        fprintf(stderr, "USB%d: FX2 %s not found.\n", c->index, c->path ? c->path : "");
+        return -1;
+    }
+    timeline_mark("FX2 #%d opened", c->index);
+    if (capture_claim(c) < 0) {
+        return -1;
+    }
+    timeline_mark("FX2 #%d interface claimed", c->index);
+
+    // load firmware
+    if (capture_load(c, firmware_sel) < 0) {
+        printf("USB%d: Firmware download failed.\n", c->index);
+        return -1;
+    }
+    printf("USB%d: Firmware download finished (%s).\n", c->index, firmware_variant[firmware_sel].name);
+    timeline_mark("FX2 #%d firmware loaded", c->index);
+
+    // Transfer ring
+    if (capture_ring_alloc(c) < 0) {
+        return -1;
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // for the no-signal timeout
+    pthread_cond_init(&c->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&c->mtx, NULL);
+
+    // Allocating transfer request structures (with room for the iso packets)
+    for (int i = 0; i < XFR_NUM; i++) {
+        c->xfr[i] = libusb_alloc_transfer(ISO_PACKETS);
+        if (c->xfr[i] == NULL) {
+            return -1;
+        }
+    }
+    c->stat_xfr = libusb_alloc_transfer(0);
+    if (c->stat_xfr == NULL) {
+        return -1;
+    }
+    timeline_mark("FX2 #%d transfers allocated", c->index);
+
+    return 0;
+}
+
+// Startup thread per device, run while the display is set up
+void *capture_open_run(void *arg) { return (void *)(intptr_t)capture_open(arg); }
+
+//======================================================================
+// USB stall watchdog
+//======================================================================
+// A halted EP6, a burst of failed transfers or transfers that are no longer
+// resubmitted (failed submissions, a device that dropped off) would drain the
+// pool and end the capture. The watchdog escalates until transfers flow
+// again:
+//   1. clear the EP6 halt
+//   2. reset the FIFO by the firmware (firmware/fifo_reset.h), clear the halt
+//   3. reset the device and reload the firmware (repeated every WD_RETRY_US)
+// Each step parks the whole pool, acts and submits the pool again in ring
+// order. If the problem is back within WD_VERIFY_US, the next step follows.
+// No data without errors is not a stall but the source being off (no signal).
+//----------------------------------------------------------------------
+#define WD_INTERVAL_MS 100
+#define WD_ERRORS_MAX 16      // failed transfers within a second
+#define WD_VERIFY_US 1000000  // the problem has not come back for this long: recovered
+#define WD_QUIESCE_US 1000000 // max. wait for the cancelled transfers
+#define WD_RETRY_US 2000000   // between device resets that did not help
+enum { WD_CLEAR_HALT = 1, WD_FIFO_RESET, WD_DEVICE_RESET };
+
+static struct {
+    int stage;            // latest recovery step, 0 while healthy
+    wd_cause_t cause;     // what started the recovery
+    int64_t detect_us;    // when it was noticed
+    int64_t acted_us;     // end of the latest step
+    int64_t window_us;    // start of the error count window
+    uint64_t window_errors;
+} wd[CAPTURE_MAX];
+static pthread_t wd_th;
+
+static wd_cause_t wd_check(capture_t *c, int64_t now) {
+    if (c->stalled) {
+        return WD_STALL;
+    }
+    if (__atomic_load_n(&c->idle_xfr, __ATOMIC_ACQUIRE) > XFR_NUM / 2) {
+        return WD_DRAINED;
+    }
+    if (now - wd[c->index].window_us >= 1000000) {
+        wd[c->index].window_us = now;
+        wd[c->index].window_errors = c->errors;
+    }
+    return (c->errors - wd[c->index].window_errors >= WD_ERRORS_MAX) ? WD_ERRORS : WD_OK;
+}
+
+// Cancel the ring (and the report) transfers and wait until all are parked
+static int wd_quiesce(capture_t *c, int with_stat) {
+    c->recovering = 1;
+    for (int64_t start = timemicros(); timemicros() - start < WD_QUIESCE_US; usleep(10000)) {
+        if (__atomic_load_n(&c->idle_xfr, __ATOMIC_ACQUIRE) == XFR_NUM && (!with_stat || c->stat_idle)) {
+            return 0;
+        }
+        for (int i = 0; i < XFR_NUM; i++) {
+            libusb_cancel_transfer(c->xfr[i]); // LIBUSB_ERROR_NOT_FOUND if parked already
+        }
+        if (with_stat) {
+            libusb_cancel_transfer(c->stat_xfr);
+        }
+    }
+    return -1;
+}
+
+// Submit the parked transfers again, in ring order from the slot after the
+// last completed one, so the decoder can keep taking them in long runs
+static void wd_resubmit(capture_t *c) {
+    uint64_t completed = __atomic_load_n(&c->completed, __ATOMIC_ACQUIRE);
+    int first = completed ? c->order[(completed - 1) % XFR_NUM] + 1 : 0;
+    c->stalled = 0;
+    c->recovering = 0;
+    if (__atomic_load_n(&c->idle_xfr, __ATOMIC_ACQUIRE) == XFR_NUM) {
+        for (int n = 0; n < XFR_NUM; n++) {
+            int i = (first + n) % XFR_NUM;
+            usb_fill_transfer(c, i, usb_callback);
+            if (libusb_submit_transfer(c->xfr[i]) == 0) {
+                __atomic_sub_fetch(&c->idle_xfr, 1, __ATOMIC_RELEASE);
+            }
+        }
+    }
+    if (c->stat_idle) {
+        usb_fill_stat_transfer(c, usb_stat_callback);
+        if (libusb_submit_transfer(c->stat_xfr) == 0) {
+            c->stat_idle = 0;
+        }
+    }
+}
+
+// Reset the device. If it comes back with other descriptors (iso_sync_8), it
+// has to be opened again.
+static int wd_reset_device(capture_t *c) {
+    char path[64];
+    usb_device_path(libusb_get_device(c->handle), path, sizeof(path));
+    int ret = libusb_reset_device(c->handle);
+    if (ret == LIBUSB_ERROR_NOT_FOUND) {
+        libusb_close(c->handle);
+        c->handle = NULL;
+        for (int ms = 0; ms < RENUM_WAIT_MS && c->handle == NULL; ms += 100) {
+            usleep(100000);
+            c->handle = usb_open_device(path);
+        }
+        ret = (c->handle != NULL) ? capture_claim(c) : -1;
+    }
+    if (ret < 0) {
+        return -1;
+    }
+    c->fifo_base = c->fifo_overflows; // the firmware counts from 0 again
+    if (capture_load(c, firmware_sel) < 0) {
+        return -1;
+    }
+    // Reset the data toggles (the iso firmware is claimed anew)
+    return (!c->iso && libusb_set_interface_alt_setting(c->handle, 0, 1) < 0) ? -1 : 0;
+}
+
+static void wd_act(capture_t *c, int stage) {
+    static const rtlog_id_t msg[] = {[WD_CLEAR_HALT] = RTLOG_WD_CLEAR_HALT, [WD_FIFO_RESET] = RTLOG_WD_FIFO_RESET, [WD_DEVICE_RESET] = RTLOG_WD_DEVICE_RESET};
+    rtlog(msg[stage], c->index, 0);
+    wd[c->index].stage = stage;
+
+    int ret = wd_quiesce(c, stage == WD_DEVICE_RESET);
+    if (ret == 0) {
+        switch (stage) {
+        case WD_FIFO_RESET:
+            ret = usb_fifo_reset(c->handle);
+            // fall through: the halt and the data toggle are cleared after the reset
+        case WD_CLEAR_HALT:
+            if (libusb_clear_halt(c->handle, IN_EP) < 0) {
+                ret = -1;
+            }
+            break;
+        case WD_DEVICE_RESET:
+            ret = wd_reset_device(c);
+            break;
+        }
+    }
+    if (ret < 0) {
+        rtlog(RTLOG_WD_FAILED, c->index, stage);
+    }
+    if (c->handle != NULL) {
+        wd_resubmit(c);
+    }
+
+    int64_t now = timemicros();
+    wd[c->index].acted_us = now;
+    wd[c->index].window_us = now;
+    wd[c->index].window_errors = c->errors;
+}
+
+static void wd_tick(capture_t *c, int64_t now) {
+    typeof(wd[0]) *w = &wd[c->index];
+    wd_cause_t cause = wd_check(c, now);
+    if (!w->stage) {
+        if (cause != WD_OK) {
+            static const rtlog_id_t msg[WD_CAUSES] = {[WD_STALL] = RTLOG_WD_STALL, [WD_ERRORS] = RTLOG_WD_ERRORS, [WD_DRAINED] = RTLOG_WD_DRAINED};
+            rtlog(msg[cause], c->index, (cause == WD_ERRORS) ? c->errors - w->window_errors : (uint32_t)c->idle_xfr);
+            w->cause = cause;
+            w->detect_us = now;
+            wd_act(c, WD_CLEAR_HALT);
+        }
+    } else if (cause != WD_OK) {
+        if (w->stage < WD_DEVICE_RESET) {
+            wd_act(c, w->stage + 1);
+        } else if (now - w->acted_us >= WD_RETRY_US) {
+            wd_act(c, WD_DEVICE_RESET);
+        }
+    } else if (now - w->acted_us >= WD_VERIFY_US) {
+        uint32_t ms = (w->acted_us - w->detect_us) / 1000;
+        c->recoveries[w->cause]++;
+        c->recovery_ms = ms;
+        c->recovery_ms_max = MAX(c->recovery_ms_max, ms);
+        rtlog(RTLOG_WD_RECOVERED, c->index, ms);
+        w->stage = 0;
+    }
+}
+
+void *wd_run(void *arg) {
+    pthread_setname_np(pthread_self(), "watchdog");
+    for (int c = 0; c < cap_num; c++) {
+        wd[c].window_us = timemicros();
+        wd[c].window_errors = cap[c].errors;
+    }
+    while (wd_run_flag) {
+        usleep(WD_INTERVAL_MS * 1000);
+        int64_t now = timemicros();
+        for (int c = 0; c < cap_num; c++) {
+            __atomic_store_n(&wd_busy, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&wd_run_flag, __ATOMIC_SEQ_CST)) {
+                wd_tick(&cap[c], now);
+            }
+            __atomic_store_n(&wd_busy, 0, __ATOMIC_SEQ_CST);
+        }
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------
+// Firmware sweep: load each variant and measure the sustained rate, the
+// FIFO overflows and the spacing of the transfer completions (how late and
+// how unevenly the samples reach the host) with the USB transfers only (no
+// decoding, no display)
+//----------------------------------------------------------------------
+#define SWEEP_SEC 10
+static volatile int sweep_run_flag;
+static int sweep_pending;
+static struct {
+    int64_t last_us;
+    uint64_t n;
+    double sum, sq, max; // completion intervals, msec
+} sweep_interval[CAPTURE_MAX];
+
+void sweep_callback(struct libusb_transfer *xfr) {
+    capture_t *c = xfr->user_data;
+    if (xfr->status == LIBUSB_TRANSFER_COMPLETED) {
+        int gap = 0;
+        c->total_size += c->iso ? usb_iso_collect(c, xfr, &gap) : xfr->actual_length;
+        int64_t now = timemicros();
+        typeof(sweep_interval[0]) *iv = &sweep_interval[c->index];
+        if (iv->last_us) {
+            double ms = (now - iv->last_us) / 1000.0;
+            iv->n++;
+            iv->sum += ms;
+            iv->sq += ms * ms;
+            iv->max = MAX(iv->max, ms);
+        }
+        iv->last_us = now;
+    } else if (xfr->status != LIBUSB_TRANSFER_CANCELLED) {
+        c->errors++;
+    }
+    if (!sweep_run_flag || xfr->status == LIBUSB_TRANSFER_NO_DEVICE || libusb_submit_transfer(xfr) < 0) {
+        sweep_pending--;
+    }
+}
+
+// The overflow count of the variant being measured
+void sweep_stat_callback(struct libusb_transfer *xfr) {
+    if (sweep_run_flag && xfr->status != LIBUSB_TRANSFER_CANCELLED && xfr->status != LIBUSB_TRANSFER_NO_DEVICE) {
+        usb_stat_callback(xfr); // resubmits
+        capture_t *c = xfr->user_data;
+        if (c->stat_idle) {
+            c->stat_idle = 0; // the resubmission failed
+            sweep_pending--;
+        }
+    } else {
+        sweep_pending--;
+    }
+}
+
+void usb_sweep() {
+    printf("Sweep: %d s per firmware variant.\n", SWEEP_SEC);
+    for (int v = 0; v < FIRMWARE_VARIANTS; v++) {
+        sweep_run_flag = 1;
+        for (int c = 0; c < cap_num; c++) {
+            capture_t *cp = &cap[c];
+            // Set the alternate setting again to reset the data toggles (the iso firmware is claimed anew)
+            if (capture_load(cp, v) < 0 || (!cp->iso && libusb_set_interface_alt_setting(cp->handle, 0, 1) < 0)) {
+                fprintf(stderr, "USB%d: Firmware %s download failed.\n", c, firmware_variant[v].name);
+                return;
+            }
+            cp->total_size = 0;
+            cp->errors = 0;
+            cp->fifo_overflows = 0;
+            cp->iso_lost = 0;
+            for (int i = 0; i < XFR_NUM; i++) {
+                usb_fill_transfer(cp, i, sweep_callback);
+                sweep_pending += libusb_submit_transfer(cp->xfr[i]) == 0;
+            }
+            usb_fill_stat_transfer(cp, sweep_stat_callback);
+            sweep_pending += libusb_submit_transfer(cp->stat_xfr) == 0;
+        }
+
+        // Skip the first second (FIFO fill, transfer ramp-up)
+        int64_t start = 0;
+        uint64_t start_size[CAPTURE_MAX];
+        for (int64_t t0 = timemillis(); timemillis() - t0 < (SWEEP_SEC + 1) * 1000;) {
+            struct timeval wait = {0, 100000};
+            libusb_handle_events_timeout(NULL, &wait);
+            if (!start && timemillis() - t0 >= 1000) {
+                start = timemicros();
+                for (int c = 0; c < cap_num; c++) {
+                    start_size[c] = cap[c].total_size;
+                    memset(&sweep_interval[c], 0, sizeof(sweep_interval[c]));
+                }
+            }
+        }
+        double sec = (timemicros() - start) / 1000000.0;
+
+        // Stop and wait for the cancelled transfers
+        sweep_run_flag = 0;
+        for (int c = 0; c < cap_num; c++) {
+            for (int i = 0; i < XFR_NUM; i++) {
+                libusb_cancel_transfer(cap[c].xfr[i]);
+            }
+            libusb_cancel_transfer(cap[c].stat_xfr);
+        }
+        while (sweep_pending > 0) {
+            libusb_handle_events(NULL);
+        }
+
+        for (int c = 0; c < cap_num; c++) {
+            typeof(sweep_interval[0]) *iv = &sweep_interval[c];
+            double mean = iv->n ? iv->sum / iv->n : 0;
+            double sd = iv->n ? sqrt(MAX(0, iv->sq / iv->n - mean * mean)) : 0;
+            printf("Sweep: USB%d %-6s %-26s %7.3f MB/s, %u FIFO overflows, %llu transfer errors, %llu iso packets lost, "
+                   "completions every %.2f ms (sd %.2f, max %.2f)\n",
+                   c, firmware_variant[v].name, firmware_variant[v].desc, (cap[c].total_size - start_size[c]) / sec / 1024.0 / 1024.0,
+                   cap[c].fifo_overflows, (unsigned long long)cap[c].errors, (unsigned long long)cap[c].iso_lost, mean, sd, iv->max);
+        }
+    }
+}
+
+// "-d path[@x,y,w,h]"
+int capture_add(char *arg) {
+    if (cap_num >= CAPTURE_MAX) {
+        fprintf(stderr, "Main: Up to %d capture devices.\n", CAPTURE_MAX);
+        return -1;
+    }
+    capture_t *c = &cap[cap_num];
+    c->index = cap_num++;
+    c->path = arg;
+    char *at = strchr(arg, '@');
+    if (at != NULL) {
+        *at = '\0';
+        if (sscanf(at + 1, "%d,%d,%d,%d", &c->place.x, &c->place.y, &c->place.width, &c->place.height) != 4) {
+            fprintf(stderr, "Main: Invalid placement %s.\n", at + 1);
+            return -1;
+        }
+    }
+    return 0;
 }
 
 //======================================================================
 // Main
 //======================================================================
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-1] [-g] [-r] [-o] [-t file] [-d path[@x,y,w,h]]...\n", prog);
+    fprintf(stderr, "  -1       Single-thread mode (decode in the USB event loop)\n");
+    fprintf(stderr, "  -g       Lock the HDMI refresh rate to the source (closest mode and pixel clock fine tuning)\n");
+    fprintf(stderr, "  -r       Raw passthrough: copy the samples, the display palette decodes the colors\n");
+    fprintf(stderr, "  -o       Show the statistics OSD (toggle with SIGUSR1)\n");
+    fprintf(stderr, "  -t file  Write the raw signal bytes (first device) to file\n");
+    fprintf(stderr, "  -d path  Capture from the FX2 at bus-port path (e.g. 1-1.3), optionally placed at x,y,w,h.\n");
+    fprintf(stderr, "           Repeat for several devices. Default: the first FX2 found.\n");
+    fprintf(stderr, "  -B       Benchmark the decoder on a synthetic stream and exit\n");
+    fprintf(stderr, "  -f name  Firmware variant (EP6 buffering, transfer type):");
+    for (int v = 0; v < FIRMWARE_VARIANTS; v++) {
+        fprintf(stderr, " %s", firmware_variant[v].name);
+    }
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -S       Sweep the firmware variants: MB/s and FIFO overflows of each, then exit\n");
+    fprintf(stderr, "  -L       Log the capture errors to syslog instead of stderr\n");
+#ifdef STAGE_PROF
+    fprintf(stderr, "  -P file  Record the stage profile, write it as a Chrome trace to file on SIGUSR2 and at exit\n");
+    fprintf(stderr, "  -M       Count cache misses per stage too (with -P)\n");
+#endif
+}
+
 int main(int argc, char *argv[]) {
+    timeline_mark("start");
     setvbuf(stdout, (char *)NULL, _IONBF, 0);
     int ret;
 
+    char *tap_path = NULL;
+    int sweep = 0;
+    int use_syslog = 0;
+    int opt;
+#ifdef STAGE_PROF
+    char *prof_path = NULL;
+    int prof_misses = 0;
+#define PROF_OPTS "P:M"
+#else
+#define PROF_OPTS ""
+#endif
+    while ((opt = getopt(argc, argv, "1grBSLot:d:f:h" PROF_OPTS)) != -1) {
+        switch (opt) {
+        case '1':
+            usb_single_thread = 1;
+            break;
+        case 'g':
+            genlock_hdmi = 1;
+            break;
+        case 'r':
+            decode_raw = 1;
+            break;
+        case 'B':
+            return decode_bench();
+        case 'S':
+            sweep = 1;
+            break;
+        case 'L':
+            use_syslog = 1;
+            break;
+        case 'f':
+            for (firmware_sel = 0; firmware_sel < FIRMWARE_VARIANTS; firmware_sel++) {
+                if (strcmp(optarg, firmware_variant[firmware_sel].name) == 0) {
+                    break;
+                }
+            }
+            if (firmware_sel == FIRMWARE_VARIANTS) {
+                fprintf(stderr, "Main: Unknown firmware variant %s.\n", optarg);
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'o':
+            osd_visible = 1;
+            break;
+        case 't':
+            tap_path = optarg;
+            ring_zero_copy = 0; // the tap writes the slots with O_DIRECT, not from usbfs memory
+            break;
+#ifdef STAGE_PROF
+        case 'P':
+            prof_path = optarg;
+            break;
+        case 'M':
+            prof_misses = 1;
+            break;
+#endif
+        case 'd':
+            if (capture_add(optarg) < 0) {
+                return -1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (cap_num == 0) {
+        cap[cap_num++].index = 0;
+    }
+#ifdef PROFILE_VGA
+    // gated_8 is built for the 640x200 timing, iso reserves 16 MB/s
+    if (firmware_variant[firmware_sel].gated || firmware_variant[firmware_sel].iso) {
+        fprintf(stderr, "Main: Firmware %s does not carry a %dx%d source, use a slave FIFO variant.\n", firmware_variant[firmware_sel].name, DW, DH);
+        return -1;
+    }
+#endif
+    printf("Decoder: %s kernels.\n", rgb_kernels_best()->name);
+    if (rtlog_open(use_syslog) < 0) {
+        perror("Main: Failed to start the log thread");
+        return -1;
+    }
+#ifdef STAGE_PROF
+    if (prof_path != NULL && prof_open(prof_path, prof_misses) < 0) {
+        return -1;
+    }
+#endif
+
     // Initialize USB
     ret = libusb_init(NULL);
     assert(ret == 0);
-    usb_handle = libusb_open_device_with_vid_pid(NULL, VID, PID);
-    assert(usb_handle != NULL);
-    ret = libusb_set_auto_detach_kernel_driver(usb_handle, 1);
-    assert(ret == 0);
-    ret = libusb_claim_interface(usb_handle, 0);
-    assert(ret == 0);
-    ret = libusb_set_interface_alt_setting(usb_handle, 0, 1);
-    assert(ret == 0);
+    timeline_mark("libusb_init");
 
-    // load firmware
-    printf("Main: Firmware download...");
-    if (usb_load_firmware(firmware) >= 0) {
-        puts("finished.");
-    } else {
-        puts("failed.");
-        return -1;
+    if (sweep) {
+        for (int c = 0; c < cap_num; c++) {
+            if (capture_open(&cap[c]) < 0) {
+                usb_close();
+                return -1;
+            }
+        }
+        usb_sweep();
+        usb_close();
+        libusb_exit(NULL);
+        return 0;
     }
 
-    // Allocating transfer request structures
-    ZEROFILL(xfr);
-    for (int i = 0; i < XFR_NUM; i++) {
-        xfr[i] = libusb_alloc_transfer(0);
-        if (xfr[i] == NULL) {
-            usb_close();
+    // Open the devices and download the firmware while the display is set up
+    pthread_t open_th[CAPTURE_MAX];
+    for (int c = 0; c < cap_num; c++) {
+        cap[c].layer = MGL_AddLayer(cap[c].place.x, cap[c].place.y, cap[c].place.width, cap[c].place.height);
+        assert(cap[c].layer != NULL);
+        if (pthread_create(&open_th[c], NULL, capture_open_run, &cap[c]) != 0) {
+            perror("Main: Failed to start USB setup thread");
             return -1;
         }
     }
 
-    if (pthread_create(&usb_th, NULL, usb_run, NULL) != 0) {
-        perror("Main: Failed to start USB thread");
+    // setvbuf(fp, buf, _IOFBF, 10240);
+    MGL_Start();
+    timeline_mark("display ready");
+
+    int failed = 0;
+    for (int c = 0; c < cap_num; c++) {
+        void *res;
+        pthread_join(open_th[c], &res);
+        failed |= (intptr_t)res < 0;
+    }
+
+    // Raw signal tap
+    if (failed || (tap_path != NULL && tap_open(tap_path, cap[0].buf[0], XFR_NUM, RX_SIZE, usb_tap_release) < 0)) {
+        usb_close();
+        MGL_Quit();
         return -1;
     }
 
-    // setvbuf(fp, buf, _IOFBF, 10240);
-    MGL_Start();
+    if (pthread_create(&genlock_th, NULL, genlock_run, NULL) != 0) {
+        perror("Main: Failed to start genlock thread");
+        return -1;
+    }
 
-    uint32_t d = 0;
-    uint32_t vmask = 1 << BIT_VSYNC;
-    uint32_t hmask = 1 << BIT_HSYNC;
-    uint32_t vhmask = vmask | hmask;
-    col_t col[8] = {0, WEB_RGB(0, 0, 5), WEB_RGB(0, 5, 0), WEB_RGB(0, 5, 5), WEB_RGB(5, 0, 0), WEB_RGB(5, 0, 5), WEB_RGB(5, 5, 0), WEB_RGB(5, 5, 5)};
-    col_t *p;
-    while (1) {
-        // Wait V-Sync
-        while (READ() & vmask)
-            ; // wait untill low
-        while (!(READ() & vmask))
-            ; // wait untill hi
-
-        // Skip V-Sync back porch
-        for (int i = 0; i < 36; i++) {
-            while (READ() & hmask)
-                ; // wait untill low
-            while (!(READ() & hmask))
-                ; // wait untill hi
-        }
-
-        int x, y;
-        for (y = 0; y < DH; y++) {
-            // Wait H-Sync
-            while (READ() & hmask)
-                ; // wait untill low
-            while (!(READ() & hmask))
-                ; // wait untill hi
-
-            // Skip H-Sync back porch
-            for (x = 0; x < 132 - 1; x++) {
-                READ();
-            }
+    // Statistics OSD
+    struct sigaction sa;
+    ZEROFILL(sa);
+    sa.sa_handler = osd_toggle;
+    sigaction(SIGUSR1, &sa, NULL);
+    if (MGL_OverlayInit(OSD_COLS, 2 * cap_num + 1) < 0 || pthread_create(&osd_th, NULL, osd_run, NULL) != 0) {
+        perror("Main: Failed to start OSD");
+        return -1;
+    }
 
-            p = &vram[y * GRP_W];
-            for (x = 0; x < DW; x++) {
-                d = READ();
-                if ((~d) & vhmask) {
-                    y = DH; // Sync is lost, skip this frame
-                    break;
-                }
-                *p++ = col[d & 7];
-            }
+    for (int c = 0; c < cap_num; c++) {
+        decode_init(&cap[c]);
+    }
+    if (pthread_create(&wd_th, NULL, wd_run, NULL) != 0) {
+        perror("Main: Failed to start the USB watchdog");
+        return -1;
+    }
+    if (usb_single_thread) {
+        usb_event_loop();
+        return 0;
+    }
+
+    if (pthread_create(&usb_th, NULL, usb_run, NULL) != 0) {
+        perror("Main: Failed to start USB thread");
+        return -1;
+    }
+    for (int c = 1; c < cap_num; c++) {
+        if (pthread_create(&cap[c].decode_th, NULL, decode_run, &cap[c]) != 0) {
+            perror("Main: Failed to start decoder thread");
+            return -1;
         }
     }
+    decode_run(&cap[0]);
+
+    return 0;
 }
 
 void finalize() {
     puts("\nMain: Finalizing...");
+    // The tap releases its slots (resubmits the transfers) until it has stopped
+    tap_close();
     usb_close();
     puts("Main: USB device closed.");
 
     usb_closed_flag = 1;
 
-    if (pthread_join(usb_th, NULL) != 0) {
+    if (usb_single_thread) {
+        // usb_event_loop() runs on the main thread
+    } else if (pthread_join(usb_th, NULL) != 0) {
         perror("Main: Failed to join USB thread.");
     } else {
         puts("Main: USB thread joined.");
     }
 
+    rtlog_flush();
+#ifdef STAGE_PROF
+    prof_dump();
+#endif
+
     libusb_exit(NULL);
 
     MGL_Quit();
+    exit(0);
 }
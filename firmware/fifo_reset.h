@@ -0,0 +1,30 @@
+//
+// EP6 FIFO reset on request of the host (its USB stall watchdog)
+//
+// The firmware load request (0xA0) is answered by the FX2 core and only
+// reaches the RAM, not FIFORESET. So the host writes a non-zero byte to this
+// mailbox in the scratch RAM, and the main loop resets the FIFO between
+// transactions and clears it. A macro, so that the main loops test the
+// mailbox inline.
+//
+#ifndef FIFO_RESET_H
+#define FIFO_RESET_H
+
+#define FIFO_RESET_REQ 0xE1F0 // also in fx2_usb.h (host) and fx2_emu.c
+
+volatile __xdata __at(FIFO_RESET_REQ) BYTE fifo_reset_req;
+
+#define POLL_FIFO_RESET()                    \
+    do {                                     \
+        if (fifo_reset_req) {                \
+            FIFORESET = 0x80; /* NAK all */  \
+            SYNCDELAY;                       \
+            FIFORESET = 0x86; /* EP6 FIFO */ \
+            SYNCDELAY;                       \
+            FIFORESET = 0x00; /* resume */   \
+            SYNCDELAY;                       \
+            fifo_reset_req = 0;              \
+        }                                    \
+    } while (0)
+
+#endif // FIFO_RESET_H
@@ -0,0 +1,208 @@
+//
+// firmware for Cypress EZ-USB FX2LP
+// 8bit GPIF capture gated by the sync signals
+//
+// Only the active area goes over USB. For every H-Sync (or V-Sync) pulse one
+// marker sample, taken inside the pulse, is written to EP6, followed by the
+// active pixels of the line if it is one of the active lines. Markers have
+// H or V low, pixels have both high, so the host can tell them apart:
+//
+//   line:  marker (000VHRGB, H or V low) [ACTIVE_W pixels (000 1 1 RGB)]
+//
+// Wiring: besides FD[7:0], H-Sync goes to RDY0 (SLRD) and V-Sync to RDY1
+// (SLWR); IFCLK is the sample clock as with slave_sync_8.
+//
+#include "Fx2.h"
+#include "fx2regs.h"
+#include "syncdly.h"
+#include "fifo_reset.h"
+
+// Source timing (same as the host decoder)
+#define ACTIVE_W 640 // pixels per line
+#define ACTIVE_H 200 // active lines per frame
+#define V_PORCH 36   // H-Sync pulses from the end of V-Sync to the first active line
+#define H_PORCH 131  // samples from the end of H-Sync to the first pixel
+#define LINE_MAX 0xffff // no V-Sync seen yet
+
+// ----------------------------------------------------------------------
+// GPIF waveform 0: FIFO read into EP6, one execution per sync pulse
+// ----------------------------------------------------------------------
+// S0  wait until H-Sync or V-Sync is low
+// S1  write the marker sample
+// S2  wait until both are high again (the end of the pulse)
+// S3  transaction count expired (marker only line): done
+// S4  skip the back porch
+// S5  write a pixel each clock until the transaction count expires
+//
+// Decision point logic function: LFUNC(7:6) TERMA(5:3) TERMB(2:0);
+// RDY0=0, RDY1=1, RDY5=5 (the transaction count expiration, TCXRDY5).
+#define RDY_AND_HV 0x01 // RDY0 AND RDY1
+#define RDY_TCX 0x2d    // TCXpire AND TCXpire
+const BYTE __code waveform[32] = {
+    // LENGTH / BRANCH (DP: branch on 1 (5:3), branch on 0 (2:0))
+    0x01, 0x01, 0x1a, 0x3c, H_PORCH - 1, 0x3d, 0x00, 0x00,
+    // OPCODE: DATA(1) DP(0)
+    0x01, 0x02, 0x01, 0x01, 0x00, 0x03, 0x00, 0x00,
+    // OUTPUT: CTL pins are not used
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    // LOGIC FUNCTION
+    RDY_AND_HV, 0x00, RDY_AND_HV, RDY_TCX, 0x00, RDY_TCX, 0x00, 0x00,
+};
+
+void Initialize() {
+    BYTE i;
+
+    // ----------------------------------------------------------------------
+    // CPU Clock
+    // ----------------------------------------------------------------------
+    CPUCS = 0x10; // 0b0001_0000; 48MHz
+    SYNCDELAY;
+
+    // ----------------------------------------------------------------------
+    // Interface Config
+    // ----------------------------------------------------------------------
+    // bit7   1=Internal clock, 0=External
+    // bit6   1=48MHz, 0=30MHz
+    // bit5   1=IFCLK out enable
+    // bit4   1=IFCLK inverted
+    // bit3   1=Async, 0=Sync
+    // bit2   1=GPIF GSTATE out enable
+    // bit1:0 00=Ports, 01=Reserved, 10=GPIF, 11=Slave FIFO
+    IFCONFIG = 0x02; // 0b0000_0010; External clock, Sync, GPIF
+    SYNCDELAY;
+
+    // ----------------------------------------------------------------------
+    // Chip Revision Control
+    // ----------------------------------------------------------------------
+    REVCTL = 0x03; // Recommended setting.
+    SYNCDELAY;
+
+    // ----------------------------------------------------------------------
+    // EP Config
+    // ----------------------------------------------------------------------
+    EP2CFG &= 0x7f; // disable
+    SYNCDELAY;
+    EP4CFG &= 0x7f; // disable
+    SYNCDELAY;
+    EP6CFG = 0xe0; // 0b1110_0000; Bulk-IN, 512bytes Quad buffer
+    SYNCDELAY;
+    EP8CFG &= 0x7f; // disable
+    SYNCDELAY;
+
+    // ----------------------------------------------------------------------
+    // FIFO Reset
+    // ----------------------------------------------------------------------
+    FIFORESET = 0x80; // NAK all transfer
+    SYNCDELAY;
+    FIFORESET = 0x86; // Reset EP6 FIFO
+    SYNCDELAY;
+    FIFORESET = 0x00; // Resume
+    SYNCDELAY;
+
+    // ----------------------------------------------------------------------
+    // EP FIFO Config
+    // ----------------------------------------------------------------------
+    EP6FIFOCFG = 0x0c; // 0b0000_1100; Auto-IN, 8bit
+    SYNCDELAY;
+    EP6AUTOINLENH = (512 >> 8);
+    SYNCDELAY;
+    EP6AUTOINLENL = 0;
+    SYNCDELAY;
+
+    // ----------------------------------------------------------------------
+    // GPIF
+    // ----------------------------------------------------------------------
+    // bit7   1=Internal RDY (INTRDY)
+    // bit6   1=Synchronous RDY sampling (SAS)
+    // bit5   1=RDY5 is the transaction count expiration (TCXRDY5)
+    GPIFREADYCFG = 0x60;
+    GPIFCTLCFG = 0x00;
+    GPIFIDLECS = 0x00;
+    GPIFIDLECTL = 0x00;
+    GPIFWFSELECT = 0x00; // all transactions use waveform 0
+    EP6GPIFFLGSEL = 0x02; // FIFO flag: full
+    SYNCDELAY;
+    EP6GPIFPFSTOP = 0x00;
+    GPIFTCB3 = 0;
+    SYNCDELAY;
+    GPIFTCB2 = 0;
+    SYNCDELAY;
+    for (i = 0; i < sizeof(waveform); i++) {
+        (&GPIF_WAVE_DATA)[i] = waveform[i];
+    }
+}
+
+// ----------------------------------------------------------------------
+// Main loop: start a GPIF transaction per sync pulse and count the lines.
+// While it runs, watch V-Sync and the EP6 FIFO (overflow count on EP1-IN,
+// as slave_sync_8). A FIFO reset requested by the host waits for the end of
+// the transaction that saw V-Sync.
+// After the last pixel of a line, only the front porch and the next H-Sync
+// pulse are left to start the next transaction, so the next line is worked
+// out while the transaction runs; a V-Sync seen meanwhile only resets it.
+// ----------------------------------------------------------------------
+void main() {
+    BYTE full = 1; // the FIFO fills before the host starts reading: not an overflow
+    BYTE pending = 0;
+    DWORD overflows = 0;
+    WORD line = LINE_MAX; // H-Sync pulses since the end of V-Sync
+    BYTE active = 0;      // the line is an active line
+    BYTE vsync;
+
+    Initialize();
+    fifo_reset_req = 0; // the scratch RAM survives a firmware reload
+
+    for (;;) {
+        // The marker, plus the pixels on the active lines
+        if (active) {
+            GPIFTCB1 = (ACTIVE_W + 1) >> 8;
+            SYNCDELAY;
+            GPIFTCB0 = (ACTIVE_W + 1) & 0xff;
+        } else {
+            GPIFTCB1 = 0;
+            SYNCDELAY;
+            GPIFTCB0 = 1;
+        }
+        SYNCDELAY;
+        GPIFTRIG = 0x06; // FIFO read, EP6
+
+        if (line != LINE_MAX) {
+            line++;
+        }
+        active = (line >= V_PORCH && line - V_PORCH < ACTIVE_H);
+
+        vsync = 0;
+        do {
+            if (!(GPIFREADYSTAT & bmBIT1)) {
+                vsync = 1;
+            }
+
+            if (EP2468STAT & bmEP6FULL) {
+                if (!full) {
+                    full = 1;
+                    overflows++;
+                    pending = 1;
+                }
+            } else {
+                full = 0;
+            }
+
+            if (pending && !(EP1INCS & bmEPBUSY)) {
+                EP1INBUF[0] = overflows;
+                EP1INBUF[1] = overflows >> 8;
+                EP1INBUF[2] = overflows >> 16;
+                EP1INBUF[3] = overflows >> 24;
+                EP1INBC = 4;
+                pending = 0;
+            }
+        } while (!(GPIFTRIG & bmBIT7)); // DONE
+
+        if (vsync) {
+            line = 0;
+            active = 0;
+            // Between transactions, in the vertical blanking: the next
+            // transaction is a marker, so there is time for it
+            POLL_FIFO_RESET();
+        }
+    }
+}
@@ -0,0 +1,217 @@
+//
+// firmware for Cypress EZ-USB FX2LP
+// 8bit Synchronous Slave FIFO, high-bandwidth isochronous EP6
+//
+// The same slave FIFO as slave_sync_8, but EP6 is an isochronous IN endpoint
+// with two 1024 byte transactions per microframe: 16MB/s reserved on the bus,
+// so the samples never wait for bulk scheduling. The FX2's default
+// descriptors have no such endpoint; this firmware renumerates (USBCS.RENUM)
+// with its own descriptors and answers the standard requests itself. High
+// speed only. The 0xA0 firmware load request is still handled by the core.
+//
+// EP6 is limited to 1024 bytes double buffered (three transactions per
+// microframe would need EP2 quad buffered, i.e. FIFOADR=00).
+//
+#include "Fx2.h"
+#include "fx2regs.h"
+#include "syncdly.h"
+#include "fifo_reset.h"
+
+#define BCD_DEVICE 0x0100 // the host tells this firmware by bcdDevice
+#define ISO_PACKETS 2     // transactions per microframe
+#define DISCON_LOOPS 12   // ~200ms disconnected before renumerating
+
+// ----------------------------------------------------------------------
+// Descriptors, sent by the core from SUDPTR (word aligned)
+// ----------------------------------------------------------------------
+__code __at(0x0300) const BYTE device_dscr[] = {
+    18, 0x01,                                    // bLength, DEVICE
+    0x00, 0x02,                                  // USB 2.0
+    0xff, 0xff, 0xff,                            // vendor specific class
+    64,                                          // EP0 max packet
+    0xb4, 0x04, 0x13, 0x86,                      // VID 04b4, PID 8613 (as the unprogrammed FX2)
+    BCD_DEVICE & 0xff, BCD_DEVICE >> 8,          // bcdDevice
+    0, 0, 0,                                     // no strings
+    1,                                           // configurations
+};
+__code __at(0x0312) const BYTE config_dscr[] = {
+    9, 0x02, 41, 0, 1, 1, 0, 0x80, 50,           // CONFIGURATION: 1 interface, bus powered, 100mA
+    9, 0x04, 0, 0, 0, 0xff, 0xff, 0xff, 0,       // INTERFACE 0 alt 0: no bandwidth
+    9, 0x04, 0, 1, 2, 0xff, 0xff, 0xff, 0,       // INTERFACE 0 alt 1: capture
+    7, 0x05, 0x81, 0x03, 64, 0x00, 1,            // EP1-IN interrupt 64 bytes (FIFO overflow count)
+    7, 0x05, 0x86, 0x05, 0x00, 0x04 | ((ISO_PACKETS - 1) << 3), 1, // EP6-IN iso async, 1024 x ISO_PACKETS, every microframe
+};
+
+void Initialize() {
+    // ----------------------------------------------------------------------
+    // CPU Clock
+    // ----------------------------------------------------------------------
+    CPUCS = 0x10; // 0b0001_0000; 48MHz
+    SYNCDELAY;
+
+    // ----------------------------------------------------------------------
+    // Interface Config
+    // ----------------------------------------------------------------------
+    IFCONFIG = 0x03; // 0b0000_0011; External clock, Sync, Slave FIFO
+    SYNCDELAY;
+
+    // ----------------------------------------------------------------------
+    // Chip Revision Control
+    // ----------------------------------------------------------------------
+    REVCTL = 0x03; // Recommended setting.
+    SYNCDELAY;
+
+    // ----------------------------------------------------------------------
+    // EP Config
+    // ----------------------------------------------------------------------
+    EP1INCFG = 0xb0; // 0b1011_0000; Interrupt-IN
+    SYNCDELAY;
+    EP2CFG &= 0x7f; // disable
+    SYNCDELAY;
+    EP4CFG &= 0x7f; // disable
+    SYNCDELAY;
+    EP6CFG = 0xda; // 0b1101_1010; Iso-IN, 1024bytes Double buffer
+    SYNCDELAY;
+    EP8CFG &= 0x7f; // disable
+    SYNCDELAY;
+    EP6ISOINPKTS = ISO_PACKETS;
+    SYNCDELAY;
+
+    // ----------------------------------------------------------------------
+    // FIFO Reset
+    // ----------------------------------------------------------------------
+    FIFORESET = 0x80; // NAK all transfer
+    SYNCDELAY;
+    FIFORESET = 0x86; // Reset EP6 FIFO
+    SYNCDELAY;
+    FIFORESET = 0x00; // Resume
+    SYNCDELAY;
+
+    // ----------------------------------------------------------------------
+    // EP FIFO Config
+    // ----------------------------------------------------------------------
+    EP6FIFOCFG = 0x0c; // 0b0000_1100; Auto-IN, 8bit
+    SYNCDELAY;
+    EP6AUTOINLENH = (1024 >> 8);
+    SYNCDELAY;
+    EP6AUTOINLENL = 0;
+    SYNCDELAY;
+}
+
+// ----------------------------------------------------------------------
+// Standard requests (SUDAV). Anything else is stalled.
+// ----------------------------------------------------------------------
+BYTE configuration, alt_setting;
+
+void Setup() {
+    BYTE stall = 0;
+
+    if ((SETUPDAT[0] & 0x60) != 0x00) {
+        if (SETUPDAT[1] == 0xa0) {
+            return; // firmware load: the core answers
+        }
+        stall = 1;
+    } else {
+        switch (SETUPDAT[1]) {
+        case 0x00: // GET_STATUS
+            EP0BUF[0] = 0;
+            EP0BUF[1] = 0;
+            EP0BCH = 0;
+            EP0BCL = 2;
+            break;
+        case 0x01: // CLEAR_FEATURE
+        case 0x03: // SET_FEATURE
+            break;
+        case 0x06: // GET_DESCRIPTOR: device and configuration only (no strings, high speed only)
+            if (SETUPDAT[3] == 0x01) {
+                SUDPTRH = MSB(device_dscr);
+                SUDPTRL = LSB(device_dscr);
+            } else if (SETUPDAT[3] == 0x02) {
+                SUDPTRH = MSB(config_dscr);
+                SUDPTRL = LSB(config_dscr);
+            } else {
+                stall = 1;
+            }
+            break;
+        case 0x08: // GET_CONFIGURATION
+            EP0BUF[0] = configuration;
+            EP0BCH = 0;
+            EP0BCL = 1;
+            break;
+        case 0x09: // SET_CONFIGURATION
+            configuration = SETUPDAT[2];
+            break;
+        case 0x0a: // GET_INTERFACE
+            EP0BUF[0] = alt_setting;
+            EP0BCH = 0;
+            EP0BCL = 1;
+            break;
+        case 0x0b: // SET_INTERFACE
+            alt_setting = SETUPDAT[2];
+            break;
+        default:
+            stall = 1;
+            break;
+        }
+    }
+
+    if (stall) {
+        EP0CS |= bmEPSTALL;
+    }
+    EP0CS |= bmHSNAK;
+}
+
+// ----------------------------------------------------------------------
+// Main loop: requests, the FIFO overflow monitor and FIFO resets (as
+// slave_sync_8)
+// ----------------------------------------------------------------------
+void main() {
+    BYTE full = 1; // the FIFO fills before the host starts reading: not an overflow
+    BYTE pending = 0;
+    DWORD overflows = 0;
+    BYTE i, j, k;
+
+    Initialize();
+    fifo_reset_req = 0; // the scratch RAM survives a firmware reload
+
+    // Renumerate: disconnect long enough for the hub to notice
+    USBCS |= bmDISCON | bmRENUM;
+    for (i = DISCON_LOOPS; i; i--) {
+        for (j = 0; --j;) {
+            for (k = 0; --k;) {
+            }
+        }
+    }
+    USBIRQ = 0xff;
+    EPIRQ = 0xff;
+    EXIF &= ~0x10; // USBINT
+    USBCS &= ~bmDISCON;
+
+    for (;;) {
+        if (USBIRQ & bmSUDAV) {
+            USBIRQ = bmSUDAV;
+            Setup();
+        }
+
+        if (EP2468STAT & bmEP6FULL) {
+            if (!full) {
+                full = 1;
+                overflows++;
+                pending = 1;
+            }
+        } else {
+            full = 0;
+        }
+
+        if (pending && !(EP1INCS & bmEPBUSY)) {
+            EP1INBUF[0] = overflows;
+            EP1INBUF[1] = overflows >> 8;
+            EP1INBUF[2] = overflows >> 16;
+            EP1INBUF[3] = overflows >> 24;
+            EP1INBC = 4;
+            pending = 0;
+        }
+
+        POLL_FIFO_RESET();
+    }
+}
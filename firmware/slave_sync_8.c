@@ -7,6 +7,15 @@
 #include "Fx2.h"
 #include "fx2regs.h"
 #include "syncdly.h"
+#include "fifo_reset.h"
+
+// EP6 buffer geometry. firmware/Makefile builds variants with other values.
+#ifndef EP6_CFG
+#define EP6_CFG 0xe0 // 0b1110_0000; Bulk-IN, 512bytes Quad buffer
+#endif
+#ifndef EP6_AUTOINLEN
+#define EP6_AUTOINLEN 512 // bytes committed per buffer
+#endif
 
 void Initialize() {
     // ----------------------------------------------------------------------
@@ -53,7 +62,7 @@ void Initialize() {
     SYNCDELAY;
     EP4CFG &= 0x7f; // disable
     SYNCDELAY;
-    EP6CFG = 0xe0; // 0b1110_0000; Bulk-IN, 512bytes Quad buffer
+    EP6CFG = EP6_CFG;
     SYNCDELAY;
     EP8CFG &= 0x7f; // disable
     SYNCDELAY;
@@ -85,15 +94,48 @@ void Initialize() {
     // ----------------------------------------------------------------------
     // Auto IN Length
     // ----------------------------------------------------------------------
-    EP6AUTOINLENH = (512 >> 8);
+    EP6AUTOINLENH = (EP6_AUTOINLEN >> 8);
     SYNCDELAY;
-    EP6AUTOINLENL = 0;
+    EP6AUTOINLENL = (EP6_AUTOINLEN & 0xff);
     SYNCDELAY;
 }
 
+// ----------------------------------------------------------------------
+// Main loop: FIFO overflow monitor
+// ----------------------------------------------------------------------
+// When all EP6 buffers are full, the FIFO is full and the samples clocked in
+// are lost. Every time EP6 becomes full, the overflow counter is incremented.
+// The counter is sent on EP1-IN (bulk, 4 bytes little endian) whenever it has
+// changed and the host has taken the previous report.
+// FIFO reset requests of the host are served here too (fifo_reset.h).
 void main() {
+    BYTE full = 1; // the FIFO fills before the host starts reading: not an overflow
+    BYTE pending = 0;
+    DWORD overflows = 0;
+
     Initialize();
+    fifo_reset_req = 0; // the scratch RAM survives a firmware reload
 
     for (;;) {
+        if (EP2468STAT & bmEP6FULL) {
+            if (!full) {
+                full = 1;
+                overflows++;
+                pending = 1;
+            }
+        } else {
+            full = 0;
+        }
+
+        if (pending && !(EP1INCS & bmEPBUSY)) {
+            EP1INBUF[0] = overflows;
+            EP1INBUF[1] = overflows >> 8;
+            EP1INBUF[2] = overflows >> 16;
+            EP1INBUF[3] = overflows >> 24;
+            EP1INBC = 4;
+            pending = 0;
+        }
+
+        POLL_FIFO_RESET();
     }
 }
\ No newline at end of file
@@ -0,0 +1,214 @@
+//
+// Firmware check: GPIF transactions of gpif_gated_8
+//
+// Runs the image on the 8051 model against a synthetic source (the timing of
+// the default host profile) with the GPIF mocked: a transaction started with
+// GPIFTRIG waits for the next sync pulse (H or V low), writes the marker,
+// waits for the end of the pulse and, if the transaction count is more than
+// one, skips H_PORCH samples and writes the pixels. Checks:
+//  - the waveform the image copies to GPIF_WAVE_DATA
+//  - one transaction per sync pulse, none missed: after the last pixel of an
+//    active line the next transaction must start within the front porch and
+//    the next H-Sync pulse (H_FRONT + H_SYNC samples)
+//  - the transaction count of each line: the marker only until V-Sync and on
+//    the V_PORCH lines after it, ACTIVE_W + 1 on the next ACTIVE_H lines,
+//    then the marker only again
+//  - a FIFO reset asked for in the scratch RAM mailbox (fifo_reset.h) is done
+//    between transactions, by the next V-Sync
+//
+//   gated_capture [image]
+//
+#include <stdio.h>
+#include <stdlib.h>
+#define MCS51_IMPLEMENTATION
+#include "mcs51.h"
+
+#define CYCLES_PER_US 12 // 48MHz, 4 clocks per cycle
+#define SAMPLE_MHZ 14.318
+
+// Source timing: as gpif_gated_8.c and the default host profile
+#define ACTIVE_W 640
+#define ACTIVE_H 200
+#define V_PORCH 36
+#define H_PORCH 131
+#define H_SYNC 40
+#define H_FRONT 60
+#define LINE (H_SYNC + H_PORCH + ACTIVE_W + H_FRONT)
+#define V_SYNC_LINES 3 // V-Sync from the start of line 0 to the start of line 3
+#define FRAME_LINES 262
+#define FRAMES 3
+
+#define GPIFTRIG 0xbb
+#define EP2468STAT 0xaa
+#define GPIFTCB1 0xe6d0
+#define GPIFTCB0 0xe6d1
+#define GPIFREADYSTAT 0xe6f4
+#define EP1INCS 0xe6a2
+#define GPIF_WAVE_DATA 0xe400
+#define FIFORESET 0xe604
+#define FIFO_RESET_REQ 0xe1f0 // firmware/fifo_reset.h
+#define RESET_AT ((int64_t)(FRAME_LINES + V_PORCH + 10) * LINE) // the host asks for a FIFO reset (samples)
+
+static const uint8_t waveform[32] = {
+    0x01, 0x01, 0x1a, 0x3c, H_PORCH - 1, 0x3d, 0x00, 0x00, 0x01, 0x02, 0x01, 0x01, 0x00, 0x03, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x01, 0x2d, 0x00, 0x2d, 0x00, 0x00,
+};
+
+#define TRANSACTIONS_MAX (FRAMES * FRAME_LINES + 16)
+
+typedef struct {
+    int64_t trigger, start, end, done; // samples
+    int tc;
+} transaction_t;
+
+typedef struct {
+    transaction_t t[TRANSACTIONS_MAX];
+    int num;
+    int running;
+    uint8_t resets[8]; // FIFORESET writes after RESET_AT
+    int reset_num;
+    int64_t reset_done; // sample of the last one
+    int reset_busy;     // FIFORESET written during a transaction
+} gpif_t;
+
+static int64_t sample_at(uint64_t cycles) { return (int64_t)(cycles * SAMPLE_MHZ / CYCLES_PER_US); }
+
+static int vsync_low(int64_t s) { return (s / LINE) % FRAME_LINES < V_SYNC_LINES; }
+static int hsync_low(int64_t s) { return s % LINE < H_SYNC; }
+static int sync_low(int64_t s) { return vsync_low(s) || hsync_low(s); }
+
+static int sfr_read(mcs51_t *m, uint8_t addr) {
+    gpif_t *g = m->user;
+    if (addr == GPIFTRIG) {
+        int done = !g->running || sample_at(m->cycles) >= g->t[g->num - 1].done;
+        return (m->sfr[GPIFTRIG - 0x80] & 0x7f) | (done ? 0x80 : 0);
+    }
+    if (addr == EP2468STAT) {
+        return 0; // the host keeps up
+    }
+    return -1;
+}
+
+// GPIFTRIG: start a transaction and work out when it is done
+static void sfr_write(mcs51_t *m, uint8_t addr, uint8_t v) {
+    gpif_t *g = m->user;
+    if (addr != GPIFTRIG || g->num == TRANSACTIONS_MAX) {
+        return;
+    }
+    transaction_t *t = &g->t[g->num++];
+    t->trigger = sample_at(m->cycles);
+    t->tc = m->xram[GPIFTCB1] << 8 | m->xram[GPIFTCB0];
+    int64_t s = t->trigger;
+    while (!sync_low(s)) {
+        s++;
+    }
+    t->start = s;
+    while (sync_low(s)) {
+        s++;
+    }
+    t->end = s;
+    t->done = s + ((t->tc > 1) ? H_PORCH + t->tc - 1 : 0);
+    g->running = 1;
+    (void)v;
+}
+
+static int xread(mcs51_t *m, uint16_t addr) {
+    if (addr == GPIFREADYSTAT) {
+        int64_t s = sample_at(m->cycles);
+        return (vsync_low(s) ? 0 : 0x02) | (hsync_low(s) ? 0 : 0x01);
+    }
+    if (addr == EP1INCS) {
+        return 0;
+    }
+    return -1;
+}
+
+static void xwrite(mcs51_t *m, uint16_t addr, uint8_t v) {
+    gpif_t *g = m->user;
+    int64_t s = sample_at(m->cycles);
+    if (addr == FIFORESET && s >= RESET_AT && g->reset_num < 8) {
+        g->resets[g->reset_num++] = v;
+        g->reset_done = s;
+        g->reset_busy |= g->running && s < g->t[g->num - 1].done;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *image = (argc > 1) ? argv[1] : "gpif_gated_8.ihx";
+    static mcs51_t m;
+    static gpif_t g;
+    int failed = 0;
+
+    if (mcs51_load_ihx(&m, image) < 0) {
+        return 1;
+    }
+    m.sfr_read = sfr_read;
+    m.sfr_write = sfr_write;
+    m.xread = xread;
+    m.xwrite = xwrite;
+    m.user = &g;
+    mcs51_reset(&m);
+    int requested = 0;
+    while (sample_at(m.cycles) < (int64_t)FRAMES * FRAME_LINES * LINE) {
+        if (mcs51_step(&m) < 0) {
+            return 1;
+        }
+        if (!requested && sample_at(m.cycles) >= RESET_AT) {
+            m.xram[FIFO_RESET_REQ] = 1;
+            requested = 1;
+        }
+    }
+
+    if (memcmp(&m.xram[GPIF_WAVE_DATA], waveform, sizeof(waveform)) != 0) {
+        printf("FAIL: %s: the GPIF waveform differs\n", image);
+        failed = 1;
+    }
+
+    // Every transaction but the last (cut off)
+    int line = -1, vsyncs = 0, active = 0, worst = 0;
+    for (int i = 0; i < g.num - 1; i++) {
+        const transaction_t *t = &g.t[i], *prev = &g.t[i ? i - 1 : 0];
+        int want_tc = (line >= V_PORCH && line - V_PORCH < ACTIVE_H) ? ACTIVE_W + 1 : 1;
+        if (i > 0 && (t->start / LINE) != (prev->end - 1) / LINE + 1) {
+            printf("FAIL: %s: transaction %d started on line %d, the last one ended on line %d\n", image, i, (int)(t->start / LINE),
+                   (int)((prev->end - 1) / LINE));
+            failed = 1;
+            break;
+        }
+        if (t->tc != want_tc) {
+            printf("FAIL: %s: transaction %d (line %d after V-Sync) counts %d, want %d\n", image, i, line, t->tc, want_tc);
+            failed = 1;
+            break;
+        }
+        if (i > 0 && prev->tc > 1 && t->trigger - prev->done > worst) {
+            worst = t->trigger - prev->done;
+        }
+        active += (t->tc > 1);
+        if (vsync_low(t->start)) {
+            line = 0;
+            vsyncs++;
+        } else if (line >= 0) {
+            line++;
+        }
+    }
+    if (!failed && (vsyncs < FRAMES - 1 || active != vsyncs * ACTIVE_H)) {
+        printf("FAIL: %s: %d V-Sync pulses, %d active lines\n", image, vsyncs, active);
+        failed = 1;
+    }
+    if (worst >= H_FRONT + H_SYNC) {
+        printf("FAIL: %s: next transaction %d samples after the last pixel, want less than %d\n", image, worst, H_FRONT + H_SYNC);
+        failed = 1;
+    }
+    static const uint8_t fifo_reset[] = {0x80, 0x86, 0x00};
+    if (g.reset_num != sizeof(fifo_reset) || memcmp(g.resets, fifo_reset, sizeof(fifo_reset)) != 0 || m.xram[FIFO_RESET_REQ] != 0 || g.reset_busy ||
+        g.reset_done >= (int64_t)(2 * FRAME_LINES + V_SYNC_LINES + 1) * LINE) {
+        printf("FAIL: %s: FIFO reset request: %d FIFORESET writes (want 0x80 0x86 0x00), mailbox %d, %s\n", image, g.reset_num, m.xram[FIFO_RESET_REQ],
+               g.reset_busy ? "during a transaction" : "by the next V-Sync?");
+        failed = 1;
+    }
+    if (!failed) {
+        printf("ok: %s: %d transactions, %d frames, %d active lines, next transaction %d samples after the last pixel at most (limit %d), FIFO reset on request\n",
+               image, g.num, vsyncs, active, worst, H_FRONT + H_SYNC);
+    }
+    return failed;
+}
@@ -0,0 +1,272 @@
+//
+// Firmware check: renumeration and control requests of iso_sync_8
+//
+// Runs the image on the 8051 model with the USB core mocked:
+//  - the endpoints are set up for high-bandwidth iso (EP6 1024 bytes double
+//    buffered, 2 transactions per microframe) before it renumerates
+//  - it stays disconnected long enough for the hub to notice, then connects
+//    with RENUM set (the firmware answers the requests)
+//  - the host then sends a sequence of setup requests (SUDAV); the answers
+//    (EP0BUF, descriptors through SUDPTR) must match, the unsupported ones
+//    must be stalled and the 0xA0 firmware load left to the core
+//  - an EP6 overflow after the requests is reported on EP1-IN
+//  - a FIFO reset asked for in the scratch RAM mailbox (fifo_reset.h) is done
+//
+//   iso_setup [image]
+//
+#include <stdio.h>
+#include <stdlib.h>
+#define MCS51_IMPLEMENTATION
+#include "mcs51.h"
+
+#define CYCLES_PER_US 12 // 48MHz, 4 clocks per cycle
+#define DISCON_MIN_MS 100
+#define REQUEST_GAP 2000 // cycles between the end of a request and the next one
+#define RUN_CYCLES (400 * 1000 * CYCLES_PER_US)
+
+#define EP2468STAT 0xaa
+#define bmEP6FULL 0x20
+#define FIFORESET 0xe604
+#define FIFO_RESET_REQ 0xe1f0 // firmware/fifo_reset.h
+#define EP1INCFG 0xe611
+#define EP6CFG 0xe614
+#define EP6AUTOINLENH 0xe624
+#define EP6AUTOINLENL 0xe625
+#define EP6ISOINPKTS 0xe642
+#define USBIRQ 0xe65d
+#define bmSUDAV 0x01
+#define USBCS 0xe680
+#define bmDISCON 0x08
+#define bmRENUM 0x02
+#define EP0BCL 0xe68b
+#define EP1INBC 0xe68f
+#define EP0CS 0xe6a0
+#define bmHSNAK 0x80
+#define bmEPSTALL 0x01
+#define EP1INCS 0xe6a2
+#define SUDPTRH 0xe6b3
+#define SUDPTRL 0xe6b4
+#define SETUPDAT 0xe6b8
+#define EP0BUF 0xe740
+#define EP1INBUF 0xe7c0
+
+// Setup requests and their expected answers
+typedef enum { ANSWER_ACK, ANSWER_DATA, ANSWER_DESCRIPTOR, ANSWER_STALL, ANSWER_CORE } answer_t;
+typedef struct {
+    const char *name;
+    uint8_t setup[8];
+    answer_t answer;
+    int len; // ANSWER_DATA: EP0BUF bytes; ANSWER_DESCRIPTOR: bDescriptorType
+    uint8_t data[2];
+} request_t;
+
+static const request_t requests[] = {
+    {"GET_DESCRIPTOR device", {0x80, 0x06, 0x00, 0x01, 0, 0, 18, 0}, ANSWER_DESCRIPTOR, 0x01},
+    {"GET_DESCRIPTOR configuration", {0x80, 0x06, 0x00, 0x02, 0, 0, 0xff, 0}, ANSWER_DESCRIPTOR, 0x02},
+    {"GET_DESCRIPTOR string", {0x80, 0x06, 0x00, 0x03, 0, 0, 0xff, 0}, ANSWER_STALL},
+    {"SET_CONFIGURATION 1", {0x00, 0x09, 1, 0, 0, 0, 0, 0}, ANSWER_ACK},
+    {"GET_CONFIGURATION", {0x80, 0x08, 0, 0, 0, 0, 1, 0}, ANSWER_DATA, 1, {1}},
+    {"SET_INTERFACE 0 alt 1", {0x01, 0x0b, 1, 0, 0, 0, 0, 0}, ANSWER_ACK},
+    {"GET_INTERFACE", {0x81, 0x0a, 0, 0, 0, 0, 1, 0}, ANSWER_DATA, 1, {1}},
+    {"GET_STATUS", {0x80, 0x00, 0, 0, 0, 0, 2, 0}, ANSWER_DATA, 2, {0, 0}},
+    {"CLEAR_FEATURE", {0x02, 0x01, 0, 0, 0x86, 0, 0, 0}, ANSWER_ACK},
+    {"firmware load (0xA0)", {0x40, 0xa0, 0x00, 0xe6, 0, 0, 1, 0}, ANSWER_CORE},
+    {"vendor request 0xB0", {0xc0, 0xb0, 0, 0, 0, 0, 1, 0}, ANSWER_STALL},
+    {"SYNCH_FRAME", {0x82, 0x0c, 0, 0, 0x86, 0, 2, 0}, ANSWER_STALL},
+};
+#define REQUESTS (int)(sizeof(requests) / sizeof(requests[0]))
+
+typedef struct {
+    uint64_t discon_at, connect_at; // 0: not yet
+    int renum;
+    int next;           // request to send
+    int sent;           // the request is pending or being answered
+    uint64_t sent_at;   // when it was sent
+    uint64_t idle_at;   // end of the last request
+    int stall, hsnak, bcl, sudptr;
+    int failed;
+    uint64_t ep6_full_from, ep6_full_to;
+    uint32_t report;
+    int reports;
+    uint64_t reset_at; // the host asks for a FIFO reset; 0: not yet
+    uint8_t resets[8]; // FIFORESET writes after that
+    int reset_num;
+} usb_t;
+
+static const char *image;
+
+// The answer of the current request once the firmware has handled it
+static void finish(mcs51_t *m, usb_t *u) {
+    const request_t *r = &requests[u->next];
+    const char *err = NULL;
+    answer_t got = u->stall ? ANSWER_STALL : u->sudptr ? ANSWER_DESCRIPTOR : (u->bcl >= 0) ? ANSWER_DATA : u->hsnak ? ANSWER_ACK : ANSWER_CORE;
+    if (got != r->answer || (got != ANSWER_CORE && !u->hsnak)) {
+        err = "wrong kind of answer";
+    } else if (got == ANSWER_DATA && (u->bcl != r->len || memcmp(&m->xram[EP0BUF], r->data, r->len) != 0)) {
+        err = "wrong data";
+    } else if (got == ANSWER_DESCRIPTOR) {
+        uint16_t ptr = m->xram[SUDPTRH] << 8 | m->xram[SUDPTRL];
+        const uint8_t *d = &m->code[ptr];
+        if ((ptr & 1) || d[1] != r->len) {
+            err = "wrong descriptor";
+        } else if (r->len == 0x01) {
+            // VID:PID of the unprogrammed FX2 (the host finds it so), bcdDevice 0x0100
+            if (d[0] != 18 || (d[8] | d[9] << 8) != 0x04b4 || (d[10] | d[11] << 8) != 0x8613 || (d[12] | d[13] << 8) != 0x0100) {
+                err = "wrong device descriptor";
+            }
+        } else {
+            // Interface 0 alt 1: EP6-IN iso, 2 x 1024 bytes every microframe
+            int total = d[2] | d[3] << 8, ep6 = 0;
+            for (int i = d[0]; i + 7 <= total; i += d[i]) {
+                if (d[i] == 0) {
+                    break;
+                }
+                if (d[i + 1] == 0x05 && d[i + 2] == 0x86) {
+                    ep6 = ((d[i + 3] & 0x03) == 0x01) && (d[i + 4] | d[i + 5] << 8) == (0x0400 | (1 << 11)) && d[i + 6] == 1;
+                }
+            }
+            if (!ep6) {
+                err = "no high-bandwidth iso EP6 in the configuration";
+            }
+        }
+    }
+    if (err) {
+        printf("FAIL: %s: %s: %s\n", image, r->name, err);
+        u->failed = 1;
+    }
+    u->sent = 0;
+    u->next++;
+    u->idle_at = m->cycles;
+}
+
+static int sfr_read(mcs51_t *m, uint8_t addr) {
+    usb_t *u = m->user;
+    if (addr == EP2468STAT) {
+        return (m->cycles >= u->ep6_full_from && m->cycles < u->ep6_full_to) ? bmEP6FULL : 0;
+    }
+    return -1;
+}
+
+static int xread(mcs51_t *m, uint16_t addr) {
+    usb_t *u = m->user;
+    if (addr == USBIRQ) {
+        return (u->sent && m->cycles >= u->sent_at) ? bmSUDAV : 0;
+    }
+    if (addr == EP1INCS) {
+        return 0;
+    }
+    return -1;
+}
+
+static void xwrite(mcs51_t *m, uint16_t addr, uint8_t v) {
+    usb_t *u = m->user;
+    switch (addr) {
+    case FIFORESET:
+        if (u->reset_at && m->cycles >= u->reset_at && u->reset_num < 8) {
+            u->resets[u->reset_num++] = v;
+        }
+        break;
+    case USBCS:
+        if ((v & bmDISCON) && !u->discon_at) {
+            u->discon_at = m->cycles;
+            u->renum = (v & bmRENUM) != 0;
+        } else if (!(v & bmDISCON) && u->discon_at && !u->connect_at) {
+            u->connect_at = m->cycles;
+            u->renum = u->renum && (v & bmRENUM);
+            u->idle_at = m->cycles;
+        }
+        break;
+    case USBIRQ:
+        if (u->sent && (v & bmSUDAV)) {
+            u->sent = 2; // acknowledged: being answered
+        }
+        break;
+    case EP0BCL:
+        u->bcl = v;
+        break;
+    case SUDPTRL:
+        u->sudptr = 1;
+        break;
+    case EP0CS:
+        u->stall |= (v & bmEPSTALL) != 0;
+        u->hsnak |= (v & bmHSNAK) != 0;
+        m->xram[EP0CS] = v & ~(bmHSNAK | bmEPSTALL); // the core clears them
+        break;
+    case EP1INBC: {
+        const uint8_t *b = &m->xram[EP1INBUF];
+        u->report = b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24;
+        u->reports++;
+        break;
+    }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    static mcs51_t m;
+    usb_t u = {0};
+
+    image = (argc > 1) ? argv[1] : "iso_sync_8.ihx";
+    if (mcs51_load_ihx(&m, image) < 0) {
+        return 1;
+    }
+    m.sfr_read = sfr_read;
+    m.xread = xread;
+    m.xwrite = xwrite;
+    m.user = &u;
+    u.ep6_full_to = RUN_CYCLES; // the FIFO fills before the host starts reading
+    mcs51_reset(&m);
+    while (m.cycles < RUN_CYCLES && !u.failed) {
+        if (mcs51_step(&m) < 0) {
+            return 1;
+        }
+        if (!u.connect_at) {
+            continue;
+        }
+        if (!u.sent && u.next < REQUESTS && m.cycles - u.idle_at >= REQUEST_GAP) {
+            // A new setup packet
+            memcpy(&m.xram[SETUPDAT], requests[u.next].setup, 8);
+            u.sent = 1;
+            u.sent_at = m.cycles;
+            u.stall = u.hsnak = u.sudptr = 0;
+            u.bcl = -1;
+        } else if (u.sent == 2 && (u.hsnak || m.cycles - u.sent_at >= REQUEST_GAP)) {
+            finish(&m, &u);
+            if (u.next == REQUESTS) {
+                // Capturing: the host reads, then EP6 overflows once
+                u.ep6_full_from = m.cycles + REQUEST_GAP;
+                u.ep6_full_to = u.ep6_full_from + REQUEST_GAP;
+                u.reset_at = u.ep6_full_to + REQUEST_GAP;
+            }
+        } else if (u.reset_at && m.cycles >= u.reset_at && !u.reset_num && !m.xram[FIFO_RESET_REQ]) {
+            m.xram[FIFO_RESET_REQ] = 1;
+        }
+    }
+
+    int failed = u.failed;
+    unsigned int len = m.xram[EP6AUTOINLENH] << 8 | m.xram[EP6AUTOINLENL];
+    if (!u.discon_at || m.xram[EP1INCFG] != 0xb0 || m.xram[EP6CFG] != 0xda || m.xram[EP6ISOINPKTS] != 2 || len != 1024) {
+        printf("FAIL: %s: EP1INCFG 0x%02x, EP6CFG 0x%02x, EP6ISOINPKTS %d, EP6AUTOINLEN %u before renumerating\n", image, m.xram[EP1INCFG], m.xram[EP6CFG],
+               m.xram[EP6ISOINPKTS], len);
+        failed = 1;
+    } else if (!u.connect_at || !u.renum || (u.connect_at - u.discon_at) / (CYCLES_PER_US * 1000) < DISCON_MIN_MS) {
+        printf("FAIL: %s: did not renumerate (disconnected for %d ms, RENUM %d)\n", image,
+               u.connect_at ? (int)((u.connect_at - u.discon_at) / (CYCLES_PER_US * 1000)) : -1, u.renum);
+        failed = 1;
+    } else if (u.next < REQUESTS) {
+        if (!failed) {
+            printf("FAIL: %s: %s not answered\n", image, requests[u.next].name);
+        }
+        failed = 1;
+    } else if (!failed && (u.reports != 1 || u.report != 1)) {
+        printf("FAIL: %s: %d overflow reports (count %u), want 1 (count 1)\n", image, u.reports, u.report);
+        failed = 1;
+    } else if (!failed && (u.reset_num != 3 || u.resets[0] != 0x80 || u.resets[1] != 0x86 || u.resets[2] != 0x00 || m.xram[FIFO_RESET_REQ])) {
+        printf("FAIL: %s: FIFO reset request: %d FIFORESET writes (want 0x80 0x86 0x00), mailbox %d\n", image, u.reset_num, m.xram[FIFO_RESET_REQ]);
+        failed = 1;
+    }
+    if (!failed) {
+        printf("ok: %s: renumerated after %d ms, %d requests answered, overflow reported, FIFO reset on request\n", image,
+               (int)((u.connect_at - u.discon_at) / (CYCLES_PER_US * 1000)), REQUESTS);
+    }
+    return failed;
+}
@@ -0,0 +1,628 @@
+//
+// 8051 instruction set model for the firmware checks
+//
+// Runs an Intel HEX image (as sdcc links it) instruction by instruction and
+// counts the cycles of the FX2's core: most instructions take a cycle per
+// byte, jumps, calls and returns one more, INC DPTR and MOVC 3, MUL and
+// DIV 5, MOVX 2 plus the stretch in CKCON (1 after reset). A cycle is 4
+// clocks (83.3ns at 48MHz). Interrupts are not modelled; the firmware
+// polls.
+//
+// The FX2 registers are left to the check: hooks see every access to XDATA
+// and to the SFRs outside the core, and may return their own value on a
+// read (-1: the memory holds it).
+//
+//   mcs51_t *m = calloc(1, sizeof(*m));
+//   mcs51_load_ihx(m, "slave_sync_8.ihx");
+//   m->xread = my_xread; ...
+//   mcs51_reset(m);
+//   while (m->cycles < end) { mcs51_step(m); }
+//
+#ifndef __MCS51_H_
+#define __MCS51_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MCS51_ACC 0xe0
+#define MCS51_B 0xf0
+#define MCS51_PSW 0xd0
+#define MCS51_SP 0x81
+#define MCS51_DPL 0x82
+#define MCS51_DPH 0x83
+#define MCS51_CKCON 0x8e
+#define MCS51_XPAGE 0xa0 // page of MOVX @Ri (sdcc's default, P2)
+
+typedef struct mcs51 mcs51_t;
+struct mcs51 {
+    uint8_t code[0x10000];
+    uint8_t iram[256];
+    uint8_t sfr[128]; // 0x80..0xff
+    uint8_t xram[0x10000];
+    uint16_t pc;
+    uint64_t cycles;
+
+    // Device hooks (may be NULL). Reads return -1 to take the memory's value;
+    // writes have been stored already.
+    int (*xread)(mcs51_t *m, uint16_t addr);
+    void (*xwrite)(mcs51_t *m, uint16_t addr, uint8_t v);
+    int (*sfr_read)(mcs51_t *m, uint8_t addr);
+    void (*sfr_write)(mcs51_t *m, uint8_t addr, uint8_t v);
+    void *user;
+};
+
+// Prototypes
+//--------------------------------------------------------------------------------
+int mcs51_load_ihx(mcs51_t *m, const char *path);
+void mcs51_reset(mcs51_t *m);
+int mcs51_step(mcs51_t *m);
+
+#endif // __MCS51_H_
+#ifdef MCS51_IMPLEMENTATION
+
+#define MCS51_CY 0x80
+#define MCS51_AC 0x40
+#define MCS51_OV 0x04
+
+// Bytes per opcode
+static const uint8_t mcs51_len[256] = {
+    1, 2, 3, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x00
+    3, 2, 3, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x10
+    3, 2, 1, 1, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x20
+    3, 2, 1, 1, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x30
+    2, 2, 2, 3, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x40
+    2, 2, 2, 3, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x50
+    2, 2, 2, 3, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x60
+    2, 2, 2, 1, 2, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, // 0x70
+    2, 2, 2, 1, 1, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, // 0x80
+    3, 2, 2, 1, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x90
+    2, 2, 2, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, // 0xa0
+    2, 2, 2, 1, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, // 0xb0
+    2, 2, 2, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xc0
+    2, 2, 2, 1, 1, 3, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, // 0xd0
+    1, 2, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xe0
+    1, 2, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xf0
+};
+
+#define MCS51_REG(m, n) ((m)->iram[((m)->sfr[MCS51_PSW - 0x80] & 0x18) + (n)])
+#define MCS51_A(m) ((m)->sfr[MCS51_ACC - 0x80])
+#define MCS51_PSWR(m) ((m)->sfr[MCS51_PSW - 0x80])
+
+int mcs51_load_ihx(mcs51_t *m, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    char line[600];
+    int ret = -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        unsigned int n, addr, type, b;
+        if (line[0] != ':' || sscanf(line + 1, "%2x%4x%2x", &n, &addr, &type) != 3) {
+            break;
+        }
+        if (type == 1) {
+            ret = 0;
+            break;
+        }
+        for (unsigned int i = 0; type == 0 && i < n; i++) {
+            if (sscanf(line + 9 + 2 * i, "%2x", &b) != 1) {
+                fclose(fp);
+                return -1;
+            }
+            m->code[(addr + i) & 0xffff] = b;
+        }
+    }
+    fclose(fp);
+    if (ret < 0) {
+        fprintf(stderr, "%s: not an Intel HEX image\n", path);
+    }
+    return ret;
+}
+
+void mcs51_reset(mcs51_t *m) {
+    m->pc = 0;
+    memset(m->sfr, 0, sizeof(m->sfr));
+    m->sfr[MCS51_SP - 0x80] = 0x07;
+    m->sfr[MCS51_CKCON - 0x80] = 0x01;
+}
+
+// Direct address: the lower RAM or an SFR
+static uint8_t mcs51_dir_read(mcs51_t *m, uint8_t addr) {
+    if (addr < 0x80) {
+        return m->iram[addr];
+    }
+    if (m->sfr_read && addr != MCS51_ACC && addr != MCS51_PSW) {
+        int v = m->sfr_read(m, addr);
+        if (v >= 0) {
+            return v;
+        }
+    }
+    return m->sfr[addr - 0x80];
+}
+
+static void mcs51_dir_write(mcs51_t *m, uint8_t addr, uint8_t v) {
+    if (addr < 0x80) {
+        m->iram[addr] = v;
+        return;
+    }
+    m->sfr[addr - 0x80] = v;
+    if (m->sfr_write && addr != MCS51_ACC && addr != MCS51_PSW) {
+        m->sfr_write(m, addr, v);
+    }
+}
+
+static uint8_t mcs51_xread(mcs51_t *m, uint16_t addr) {
+    if (m->xread) {
+        int v = m->xread(m, addr);
+        if (v >= 0) {
+            return v;
+        }
+    }
+    return m->xram[addr];
+}
+
+static void mcs51_xwrite(mcs51_t *m, uint16_t addr, uint8_t v) {
+    m->xram[addr] = v;
+    if (m->xwrite) {
+        m->xwrite(m, addr, v);
+    }
+}
+
+// Bit address: 0x20..0x2f of the RAM, or a bit addressable SFR
+static int mcs51_bit_read(mcs51_t *m, uint8_t bit) {
+    uint8_t addr = (bit < 0x80) ? 0x20 + bit / 8 : (bit & 0xf8);
+    return (mcs51_dir_read(m, addr) >> (bit & 7)) & 1;
+}
+
+static void mcs51_bit_write(mcs51_t *m, uint8_t bit, int v) {
+    uint8_t addr = (bit < 0x80) ? 0x20 + bit / 8 : (bit & 0xf8);
+    uint8_t b = mcs51_dir_read(m, addr);
+    mcs51_dir_write(m, addr, v ? (b | (1 << (bit & 7))) : (b & ~(1 << (bit & 7))));
+}
+
+static uint16_t mcs51_dptr(mcs51_t *m) { return m->sfr[MCS51_DPH - 0x80] << 8 | m->sfr[MCS51_DPL - 0x80]; }
+
+static void mcs51_set_dptr(mcs51_t *m, uint16_t v) {
+    m->sfr[MCS51_DPH - 0x80] = v >> 8;
+    m->sfr[MCS51_DPL - 0x80] = v & 0xff;
+}
+
+static void mcs51_push(mcs51_t *m, uint8_t v) { m->iram[++m->sfr[MCS51_SP - 0x80]] = v; }
+static uint8_t mcs51_pop(mcs51_t *m) { return m->iram[m->sfr[MCS51_SP - 0x80]--]; }
+
+static void mcs51_set_cy(mcs51_t *m, int c) { MCS51_PSWR(m) = c ? (MCS51_PSWR(m) | MCS51_CY) : (MCS51_PSWR(m) & ~MCS51_CY); }
+static int mcs51_cy(mcs51_t *m) { return (MCS51_PSWR(m) & MCS51_CY) != 0; }
+
+// A + v + carry in, with CY, AC and OV (ADD, ADDC, and SUBB as A + ~v + !borrow)
+static void mcs51_add(mcs51_t *m, uint8_t v, int c, int sub) {
+    uint8_t a = MCS51_A(m);
+    uint8_t psw = MCS51_PSWR(m) & ~(MCS51_CY | MCS51_AC | MCS51_OV);
+    int r, ac, ov;
+    if (sub) {
+        r = a - v - c;
+        ac = (a & 0x0f) < (v & 0x0f) + c;
+        ov = ((a ^ v) & (a ^ r) & 0x80) != 0;
+        psw |= (r < 0) ? MCS51_CY : 0;
+    } else {
+        r = a + v + c;
+        ac = (a & 0x0f) + (v & 0x0f) + c > 0x0f;
+        ov = (~(a ^ v) & (a ^ r) & 0x80) != 0;
+        psw |= (r > 0xff) ? MCS51_CY : 0;
+    }
+    MCS51_A(m) = r & 0xff;
+    MCS51_PSWR(m) = psw | (ac ? MCS51_AC : 0) | (ov ? MCS51_OV : 0);
+}
+
+// Operand of the ALU rows (opcode low nibble 4..f): #data, direct, @Ri, Rn
+static uint8_t mcs51_operand(mcs51_t *m, uint8_t op, const uint8_t *arg) {
+    switch (op & 0x0f) {
+    case 0x4:
+        return arg[0];
+    case 0x5:
+        return mcs51_dir_read(m, arg[0]);
+    case 0x6:
+    case 0x7:
+        return m->iram[MCS51_REG(m, op & 1)];
+    default:
+        return MCS51_REG(m, op & 7);
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Execute one instruction. Returns its cycles, -1 on an undefined opcode.
+//--------------------------------------------------------------------------------
+int mcs51_step(mcs51_t *m) {
+    uint16_t pc = m->pc;
+    uint8_t op = m->code[pc];
+    const uint8_t arg[2] = {m->code[(uint16_t)(pc + 1)], m->code[(uint16_t)(pc + 2)]};
+    int len = mcs51_len[op];
+    int cycles = len;
+    uint16_t next = pc + len;
+    uint8_t *a = &MCS51_A(m);
+    int8_t rel = (int8_t)arg[len - 2]; // relative jumps: the last byte
+
+    switch (op) {
+    case 0x00: // NOP
+        break;
+    case 0x01: case 0x21: case 0x41: case 0x61: case 0x81: case 0xa1: case 0xc1: case 0xe1: // AJMP
+        next = (next & 0xf800) | ((op & 0xe0) << 3) | arg[0];
+        cycles++;
+        break;
+    case 0x11: case 0x31: case 0x51: case 0x71: case 0x91: case 0xb1: case 0xd1: case 0xf1: // ACALL
+        mcs51_push(m, next & 0xff);
+        mcs51_push(m, next >> 8);
+        next = (next & 0xf800) | ((op & 0xe0) << 3) | arg[0];
+        cycles++;
+        break;
+    case 0x02: // LJMP
+        next = arg[0] << 8 | arg[1];
+        cycles++;
+        break;
+    case 0x12: // LCALL
+        mcs51_push(m, next & 0xff);
+        mcs51_push(m, next >> 8);
+        next = arg[0] << 8 | arg[1];
+        cycles++;
+        break;
+    case 0x22: // RET
+    case 0x32: // RETI
+        next = mcs51_pop(m) << 8;
+        next |= mcs51_pop(m);
+        cycles += 3;
+        break;
+    case 0x03: // RR A
+        *a = (*a >> 1) | (*a << 7);
+        break;
+    case 0x13: { // RRC A
+        int c = *a & 1;
+        *a = (*a >> 1) | (mcs51_cy(m) << 7);
+        mcs51_set_cy(m, c);
+        break;
+    }
+    case 0x23: // RL A
+        *a = (*a << 1) | (*a >> 7);
+        break;
+    case 0x33: { // RLC A
+        int c = *a >> 7;
+        *a = (*a << 1) | mcs51_cy(m);
+        mcs51_set_cy(m, c);
+        break;
+    }
+    case 0x04: // INC A
+        (*a)++;
+        break;
+    case 0x05: // INC direct
+        mcs51_dir_write(m, arg[0], mcs51_dir_read(m, arg[0]) + 1);
+        break;
+    case 0x06: case 0x07: // INC @Ri
+        m->iram[MCS51_REG(m, op & 1)]++;
+        break;
+    case 0x08: case 0x09: case 0x0a: case 0x0b: case 0x0c: case 0x0d: case 0x0e: case 0x0f: // INC Rn
+        MCS51_REG(m, op & 7)++;
+        break;
+    case 0x14: // DEC A
+        (*a)--;
+        break;
+    case 0x15: // DEC direct
+        mcs51_dir_write(m, arg[0], mcs51_dir_read(m, arg[0]) - 1);
+        break;
+    case 0x16: case 0x17: // DEC @Ri
+        m->iram[MCS51_REG(m, op & 1)]--;
+        break;
+    case 0x18: case 0x19: case 0x1a: case 0x1b: case 0x1c: case 0x1d: case 0x1e: case 0x1f: // DEC Rn
+        MCS51_REG(m, op & 7)--;
+        break;
+    case 0x10: // JBC bit,rel
+        cycles++;
+        if (mcs51_bit_read(m, arg[0])) {
+            mcs51_bit_write(m, arg[0], 0);
+            next += rel;
+        }
+        break;
+    case 0x20: // JB bit,rel
+        cycles++;
+        next += mcs51_bit_read(m, arg[0]) ? rel : 0;
+        break;
+    case 0x30: // JNB bit,rel
+        cycles++;
+        next += mcs51_bit_read(m, arg[0]) ? 0 : rel;
+        break;
+    case 0x40: // JC
+        cycles++;
+        next += mcs51_cy(m) ? rel : 0;
+        break;
+    case 0x50: // JNC
+        cycles++;
+        next += mcs51_cy(m) ? 0 : rel;
+        break;
+    case 0x60: // JZ
+        cycles++;
+        next += *a ? 0 : rel;
+        break;
+    case 0x70: // JNZ
+        cycles++;
+        next += *a ? rel : 0;
+        break;
+    case 0x80: // SJMP
+        cycles++;
+        next += rel;
+        break;
+    case 0x73: // JMP @A+DPTR
+        next = mcs51_dptr(m) + *a;
+        cycles += 2;
+        break;
+    case 0x24: case 0x25: case 0x26: case 0x27: case 0x28: case 0x29: case 0x2a: case 0x2b: // ADD
+    case 0x2c: case 0x2d: case 0x2e: case 0x2f:
+        mcs51_add(m, mcs51_operand(m, op, arg), 0, 0);
+        break;
+    case 0x34: case 0x35: case 0x36: case 0x37: case 0x38: case 0x39: case 0x3a: case 0x3b: // ADDC
+    case 0x3c: case 0x3d: case 0x3e: case 0x3f:
+        mcs51_add(m, mcs51_operand(m, op, arg), mcs51_cy(m), 0);
+        break;
+    case 0x94: case 0x95: case 0x96: case 0x97: case 0x98: case 0x99: case 0x9a: case 0x9b: // SUBB
+    case 0x9c: case 0x9d: case 0x9e: case 0x9f:
+        mcs51_add(m, mcs51_operand(m, op, arg), mcs51_cy(m), 1);
+        break;
+    case 0x44: case 0x45: case 0x46: case 0x47: case 0x48: case 0x49: case 0x4a: case 0x4b: // ORL A,
+    case 0x4c: case 0x4d: case 0x4e: case 0x4f:
+        *a |= mcs51_operand(m, op, arg);
+        break;
+    case 0x54: case 0x55: case 0x56: case 0x57: case 0x58: case 0x59: case 0x5a: case 0x5b: // ANL A,
+    case 0x5c: case 0x5d: case 0x5e: case 0x5f:
+        *a &= mcs51_operand(m, op, arg);
+        break;
+    case 0x64: case 0x65: case 0x66: case 0x67: case 0x68: case 0x69: case 0x6a: case 0x6b: // XRL A,
+    case 0x6c: case 0x6d: case 0x6e: case 0x6f:
+        *a ^= mcs51_operand(m, op, arg);
+        break;
+    case 0x42: // ORL direct,A
+        mcs51_dir_write(m, arg[0], mcs51_dir_read(m, arg[0]) | *a);
+        break;
+    case 0x43: // ORL direct,#data
+        mcs51_dir_write(m, arg[0], mcs51_dir_read(m, arg[0]) | arg[1]);
+        break;
+    case 0x52: // ANL direct,A
+        mcs51_dir_write(m, arg[0], mcs51_dir_read(m, arg[0]) & *a);
+        break;
+    case 0x53: // ANL direct,#data
+        mcs51_dir_write(m, arg[0], mcs51_dir_read(m, arg[0]) & arg[1]);
+        break;
+    case 0x62: // XRL direct,A
+        mcs51_dir_write(m, arg[0], mcs51_dir_read(m, arg[0]) ^ *a);
+        break;
+    case 0x63: // XRL direct,#data
+        mcs51_dir_write(m, arg[0], mcs51_dir_read(m, arg[0]) ^ arg[1]);
+        break;
+    case 0x72: // ORL C,bit
+        mcs51_set_cy(m, mcs51_cy(m) | mcs51_bit_read(m, arg[0]));
+        break;
+    case 0xa0: // ORL C,/bit
+        mcs51_set_cy(m, mcs51_cy(m) | !mcs51_bit_read(m, arg[0]));
+        break;
+    case 0x82: // ANL C,bit
+        mcs51_set_cy(m, mcs51_cy(m) & mcs51_bit_read(m, arg[0]));
+        break;
+    case 0xb0: // ANL C,/bit
+        mcs51_set_cy(m, mcs51_cy(m) & !mcs51_bit_read(m, arg[0]));
+        break;
+    case 0x83: // MOVC A,@A+PC
+        *a = m->code[(uint16_t)(next + *a)];
+        cycles += 2;
+        break;
+    case 0x93: // MOVC A,@A+DPTR
+        *a = m->code[(uint16_t)(mcs51_dptr(m) + *a)];
+        cycles += 2;
+        break;
+    case 0x74: // MOV A,#data
+        *a = arg[0];
+        break;
+    case 0x75: // MOV direct,#data
+        mcs51_dir_write(m, arg[0], arg[1]);
+        break;
+    case 0x76: case 0x77: // MOV @Ri,#data
+        m->iram[MCS51_REG(m, op & 1)] = arg[0];
+        break;
+    case 0x78: case 0x79: case 0x7a: case 0x7b: case 0x7c: case 0x7d: case 0x7e: case 0x7f: // MOV Rn,#data
+        MCS51_REG(m, op & 7) = arg[0];
+        break;
+    case 0x84: { // DIV AB
+        uint8_t b = m->sfr[MCS51_B - 0x80];
+        MCS51_PSWR(m) &= ~(MCS51_CY | MCS51_OV);
+        if (b == 0) {
+            MCS51_PSWR(m) |= MCS51_OV;
+        } else {
+            m->sfr[MCS51_B - 0x80] = *a % b;
+            *a /= b;
+        }
+        cycles = 5;
+        break;
+    }
+    case 0xa4: { // MUL AB
+        unsigned int r = *a * m->sfr[MCS51_B - 0x80];
+        *a = r & 0xff;
+        m->sfr[MCS51_B - 0x80] = r >> 8;
+        MCS51_PSWR(m) = (MCS51_PSWR(m) & ~(MCS51_CY | MCS51_OV)) | ((r > 0xff) ? MCS51_OV : 0);
+        cycles = 5;
+        break;
+    }
+    case 0x85: // MOV direct,direct (source first)
+        mcs51_dir_write(m, arg[1], mcs51_dir_read(m, arg[0]));
+        break;
+    case 0x86: case 0x87: // MOV direct,@Ri
+        mcs51_dir_write(m, arg[0], m->iram[MCS51_REG(m, op & 1)]);
+        break;
+    case 0x88: case 0x89: case 0x8a: case 0x8b: case 0x8c: case 0x8d: case 0x8e: case 0x8f: // MOV direct,Rn
+        mcs51_dir_write(m, arg[0], MCS51_REG(m, op & 7));
+        break;
+    case 0x90: // MOV DPTR,#data16
+        mcs51_set_dptr(m, arg[0] << 8 | arg[1]);
+        break;
+    case 0x92: // MOV bit,C
+        mcs51_bit_write(m, arg[0], mcs51_cy(m));
+        break;
+    case 0xa2: // MOV C,bit
+        mcs51_set_cy(m, mcs51_bit_read(m, arg[0]));
+        break;
+    case 0xa3: // INC DPTR
+        mcs51_set_dptr(m, mcs51_dptr(m) + 1);
+        cycles = 3;
+        break;
+    case 0xa6: case 0xa7: // MOV @Ri,direct
+        m->iram[MCS51_REG(m, op & 1)] = mcs51_dir_read(m, arg[0]);
+        break;
+    case 0xa8: case 0xa9: case 0xaa: case 0xab: case 0xac: case 0xad: case 0xae: case 0xaf: // MOV Rn,direct
+        MCS51_REG(m, op & 7) = mcs51_dir_read(m, arg[0]);
+        break;
+    case 0xb2: // CPL bit
+        mcs51_bit_write(m, arg[0], !mcs51_bit_read(m, arg[0]));
+        break;
+    case 0xb3: // CPL C
+        mcs51_set_cy(m, !mcs51_cy(m));
+        break;
+    case 0xb4: case 0xb5: case 0xb6: case 0xb7: case 0xb8: case 0xb9: case 0xba: case 0xbb: // CJNE
+    case 0xbc: case 0xbd: case 0xbe: case 0xbf: {
+        uint8_t x, y;
+        if (op == 0xb4 || op == 0xb5) {
+            x = *a;
+            y = (op == 0xb4) ? arg[0] : mcs51_dir_read(m, arg[0]);
+        } else {
+            x = (op < 0xb8) ? m->iram[MCS51_REG(m, op & 1)] : MCS51_REG(m, op & 7);
+            y = arg[0];
+        }
+        mcs51_set_cy(m, x < y);
+        next += (x != y) ? rel : 0;
+        cycles++;
+        break;
+    }
+    case 0xc0: // PUSH direct
+        mcs51_push(m, mcs51_dir_read(m, arg[0]));
+        break;
+    case 0xd0: // POP direct
+        mcs51_dir_write(m, arg[0], mcs51_pop(m));
+        break;
+    case 0xc2: // CLR bit
+        mcs51_bit_write(m, arg[0], 0);
+        break;
+    case 0xc3: // CLR C
+        mcs51_set_cy(m, 0);
+        break;
+    case 0xd2: // SETB bit
+        mcs51_bit_write(m, arg[0], 1);
+        break;
+    case 0xd3: // SETB C
+        mcs51_set_cy(m, 1);
+        break;
+    case 0xc4: // SWAP A
+        *a = (*a << 4) | (*a >> 4);
+        break;
+    case 0xc5: { // XCH A,direct
+        uint8_t t = mcs51_dir_read(m, arg[0]);
+        mcs51_dir_write(m, arg[0], *a);
+        *a = t;
+        break;
+    }
+    case 0xc6: case 0xc7: { // XCH A,@Ri
+        uint8_t *p = &m->iram[MCS51_REG(m, op & 1)];
+        uint8_t t = *p;
+        *p = *a;
+        *a = t;
+        break;
+    }
+    case 0xc8: case 0xc9: case 0xca: case 0xcb: case 0xcc: case 0xcd: case 0xce: case 0xcf: { // XCH A,Rn
+        uint8_t t = MCS51_REG(m, op & 7);
+        MCS51_REG(m, op & 7) = *a;
+        *a = t;
+        break;
+    }
+    case 0xd6: case 0xd7: { // XCHD A,@Ri
+        uint8_t *p = &m->iram[MCS51_REG(m, op & 1)];
+        uint8_t t = *p & 0x0f;
+        *p = (*p & 0xf0) | (*a & 0x0f);
+        *a = (*a & 0xf0) | t;
+        break;
+    }
+    case 0xd4: { // DA A
+        int v = *a;
+        if ((v & 0x0f) > 9 || (MCS51_PSWR(m) & MCS51_AC)) {
+            v += 0x06;
+        }
+        if ((v & 0x1f0) > 0x90 || mcs51_cy(m)) {
+            v += 0x60;
+        }
+        if (v > 0xff) {
+            mcs51_set_cy(m, 1);
+        }
+        *a = v & 0xff;
+        break;
+    }
+    case 0xd5: { // DJNZ direct,rel
+        uint8_t v = mcs51_dir_read(m, arg[0]) - 1;
+        mcs51_dir_write(m, arg[0], v);
+        next += v ? rel : 0;
+        cycles++;
+        break;
+    }
+    case 0xd8: case 0xd9: case 0xda: case 0xdb: case 0xdc: case 0xdd: case 0xde: case 0xdf: // DJNZ Rn,rel
+        next += --MCS51_REG(m, op & 7) ? rel : 0;
+        cycles++;
+        break;
+    case 0xe0: // MOVX A,@DPTR
+        *a = mcs51_xread(m, mcs51_dptr(m));
+        cycles = 2 + (m->sfr[MCS51_CKCON - 0x80] & 7);
+        break;
+    case 0xe2: case 0xe3: // MOVX A,@Ri
+        *a = mcs51_xread(m, m->sfr[MCS51_XPAGE - 0x80] << 8 | MCS51_REG(m, op & 1));
+        cycles = 2 + (m->sfr[MCS51_CKCON - 0x80] & 7);
+        break;
+    case 0xf0: // MOVX @DPTR,A
+        mcs51_xwrite(m, mcs51_dptr(m), *a);
+        cycles = 2 + (m->sfr[MCS51_CKCON - 0x80] & 7);
+        break;
+    case 0xf2: case 0xf3: // MOVX @Ri,A
+        mcs51_xwrite(m, m->sfr[MCS51_XPAGE - 0x80] << 8 | MCS51_REG(m, op & 1), *a);
+        cycles = 2 + (m->sfr[MCS51_CKCON - 0x80] & 7);
+        break;
+    case 0xe4: // CLR A
+        *a = 0;
+        break;
+    case 0xe5: // MOV A,direct
+        *a = mcs51_dir_read(m, arg[0]);
+        break;
+    case 0xe6: case 0xe7: // MOV A,@Ri
+        *a = m->iram[MCS51_REG(m, op & 1)];
+        break;
+    case 0xe8: case 0xe9: case 0xea: case 0xeb: case 0xec: case 0xed: case 0xee: case 0xef: // MOV A,Rn
+        *a = MCS51_REG(m, op & 7);
+        break;
+    case 0xf4: // CPL A
+        *a = ~*a;
+        break;
+    case 0xf5: // MOV direct,A
+        mcs51_dir_write(m, arg[0], *a);
+        break;
+    case 0xf6: case 0xf7: // MOV @Ri,A
+        m->iram[MCS51_REG(m, op & 1)] = *a;
+        break;
+    case 0xf8: case 0xf9: case 0xfa: case 0xfb: case 0xfc: case 0xfd: case 0xfe: case 0xff: // MOV Rn,A
+        MCS51_REG(m, op & 7) = *a;
+        break;
+    default: // 0xa5
+        fprintf(stderr, "8051: undefined opcode %02x at %04x\n", op, pc);
+        return -1;
+    }
+
+    // Parity of A
+    uint8_t p = *a;
+    p ^= p >> 4;
+    p ^= p >> 2;
+    p ^= p >> 1;
+    MCS51_PSWR(m) = (MCS51_PSWR(m) & ~1) | (p & 1);
+
+    m->pc = next;
+    m->cycles += cycles;
+    return cycles;
+}
+
+#endif // MCS51_IMPLEMENTATION
@@ -0,0 +1,178 @@
+//
+// Firmware check: EP6 overflow reporting of slave_sync_8
+//
+// Runs the image on the 8051 model with EP6 and EP1-IN mocked:
+//  - the FIFO is full until the host starts reading, which is not an overflow
+//  - then it becomes full a few times, each time for one packet time at the
+//    fastest sample clock; every one must be counted
+//  - the host takes an EP1-IN report only a while after it was committed, so
+//    overflows are coalesced; the reports must count up to the total and
+//    EP1INBC must not be written while EP1-IN is busy
+//  - the main loop must poll EP2468STAT at least once per packet time
+//  - EP6CFG and EP6AUTOINLEN must be set to the buffer geometry the image was
+//    built for, given as the -D flags of firmware/Makefile (default: the
+//    values in slave_sync_8.c)
+//  - a FIFO reset the host asks for in the scratch RAM mailbox
+//    (fifo_reset.h) must be done (FIFORESET NAK-all, EP6, resume) and the
+//    mailbox cleared
+//
+//   overflow_report image [-DEP6_CFG=0xe2 -DEP6_AUTOINLEN=512]
+//
+#include <stdio.h>
+#include <stdlib.h>
+#define MCS51_IMPLEMENTATION
+#include "mcs51.h"
+
+#define CYCLES_PER_US 12 // 48MHz, 4 clocks per cycle
+#define SAMPLE_MHZ 25.175 // fastest sample clock (640x480@60Hz)
+#define EP6_CFG 0xe0 // defaults of slave_sync_8.c
+#define EP6_AUTOINLEN 512
+
+#define STARTUP_FULL 20000 // cycles the FIFO is full before the host reads
+#define OVERFLOWS 8
+#define OVERFLOW_PERIOD 3000 // cycles between overflows
+#define HOST_DELAY 5000 // cycles until the host takes an EP1-IN report
+#define RUN_CYCLES (STARTUP_FULL + (OVERFLOWS + 4) * OVERFLOW_PERIOD + 2 * HOST_DELAY)
+#define RESET_AT (STARTUP_FULL + (OVERFLOWS + 2) * OVERFLOW_PERIOD) // the host asks for a FIFO reset
+
+#define EP2468STAT 0xaa
+#define bmEP6FULL 0x20
+#define EP1INCS 0xe6a2
+#define bmEPBUSY 0x02
+#define EP1INBC 0xe68f
+#define EP1INBUF 0xe7c0
+#define EP6CFG 0xe614
+#define EP6AUTOINLENH 0xe624
+#define EP6AUTOINLENL 0xe625
+#define FIFORESET 0xe604
+#define FIFO_RESET_REQ 0xe1f0 // firmware/fifo_reset.h
+
+// Cycles to fill a packet at the fastest sample clock
+static int packet_cycles;
+
+typedef struct {
+    uint64_t busy_until;
+    uint32_t reports[64];
+    int num;
+    int busy_writes;
+    uint64_t last_poll; // 0: not polled yet
+    uint64_t max_gap;
+    uint8_t resets[8]; // FIFORESET writes after RESET_AT
+    int reset_num;
+} fx2_t;
+
+// EP6 is full during the startup fill and for a packet time every period
+static int fifo_full(uint64_t t) {
+    if (t < STARTUP_FULL) {
+        return 1;
+    }
+    t -= STARTUP_FULL;
+    return t / OVERFLOW_PERIOD < OVERFLOWS && t % OVERFLOW_PERIOD >= (uint64_t)(OVERFLOW_PERIOD - packet_cycles);
+}
+
+static int sfr_read(mcs51_t *m, uint8_t addr) {
+    fx2_t *fx2 = m->user;
+    if (addr != EP2468STAT) {
+        return -1;
+    }
+    if (fx2->last_poll && m->cycles - fx2->last_poll > fx2->max_gap) {
+        fx2->max_gap = m->cycles - fx2->last_poll;
+    }
+    fx2->last_poll = m->cycles;
+    return fifo_full(m->cycles) ? bmEP6FULL : 0;
+}
+
+static int xread(mcs51_t *m, uint16_t addr) {
+    fx2_t *fx2 = m->user;
+    if (addr == EP1INCS) {
+        return (m->cycles < fx2->busy_until) ? bmEPBUSY : 0;
+    }
+    return -1;
+}
+
+static void xwrite(mcs51_t *m, uint16_t addr, uint8_t v) {
+    fx2_t *fx2 = m->user;
+    if (addr == FIFORESET && m->cycles >= RESET_AT && fx2->reset_num < 8) {
+        fx2->resets[fx2->reset_num++] = v;
+    }
+    if (addr != EP1INBC) {
+        return;
+    }
+    if (m->cycles < fx2->busy_until) {
+        fx2->busy_writes++;
+    }
+    if (v == 4 && fx2->num < 64) {
+        const uint8_t *b = &m->xram[EP1INBUF];
+        fx2->reports[fx2->num++] = b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24;
+    }
+    fx2->busy_until = m->cycles + HOST_DELAY;
+}
+
+int main(int argc, char *argv[]) {
+    const char *image = (argc > 1) ? argv[1] : "slave_sync_8.ihx";
+    unsigned int cfg = EP6_CFG, len = EP6_AUTOINLEN;
+    static mcs51_t m;
+    fx2_t fx2 = {0};
+    int failed = 0, requested = 0;
+
+    for (int i = 2; i < argc; i++) {
+        if (sscanf(argv[i], "-DEP6_CFG=%i", &cfg) != 1 && sscanf(argv[i], "-DEP6_AUTOINLEN=%i", &len) != 1) {
+            fprintf(stderr, "%s: unknown flag\n", argv[i]);
+            return 1;
+        }
+    }
+    packet_cycles = len / SAMPLE_MHZ * CYCLES_PER_US;
+    if (mcs51_load_ihx(&m, image) < 0) {
+        return 1;
+    }
+    m.sfr_read = sfr_read;
+    m.xread = xread;
+    m.xwrite = xwrite;
+    m.user = &fx2;
+    mcs51_reset(&m);
+    while (m.cycles < RUN_CYCLES) {
+        if (mcs51_step(&m) < 0) {
+            return 1;
+        }
+        if (!requested && m.cycles >= RESET_AT) {
+            m.xram[FIFO_RESET_REQ] = 1;
+            requested = 1;
+        }
+    }
+
+    unsigned int got_cfg = m.xram[EP6CFG], got_len = m.xram[EP6AUTOINLENH] << 8 | m.xram[EP6AUTOINLENL];
+    if (got_cfg != cfg || got_len != len) {
+        printf("FAIL: %s: EP6CFG 0x%02x, EP6AUTOINLEN %u, want 0x%02x, %u\n", image, got_cfg, got_len, cfg, len);
+        failed = 1;
+    }
+
+    for (int i = 0; i < fx2.num; i++) {
+        if (fx2.reports[i] == 0 || (i > 0 && fx2.reports[i] <= fx2.reports[i - 1])) {
+            printf("FAIL: %s: report %d counts %u overflows after %u\n", image, i, fx2.reports[i], i ? fx2.reports[i - 1] : 0);
+            failed = 1;
+        }
+    }
+    if (fx2.num == 0 || fx2.reports[fx2.num - 1] != OVERFLOWS) {
+        printf("FAIL: %s: reported %u overflows, want %d\n", image, fx2.num ? fx2.reports[fx2.num - 1] : 0, OVERFLOWS);
+        failed = 1;
+    }
+    if (fx2.busy_writes) {
+        printf("FAIL: %s: EP1INBC written %d times while EP1-IN was busy\n", image, fx2.busy_writes);
+        failed = 1;
+    }
+    if (fx2.max_gap > (uint64_t)packet_cycles) {
+        printf("FAIL: %s: EP2468STAT polled every %d cycles, a packet takes %d\n", image, (int)fx2.max_gap, packet_cycles);
+        failed = 1;
+    }
+    static const uint8_t fifo_reset[] = {0x80, 0x86, 0x00};
+    if (fx2.reset_num != sizeof(fifo_reset) || memcmp(fx2.resets, fifo_reset, sizeof(fifo_reset)) != 0 || m.xram[FIFO_RESET_REQ] != 0) {
+        printf("FAIL: %s: FIFO reset request: %d FIFORESET writes (want 0x80 0x86 0x00), mailbox %d\n", image, fx2.reset_num, m.xram[FIFO_RESET_REQ]);
+        failed = 1;
+    }
+    if (!failed) {
+        printf("ok: %s: EP6CFG 0x%02x, %u byte packets, %d overflows in %d reports, EP2468STAT polled every %d cycles at most (packet: %d), FIFO reset "
+               "on request\n",
+               image, cfg, len, OVERFLOWS, fx2.num, (int)fx2.max_gap, packet_cycles);
+    }
+    return failed;
+}
@@ -0,0 +1,146 @@
+//
+// Frame pacer: which presented frame to show on each vsync of a display that
+// is not locked to the source
+//
+// The source and the display refresh drift against each other by
+// |src_hz - disp_hz| frames a second, so a frame has to be shown twice or
+// not at all every 1 / |src_hz - disp_hz| seconds. Showing the latest frame
+// on each vsync does that in bursts: while the frame completions pass the
+// vsync, their jitter (and the vsync's) decides anew on every vsync whether a
+// frame is late (repeat) or early (the next one replaces it: drop).
+//
+// The pacer keeps a schedule instead: the source frame due at each vsync,
+// advanced by exactly src_hz / disp_hz frames per vsync. Its phase is pulled
+// slowly towards half a frame behind the latest completion, so the jitter
+// hardly moves it. The frame shown steps by one on every vsync, and by two
+// (drop) or none (repeat) only once the schedule is more than a hysteresis
+// ahead or behind: once per drift period, and never back and forth when the
+// rates are the same. The frame shown completed half a frame before the vsync
+// on average, which is the latency this costs. Without the rates, the latest
+// frame is shown on each vsync.
+//
+// The caller serializes the calls (the MGL headers hold vram_mtx).
+//
+#ifndef __FRAME_PACER_H_
+#define __FRAME_PACER_H_
+
+#include <stdint.h>
+#include "frame_pool.h"
+
+#define FRAME_PACER_SMOOTH 256 // vsyncs the phase of the schedule follows the source over
+#define FRAME_PACER_SLIP 0.75  // source frames off the schedule to restart it
+#define FRAME_PACER_HYST 0.125 // source frames the schedule may lead or lag the frame shown
+
+typedef struct {
+    double rate;       // source frames per vsync, 0 if not paced
+    double period;     // source frame period (us)
+    double due;        // source frame due at the latest vsync, with its phase
+    double shown;      // number of the frame to show at the latest vsync
+    int started;       // due follows the source
+    uint64_t seq;      // frames pushed
+    int64_t seq_us;    // completion time of the latest one
+    frame_t *held;     // frame pushed before ready, not shown yet
+    frame_t *ready;    // latest frame pushed, not shown yet
+    uint64_t held_seq; // their numbers
+    uint64_t ready_seq;
+} frame_pacer_t;
+
+// Prototypes
+//--------------------------------------------------------------------------------
+void frame_pacer_set(frame_pacer_t *p, double src_hz, double disp_hz);
+int frame_pacer_push(frame_pacer_t *p, frame_t *f, int64_t now);
+frame_t *frame_pacer_take(frame_pacer_t *p, int64_t now, int *dropped);
+frame_t *frame_pacer_reclaim(frame_pacer_t *p);
+
+#endif // __FRAME_PACER_H_
+#if defined(FRAME_PACER_IMPLEMENTATION) && !defined(__FRAME_PACER_IMPL_)
+#define __FRAME_PACER_IMPL_ // also included by the MGL headers
+
+#include <math.h>
+
+// Measured source and display refresh; 0 for either shows the latest frame on
+// each vsync. The schedule keeps its phase when the rates are only updated.
+void frame_pacer_set(frame_pacer_t *p, double src_hz, double disp_hz) {
+    if (src_hz > 0 && disp_hz > 0) {
+        p->rate = src_hz / disp_hz;
+        p->period = 1000000.0 / src_hz;
+    } else {
+        p->rate = 0;
+        p->started = 0;
+    }
+}
+
+// Queue a frame completed at now; the pacer takes over the caller's reference.
+// Returns the frames dropped unseen (0 or 1): only the latest two are kept.
+int frame_pacer_push(frame_pacer_t *p, frame_t *f, int64_t now) {
+    int dropped = 0;
+    if (p->held) {
+        frame_release(p->held);
+        dropped = 1;
+    }
+    p->held = p->ready;
+    p->held_seq = p->ready_seq;
+    p->ready = f;
+    p->ready_seq = ++p->seq;
+    p->seq_us = now;
+    return dropped;
+}
+
+// At a vsync: the frame to show (the caller takes over its reference), or NULL
+// to show the previous one again. *dropped: queued frames passed over.
+frame_t *frame_pacer_take(frame_pacer_t *p, int64_t now, int *dropped) {
+    uint64_t due = p->seq; // not paced: the latest frame
+    if (p->rate > 0 && p->seq) {
+        // Where the schedule should be: half a frame behind the source
+        double target = p->seq + (now - p->seq_us) / p->period - 0.5;
+        p->due += p->rate;
+        double err = target - p->due;
+        if (!p->started || fabs(err) > FRAME_PACER_SLIP) {
+            p->due = target; // start, or the source stalled or jumped
+            p->shown = floor(target);
+            p->started = 1;
+        } else {
+            p->due += err / FRAME_PACER_SMOOTH;
+            double lead = p->due - ++p->shown;
+            if (lead >= 1 + FRAME_PACER_HYST) {
+                p->shown++; // drop
+            } else if (lead < -FRAME_PACER_HYST) {
+                p->shown--; // repeat
+            }
+        }
+        due = (p->shown > 0) ? (uint64_t)p->shown : 0;
+    }
+
+    frame_t *f = NULL;
+    *dropped = 0;
+    if (p->ready && p->ready_seq <= due) {
+        if (p->held) {
+            frame_release(p->held);
+            *dropped = 1;
+        }
+        f = p->ready;
+        p->held = p->ready = NULL;
+    } else if (p->held && p->held_seq <= due) {
+        f = p->held;
+        p->held = NULL;
+    }
+    return f;
+}
+
+// A queued frame that nobody else holds any more (the oldest), to be drawn over
+// again when the pool is exhausted. It will not be shown.
+frame_t *frame_pacer_reclaim(frame_pacer_t *p) {
+    frame_t *f = NULL;
+    if (p->held && frame_exclusive(p->held)) {
+        f = p->held;
+        p->held = NULL;
+    } else if (p->ready && frame_exclusive(p->ready)) {
+        f = p->ready;
+        p->ready = p->held;
+        p->ready_seq = p->held_seq;
+        p->held = NULL;
+    }
+    return f;
+}
+
+#endif // FRAME_PACER_IMPLEMENTATION
@@ -0,0 +1,138 @@
+//
+// Frame pool: a fixed set of frame buffers with atomic reference counts
+//
+// The producer takes a free frame (frame_pool_get(), one reference), draws
+// into it and publishes it: every subscriber is called with the frame and
+// keeps it by taking a reference of its own. A frame is free again when the
+// last reference is released. Nothing is allocated or copied after
+// frame_pool_init(). When every frame is held, frame_pool_get() returns NULL
+// and counts it in exhausted.
+//
+//   static void record(frame_t *f, void *user) {
+//       frame_ref(f);
+//       ... queue f, frame_release(f) once written
+//   }
+//   frame_pool_subscribe(pool, record, NULL);
+//
+// Subscribers are called on the producer's thread and must not block.
+//
+#ifndef __FRAME_POOL_H_
+#define __FRAME_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_POOL_MAX 8
+#define FRAME_SINK_MAX 4
+
+typedef struct frame_pool frame_pool_t;
+typedef struct {
+    uint8_t *data;
+    uint64_t seq; // publication number
+    int refs;
+    frame_pool_t *pool;
+} frame_t;
+
+typedef void (*frame_sink_t)(frame_t *frame, void *user);
+
+struct frame_pool {
+    frame_t frames[FRAME_POOL_MAX];
+    int num;
+    size_t size;  // bytes of a frame
+    int own_data; // data allocated by frame_pool_init()
+    uint64_t seq;
+    uint64_t exhausted; // frame_pool_get() calls that found every frame held
+    struct {
+        frame_sink_t fn;
+        void *user;
+    } sinks[FRAME_SINK_MAX];
+    int sink_num;
+};
+
+// Prototypes
+//--------------------------------------------------------------------------------
+int frame_pool_init(frame_pool_t *pool, int num, size_t size, uint8_t *const *data);
+void frame_pool_free(frame_pool_t *pool);
+frame_t *frame_pool_get(frame_pool_t *pool);
+int frame_pool_subscribe(frame_pool_t *pool, frame_sink_t fn, void *user);
+void frame_pool_publish(frame_pool_t *pool, frame_t *frame);
+
+static inline void frame_ref(frame_t *f) { __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED); }
+static inline void frame_release(frame_t *f) { __atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL); }
+
+// Only the caller holds the frame (no subscriber can take it any more)
+static inline int frame_exclusive(frame_t *f) { return __atomic_load_n(&f->refs, __ATOMIC_ACQUIRE) == 1; }
+
+#endif // __FRAME_POOL_H_
+#if defined(FRAME_POOL_IMPLEMENTATION) && !defined(__FRAME_POOL_IMPL_)
+#define __FRAME_POOL_IMPL_ // also included by the MGL headers
+
+#include <stdlib.h>
+#include <string.h>
+
+//--------------------------------------------------------------------------------
+// num frames of size bytes, zero filled. With data, the frames use the given
+// buffers (e.g. mapped display memory) instead.
+//--------------------------------------------------------------------------------
+int frame_pool_init(frame_pool_t *pool, int num, size_t size, uint8_t *const *data) {
+    if (num > FRAME_POOL_MAX) {
+        return -1;
+    }
+    memset(pool, 0, sizeof(*pool));
+    pool->num = num;
+    pool->size = size;
+    pool->own_data = (data == NULL);
+    for (int i = 0; i < num; i++) {
+        frame_t *f = &pool->frames[i];
+        f->pool = pool;
+        f->data = data ? data[i] : calloc(1, size);
+        if (f->data == NULL) {
+            frame_pool_free(pool);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void frame_pool_free(frame_pool_t *pool) {
+    if (pool->own_data) {
+        for (int i = 0; i < pool->num; i++) {
+            free(pool->frames[i].data);
+        }
+    }
+    memset(pool, 0, sizeof(*pool));
+}
+
+// A free frame with one reference, NULL if all are held
+frame_t *frame_pool_get(frame_pool_t *pool) {
+    for (int i = 0; i < pool->num; i++) {
+        frame_t *f = &pool->frames[i];
+        int free_refs = 0;
+        if (__atomic_compare_exchange_n(&f->refs, &free_refs, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return f;
+        }
+    }
+    __atomic_add_fetch(&pool->exhausted, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// Add a subscriber before the first frame is published
+int frame_pool_subscribe(frame_pool_t *pool, frame_sink_t fn, void *user) {
+    if (pool->sink_num >= FRAME_SINK_MAX) {
+        return -1;
+    }
+    pool->sinks[pool->sink_num].fn = fn;
+    pool->sinks[pool->sink_num].user = user;
+    pool->sink_num++;
+    return 0;
+}
+
+// Hand a finished frame to the subscribers. The caller keeps its reference.
+void frame_pool_publish(frame_pool_t *pool, frame_t *frame) {
+    frame->seq = ++pool->seq;
+    for (int i = 0; i < pool->sink_num; i++) {
+        pool->sinks[i].fn(frame, pool->sinks[i].user);
+    }
+}
+
+#endif // FRAME_POOL_IMPLEMENTATION
@@ -0,0 +1,568 @@
+//
+// Virtual FX2 for end-to-end tests without the hardware
+//
+// A FunctionFS gadget on any USB device controller, normally dummy_hcd, that
+// looks like the FX2 to digital_rgb_display: 04b4:8613, interface 0 alt 1
+// with EP1-IN (FIFO overflow count) and EP6-IN bulk. Firmware downloads
+// (vendor request 0xA0) are accepted and the CPUCS reset/run is followed, as
+// are FIFO reset requests (firmware/fifo_reset.h).
+// While the "firmware" runs, VH-RGB samples (a synthetic test pattern or a
+// raw tap file written with -t, its recorded gaps as idle samples) are
+// streamed on EP6 at the sample rate.
+// Samples that do not fit into the FIFO while the host is not reading are
+// dropped and counted, as on the FX2.
+//
+//   sudo modprobe dummy_hcd && sudo modprobe libcomposite && sudo modprobe usb_f_fs
+//   sudo ./fx2_emu [-r MB/s] [-f file] [-u udc]
+//
+// Needs configfs at /sys/kernel/config and FunctionFS with alternate
+// settings (Linux 5.10 or later). The iso firmware (-f iso) is not emulated.
+//
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/ioctl.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+#include "test_pattern.h"
+
+#define GADGET "/sys/kernel/config/usb_gadget/fx2emu"
+#define FFS_NAME "fx2"
+#define FFS_MOUNT "/dev/ffs-fx2"
+#define VID 0x04b4
+#define PID 0x8613
+#define CPUCS 0xe600
+#define FIFO_RESET_REQ 0xe1f0 // firmware/fifo_reset.h
+#define CHUNK (16 * 1024)      // bytes per EP6 write
+#define FIFO_SIZE (64 * 1024)  // more than the FX2's 2KB: user space is scheduled more coarsely
+#define MB (1024.0 * 1024.0)
+
+#define PATTERN_FRAMES 8
+#define PATTERN_HZ 60
+
+static int64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+//======================================================================
+// Sample source
+//======================================================================
+static uint8_t *src;
+static size_t src_len;
+static size_t src_pos;
+
+// Samples the raw tap could not write (<file>.gaps, see raw_tap.h), replayed
+// as idle samples of the same length so the timing after a gap is kept
+#define GAPS_MAX 4096
+static struct {
+    size_t offset, len;
+} gaps[GAPS_MAX];
+static int gap_num;
+static int gap_next;    // next gap in the file
+static size_t gap_left; // idle samples still to send
+
+static int source_init(const char *path) {
+    if (path == NULL) {
+        src = malloc(PATTERN_FRAMES * PATTERN_FRAME_LEN);
+        for (int f = 0; f < PATTERN_FRAMES; f++) {
+            src_len += pattern_frame(src + src_len, pattern_bars, f);
+        }
+        return 0;
+    }
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        perror("Emu: Cannot open sample file");
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    src_len = ftell(fp);
+    rewind(fp);
+    src = malloc(src_len);
+    if (src_len == 0 || fread(src, 1, src_len, fp) != src_len) {
+        fprintf(stderr, "Emu: Cannot read %s.\n", path);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    char gap_path[strlen(path) + sizeof(".gaps")];
+    snprintf(gap_path, sizeof(gap_path), "%s.gaps", path);
+    fp = fopen(gap_path, "r");
+    if (fp != NULL) {
+        unsigned long long offset, len;
+        size_t total = 0;
+        while (gap_num < GAPS_MAX && fscanf(fp, "%llu %llu", &offset, &len) == 2) {
+            if (offset <= src_len && (gap_num == 0 || offset >= gaps[gap_num - 1].offset)) {
+                gaps[gap_num].offset = offset;
+                gaps[gap_num].len = len;
+                gap_num++;
+                total += len;
+            }
+        }
+        fclose(fp);
+        printf("Emu: %d gaps (%zu bytes) in %s, replayed as idle samples.\n", gap_num, total, path);
+    }
+    return 0;
+}
+
+// Next len samples, looping over the source (buf NULL: skip them)
+static void source_read(uint8_t *buf, size_t len) {
+    while (len > 0) {
+        if (!gap_left && gap_next < gap_num && gaps[gap_next].offset == src_pos) {
+            gap_left = gaps[gap_next++].len;
+            continue;
+        }
+        if (!gap_left && src_pos == src_len) {
+            src_pos = 0;
+            gap_next = 0;
+            continue;
+        }
+        size_t n;
+        if (gap_left) {
+            n = gap_left < len ? gap_left : len;
+            if (buf != NULL) {
+                memset(buf, (1 << BIT_VSYNC) | (1 << BIT_HSYNC), n);
+            }
+            gap_left -= n;
+        } else {
+            size_t end = (gap_next < gap_num) ? gaps[gap_next].offset : src_len;
+            n = end - src_pos < len ? end - src_pos : len;
+            if (buf != NULL) {
+                memcpy(buf, src + src_pos, n);
+            }
+            src_pos += n;
+        }
+        if (buf != NULL) {
+            buf += n;
+        }
+        len -= n;
+    }
+}
+
+static void source_skip(size_t len) { source_read(NULL, len); }
+
+//======================================================================
+// Device state
+//======================================================================
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static volatile int enabled = 0;    // configured, alternate setting selected
+static volatile int running = 0;    // CPUCS out of reset
+static volatile int generation = 0; // firmware starts: restarts the FIFO
+static volatile int fifo_resets = 0; // FIFO reset requests: restart the FIFO, keep the count
+static uint32_t overflows = 0;      // since the firmware started
+static double rate;                 // bytes per second
+static volatile int quit = 0;
+static int ep0_fd = -1, stat_fd = -1, data_fd = -1;
+
+//----------------------------------------------------------------------
+// EP6: the samples clocked in since the firmware started, FIFO_SIZE at most
+// waiting for the host
+//----------------------------------------------------------------------
+static void *stream_run(void *arg) {
+    static uint8_t buf[CHUNK];
+    while (!quit) {
+        pthread_mutex_lock(&mtx);
+        while (!(enabled && running) && !quit) {
+            pthread_cond_wait(&cond, &mtx);
+        }
+        int gen = generation, resets = fifo_resets;
+        pthread_mutex_unlock(&mtx);
+
+        int64_t start = now_us();
+        uint64_t sent = 0;
+        int full = 1; // as the FX2: the FIFO fills before the host reads, not an overflow
+        while (enabled && running && gen == generation && resets == fifo_resets && !quit) {
+            uint64_t clocked = (now_us() - start) * rate / 1000000.0;
+            uint64_t fifo = clocked - sent;
+            if (fifo > FIFO_SIZE) {
+                source_skip(fifo - FIFO_SIZE);
+                sent += fifo - FIFO_SIZE;
+                if (!full) {
+                    pthread_mutex_lock(&mtx);
+                    overflows++;
+                    pthread_cond_broadcast(&cond);
+                    pthread_mutex_unlock(&mtx);
+                }
+                full = 1;
+                fifo = FIFO_SIZE;
+            } else if (sent) {
+                full = 0;
+            }
+            if (fifo < CHUNK) {
+                usleep((CHUNK - fifo) * 1000000.0 / rate);
+                continue;
+            }
+
+            source_read(buf, CHUNK);
+            if (write(data_fd, buf, CHUNK) < 0) {
+                usleep(10000);
+                break; // disabled (alternate setting changed, unbound): wait for the next enable
+            }
+            sent += CHUNK;
+        }
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------
+// EP1: the overflow count whenever it has changed (32bit little endian)
+//----------------------------------------------------------------------
+static void *stat_run(void *arg) {
+    uint32_t reported = 0;
+    int gen = -1;
+    while (!quit) {
+        pthread_mutex_lock(&mtx);
+        while (!quit && (!enabled || (gen == generation && overflows == reported))) {
+            pthread_cond_wait(&cond, &mtx);
+        }
+        if (gen != generation) {
+            gen = generation;
+            reported = 0;
+        }
+        uint32_t count = overflows;
+        pthread_mutex_unlock(&mtx);
+        if (count == reported) {
+            continue;
+        }
+
+        uint8_t d[4] = {count, count >> 8, count >> 16, count >> 24};
+        if (write(stat_fd, d, sizeof(d)) == sizeof(d)) {
+            reported = count;
+            printf("Emu: FIFO overflow, samples dropped (%u so far).\n", count);
+        } else {
+            usleep(100000);
+        }
+    }
+    return NULL;
+}
+
+//======================================================================
+// EP0
+//======================================================================
+static uint32_t loaded = 0; // firmware bytes since the CPU reset
+
+static void ep0_setup(const struct usb_ctrlrequest *req) {
+    uint16_t value = le16toh(req->wValue);
+    uint16_t length = le16toh(req->wLength);
+
+    // Firmware load: write RAM. CPUCS bit0 holds the CPU in reset.
+    if (req->bRequestType == (USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE) && req->bRequest == 0xa0) {
+        uint8_t dat[4096];
+        ssize_t n = read(ep0_fd, dat, length < sizeof(dat) ? length : sizeof(dat));
+        if (n <= 0) {
+            return;
+        }
+        if (value <= CPUCS && CPUCS < value + n) {
+            pthread_mutex_lock(&mtx);
+            running = !(dat[CPUCS - value] & 1);
+            if (running) {
+                generation++;
+                overflows = 0;
+                printf("Emu: Firmware started (%u bytes loaded), streaming at %.3f MB/s.\n", loaded, rate / MB);
+            } else {
+                loaded = 0;
+            }
+            pthread_cond_broadcast(&cond);
+            pthread_mutex_unlock(&mtx);
+        } else if (running && value <= FIFO_RESET_REQ && FIFO_RESET_REQ < value + n) {
+            if (dat[FIFO_RESET_REQ - value]) {
+                fifo_resets++;
+                printf("Emu: FIFO reset.\n");
+            }
+        } else {
+            loaded += n;
+        }
+        return;
+    }
+
+    // Anything else: stall (a transfer in the wrong direction)
+    ssize_t ret = (req->bRequestType & USB_DIR_IN) ? read(ep0_fd, NULL, 0) : write(ep0_fd, NULL, 0);
+    (void)ret;
+}
+
+static void ep0_run() {
+    static const char *names[] = {"BIND", "UNBIND", "ENABLE", "DISABLE", "SETUP", "SUSPEND", "RESUME"};
+    struct usb_functionfs_event ev[4];
+    while (!quit) {
+        ssize_t n = read(ep0_fd, ev, sizeof(ev));
+        if (n < 0) {
+            if (errno != EINTR) {
+                perror("Emu: EP0 read failed");
+                return;
+            }
+            continue;
+        }
+        for (int i = 0; i < n / (int)sizeof(ev[0]); i++) {
+            if (ev[i].type != FUNCTIONFS_SETUP) {
+                printf("Emu: %s\n", ev[i].type < sizeof(names) / sizeof(names[0]) ? names[ev[i].type] : "?");
+            }
+            pthread_mutex_lock(&mtx);
+            switch (ev[i].type) {
+            case FUNCTIONFS_ENABLE:
+                enabled = 1;
+                break;
+            case FUNCTIONFS_DISABLE:
+            case FUNCTIONFS_UNBIND:
+            case FUNCTIONFS_SUSPEND:
+                enabled = 0;
+                break;
+            }
+            pthread_cond_broadcast(&cond);
+            pthread_mutex_unlock(&mtx);
+
+            if (ev[i].type == FUNCTIONFS_ENABLE) {
+                struct usb_endpoint_descriptor desc;
+                if (ioctl(data_fd, FUNCTIONFS_ENDPOINT_DESC, &desc) == 0 && desc.bEndpointAddress != (USB_DIR_IN | 6)) {
+                    printf("Emu: The UDC gave the sample endpoint address 0x%02x, the host expects 0x86.\n", desc.bEndpointAddress);
+                }
+            } else if (ev[i].type == FUNCTIONFS_SETUP) {
+                ep0_setup(&ev[i].u.setup);
+            }
+        }
+    }
+}
+
+//======================================================================
+// Gadget: configfs + FunctionFS
+//======================================================================
+static int write_file(const char *path, const char *fmt, ...) {
+    char buf[128];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    int fd = open(path, O_WRONLY);
+    if (fd < 0 || write(fd, buf, len) != len) {
+        fprintf(stderr, "Emu: Cannot write %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// Interface 0: alt 0 without endpoints, alt 1 with EP1-IN and EP6-IN bulk
+static int ffs_write_descriptors() {
+    struct {
+        struct usb_interface_descriptor alt0, alt1;
+        struct usb_endpoint_descriptor_no_audio stat, data;
+    } __attribute__((packed)) speed[2];
+    struct {
+        struct usb_functionfs_descs_head_v2 header;
+        __le32 fs_count, hs_count;
+        typeof(speed) speed;
+    } __attribute__((packed)) descs;
+    struct usb_functionfs_strings_head strings;
+
+    memset(speed, 0, sizeof(speed));
+    for (int s = 0; s < 2; s++) {
+        uint16_t max = s ? 512 : 64; // full speed, high speed
+        speed[s].alt0.bLength = speed[s].alt1.bLength = USB_DT_INTERFACE_SIZE;
+        speed[s].alt0.bDescriptorType = speed[s].alt1.bDescriptorType = USB_DT_INTERFACE;
+        speed[s].alt0.bInterfaceClass = speed[s].alt1.bInterfaceClass = USB_CLASS_VENDOR_SPEC;
+        speed[s].alt1.bAlternateSetting = 1;
+        speed[s].alt1.bNumEndpoints = 2;
+        speed[s].stat.bLength = speed[s].data.bLength = USB_DT_ENDPOINT_SIZE;
+        speed[s].stat.bDescriptorType = speed[s].data.bDescriptorType = USB_DT_ENDPOINT;
+        speed[s].stat.bEndpointAddress = USB_DIR_IN | 1;
+        speed[s].data.bEndpointAddress = USB_DIR_IN | 6;
+        speed[s].stat.bmAttributes = speed[s].data.bmAttributes = USB_ENDPOINT_XFER_BULK;
+        speed[s].stat.wMaxPacketSize = speed[s].data.wMaxPacketSize = htole16(max);
+    }
+
+    memset(&descs, 0, sizeof(descs));
+    descs.header.magic = htole32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2);
+    descs.header.length = htole32(sizeof(descs));
+    // All control requests come to us: the 0xA0 firmware load is a device request
+    descs.header.flags = htole32(FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC | FUNCTIONFS_ALL_CTRL_RECIP);
+    descs.fs_count = descs.hs_count = htole32(4);
+    memcpy(descs.speed, speed, sizeof(speed));
+
+    memset(&strings, 0, sizeof(strings));
+    strings.magic = htole32(FUNCTIONFS_STRINGS_MAGIC);
+    strings.length = htole32(sizeof(strings));
+
+    if (write(ep0_fd, &descs, sizeof(descs)) != sizeof(descs) || write(ep0_fd, &strings, sizeof(strings)) != sizeof(strings)) {
+        perror("Emu: FunctionFS descriptors rejected");
+        return -1;
+    }
+    return 0;
+}
+
+// First UDC in /sys/class/udc (dummy_udc.0 with dummy_hcd)
+static int udc_find(char *name, int size) {
+    DIR *dir = opendir("/sys/class/udc");
+    struct dirent *e;
+    while (dir != NULL && (e = readdir(dir)) != NULL) {
+        if (e->d_name[0] != '.') {
+            snprintf(name, size, "%.*s", size - 1, e->d_name);
+            closedir(dir);
+            return 0;
+        }
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+    return -1;
+}
+
+// Also cleans up after a run that did not detach
+static void gadget_remove() {
+    int fd = open(GADGET "/UDC", O_WRONLY);
+    if (fd >= 0) {
+        ssize_t ret = write(fd, "\n", 1); // unbind
+        (void)ret;
+        close(fd);
+    }
+    if (ep0_fd >= 0) {
+        close(ep0_fd);
+    }
+    umount2(FFS_MOUNT, MNT_DETACH);
+    rmdir(FFS_MOUNT);
+    unlink(GADGET "/configs/c.1/ffs." FFS_NAME);
+    rmdir(GADGET "/configs/c.1/strings/0x409");
+    rmdir(GADGET "/configs/c.1");
+    rmdir(GADGET "/functions/ffs." FFS_NAME);
+    rmdir(GADGET "/strings/0x409");
+    rmdir(GADGET);
+}
+
+static int gadget_create(const char *udc) {
+    if (mkdir(GADGET, 0755) < 0) {
+        perror("Emu: Cannot create " GADGET " (configfs mounted, libcomposite loaded?)");
+        return -1;
+    }
+    mkdir(GADGET "/strings/0x409", 0755);
+    mkdir(GADGET "/configs/c.1", 0755);
+    mkdir(GADGET "/configs/c.1/strings/0x409", 0755);
+    if (write_file(GADGET "/idVendor", "0x%04x", VID) < 0 || write_file(GADGET "/idProduct", "0x%04x", PID) < 0 ||
+        write_file(GADGET "/bcdDevice", "0xa001") < 0 || write_file(GADGET "/bcdUSB", "0x0200") < 0 ||
+        write_file(GADGET "/strings/0x409/product", "FX2 emulator") < 0 || write_file(GADGET "/configs/c.1/MaxPower", "100") < 0) {
+        return -1;
+    }
+    if (mkdir(GADGET "/functions/ffs." FFS_NAME, 0755) < 0) {
+        perror("Emu: Cannot create the FunctionFS function (usb_f_fs loaded?)");
+        return -1;
+    }
+    if (symlink(GADGET "/functions/ffs." FFS_NAME, GADGET "/configs/c.1/ffs." FFS_NAME) < 0) {
+        perror("Emu: Cannot add the function to the configuration");
+        return -1;
+    }
+
+    mkdir(FFS_MOUNT, 0755);
+    if (mount(FFS_NAME, FFS_MOUNT, "functionfs", 0, NULL) < 0) {
+        perror("Emu: Cannot mount FunctionFS");
+        return -1;
+    }
+    ep0_fd = open(FFS_MOUNT "/ep0", O_RDWR);
+    if (ep0_fd < 0 || ffs_write_descriptors() < 0) {
+        return -1;
+    }
+    // The endpoint files exist once the descriptors are written, in descriptor order
+    stat_fd = open(FFS_MOUNT "/ep1", O_RDWR);
+    data_fd = open(FFS_MOUNT "/ep2", O_RDWR);
+    if (stat_fd < 0 || data_fd < 0) {
+        perror("Emu: Cannot open the endpoint files");
+        return -1;
+    }
+
+    if (write_file(GADGET "/UDC", "%s", udc) < 0) {
+        return -1;
+    }
+    printf("Emu: FX2 %04x:%04x attached to %s.\n", VID, PID, udc);
+    return 0;
+}
+
+//======================================================================
+// Main
+//======================================================================
+static void on_signal(int sig) { quit = 1; }
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-r MB/s] [-f file] [-u udc]\n", prog);
+    fprintf(stderr, "  -r MB/s  Sample rate (default: the test pattern at %d Hz)\n", PATTERN_HZ);
+    fprintf(stderr, "  -f file  Stream the raw samples of file (e.g. written with -t), looped, instead of the test pattern\n");
+    fprintf(stderr, "  -u udc   USB device controller (default: the first one in /sys/class/udc)\n");
+}
+
+int main(int argc, char *argv[]) {
+    setvbuf(stdout, (char *)NULL, _IONBF, 0);
+
+    char udc[64] = "";
+    char *path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:f:u:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            rate = atof(optarg) * MB;
+            break;
+        case 'f':
+            path = optarg;
+            break;
+        case 'u':
+            snprintf(udc, sizeof(udc), "%s", optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (source_init(path) < 0) {
+        return -1;
+    }
+    if (rate <= 0) {
+        rate = (double)PATTERN_FRAME_LEN * PATTERN_HZ;
+    }
+    if (!udc[0] && udc_find(udc, sizeof(udc)) < 0) {
+        fprintf(stderr, "Emu: No USB device controller (modprobe dummy_hcd?).\n");
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal; // no SA_RESTART: interrupts the EP0 read
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    gadget_remove();
+    if (gadget_create(udc) < 0) {
+        gadget_remove();
+        return -1;
+    }
+
+    pthread_t stream_th, stat_th;
+    if (pthread_create(&stream_th, NULL, stream_run, NULL) != 0 || pthread_create(&stat_th, NULL, stat_run, NULL) != 0) {
+        perror("Emu: Failed to start threads");
+        gadget_remove();
+        return -1;
+    }
+
+    ep0_run();
+
+    puts("\nEmu: Detaching.");
+    pthread_mutex_lock(&mtx);
+    quit = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mtx);
+    gadget_remove(); // unbinding fails the pending endpoint writes
+    return 0;
+}
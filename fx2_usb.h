@@ -0,0 +1,194 @@
+//
+// FX2 USB helpers: built-in firmware images, firmware download (vendor
+// request 0xA0), FIFO reset request and device lookup by bus-port path
+//
+// Shared by digital_rgb_display and usb_bench. Define FX2_USB_IMPLEMENTATION
+// in one file before including it; the firmware table and FIRMWARE_VARIANTS
+// are only visible there.
+//
+#ifndef __FX2_USB_H_
+#define __FX2_USB_H_
+
+#include <stdint.h>
+#include <libusb.h>
+
+#define VID 0x04b4
+#define PID 0x8613
+#define IN_EP (LIBUSB_ENDPOINT_IN | 6)
+#define FIFO_RESET_REQ 0xe1f0 // mailbox polled by the firmware (firmware/fifo_reset.h)
+
+// Prototypes
+//--------------------------------------------------------------------------------
+int usb_write_ram(libusb_device_handle *usb_handle, int addr, uint8_t *dat, int size);
+int usb_load_firmware(libusb_device_handle *usb_handle, char *firmware[]);
+int usb_fifo_reset(libusb_device_handle *usb_handle);
+void usb_device_path(libusb_device *dev, char *path, int size);
+libusb_device_handle *usb_open_device(const char *path);
+
+#endif // __FX2_USB_H_
+#ifdef FX2_USB_IMPLEMENTATION
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+// Built-in firmware hex strings: EP6 buffer geometry variants (firmware/Makefile)
+static char *firmware_q512[] = {
+#include "firmware/slave_sync_8.inc"
+    NULL};
+static char *firmware_d512[] = {
+#include "firmware/slave_sync_8_d512.inc"
+    NULL};
+static char *firmware_d1024[] = {
+#include "firmware/slave_sync_8_d1024.inc"
+    NULL};
+static char *firmware_gated[] = {
+#include "firmware/gpif_gated_8.inc"
+    NULL};
+static char *firmware_iso[] = {
+#include "firmware/iso_sync_8.inc"
+    NULL};
+static const struct {
+    const char *name;
+    const char *desc;
+    char **image;
+    int gated; // sends the active area only (rgb_decoder_t.gated)
+    int iso;   // isochronous EP6, renumerates with its own descriptors (last: no way back without a replug)
+} firmware_variant[] = {
+    {"q512", "512 bytes x4 (default)", firmware_q512, 0, 0},
+    {"d512", "512 bytes x2", firmware_d512, 0, 0},
+    {"d1024", "1024 bytes x2", firmware_d1024, 0, 0},
+    {"gated", "GPIF, active area only", firmware_gated, 1, 0},
+    {"iso", "iso 1024 bytes x2 / uframe", firmware_iso, 0, 1},
+};
+#define FIRMWARE_VARIANTS (sizeof(firmware_variant) / sizeof(firmware_variant[0]))
+
+//----------------------------------------------------------------------
+// USB write RAM
+//----------------------------------------------------------------------
+#define USB_WRITE_RAM_MAX_SIZE 64
+int usb_write_ram(libusb_device_handle *usb_handle, int addr, uint8_t *dat, int size) {
+    assert(usb_handle != NULL);
+
+    for (int i = 0; i < size; i += USB_WRITE_RAM_MAX_SIZE) {
+        int len = (size - i > USB_WRITE_RAM_MAX_SIZE) ? USB_WRITE_RAM_MAX_SIZE : size - i;
+        int ret = libusb_control_transfer(usb_handle, LIBUSB_REQUEST_TYPE_VENDOR, 0xa0, addr + i, 0, dat + i, len, 1000);
+        if (ret < 0) {
+            fprintf(stderr, "USB: Write Ram at %04x (len %d) failed.\n", addr + i, len);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------
+// USB load firmware
+//----------------------------------------------------------------------
+#define FIRMWARE_MAX_SIZE_PER_LINE 64
+static uint8_t firmware_dat[FIRMWARE_MAX_SIZE_PER_LINE];
+int usb_load_firmware(libusb_device_handle *usb_handle, char *firmware[]) {
+    int ret;
+
+    // Take the CPU into RESET
+    uint8_t dat = 1;
+    ret = usb_write_ram(usb_handle, 0xe600, &dat, sizeof(dat));
+    if (ret < 0) {
+        return -1;
+    }
+
+    // Load firmware
+    int size, addr, record_type, tmp_dat;
+    for (int i = 0; firmware[i] != NULL; i++) {
+        char *p = firmware[i] + 1;
+
+        // Extract size
+        ret = sscanf(p, "%2x", &size);
+        assert(ret != 0);
+        assert(size <= FIRMWARE_MAX_SIZE_PER_LINE);
+        p += 2;
+
+        // Extract addr
+        ret = sscanf(p, "%4x", &addr);
+        assert(ret != 0);
+        p += 4;
+
+        // Extract record type
+        ret = sscanf(p, "%2x", &record_type);
+        assert(ret != 0);
+        p += 2;
+
+        // Write program to EZ-USB's RAM (record_type==0).
+        if (record_type == 0) {
+            for (int j = 0; j < size; j++) {
+                ret = sscanf(p, "%2x", &tmp_dat);
+                firmware_dat[j] = tmp_dat & 0xff;
+                assert(ret != 0);
+                p += 2;
+            }
+
+            ret = usb_write_ram(usb_handle, addr, firmware_dat, size);
+            if (ret < 0) {
+                return -1;
+            }
+        }
+    }
+
+    // Take the CPU out of RESET (run)
+    dat = 0;
+    ret = usb_write_ram(usb_handle, 0xe600, &dat, sizeof(dat));
+    if (ret < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+//----------------------------------------------------------------------
+// Ask the running firmware to reset the EP6 FIFO
+//----------------------------------------------------------------------
+int usb_fifo_reset(libusb_device_handle *usb_handle) {
+    uint8_t dat = 1;
+    return usb_write_ram(usb_handle, FIFO_RESET_REQ, &dat, sizeof(dat));
+}
+
+//----------------------------------------------------------------------
+// Open an FX2 by its bus-port path ("1-1.3" as in sysfs), or the first one
+//----------------------------------------------------------------------
+void usb_device_path(libusb_device *dev, char *path, int size) {
+    uint8_t ports[8];
+    int depth = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    int len = snprintf(path, size, "%d", libusb_get_bus_number(dev));
+    for (int j = 0; j < depth; j++) {
+        len += snprintf(path + len, size - len, (j == 0) ? "-%d" : ".%d", ports[j]);
+    }
+}
+
+libusb_device_handle *usb_open_device(const char *path) {
+    if (path == NULL) {
+        return libusb_open_device_with_vid_pid(NULL, VID, PID);
+    }
+
+    libusb_device **list;
+    ssize_t n = libusb_get_device_list(NULL, &list);
+    libusb_device_handle *handle = NULL;
+    for (ssize_t i = 0; i < n && handle == NULL; i++) {
+        struct libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(list[i], &desc) != 0 || desc.idVendor != VID || desc.idProduct != PID) {
+            continue;
+        }
+
+        char dev_path[64];
+        usb_device_path(list[i], dev_path, sizeof(dev_path));
+        if (strcmp(dev_path, path) == 0) {
+            if (libusb_open(list[i], &handle) != 0) {
+                fprintf(stderr, "USB: Cannot open %s.\n", path);
+            }
+        } else {
+            printf("USB: Skipping FX2 at %s.\n", dev_path);
+        }
+    }
+    libusb_free_device_list(list, 1);
+    return handle;
+}
+
+#endif // FX2_USB_IMPLEMENTATION
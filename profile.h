@@ -0,0 +1,33 @@
+//
+// Source timing of the build profile
+//
+// Default: 15 kHz sources, 640x200. "make VGA=1" (PROFILE_VGA): 640x480@60
+// class sources (31 kHz, about 25 MHz sample clock). Shared by the decoder,
+// its benchmark and fx2_emu's test pattern (test_pattern.h).
+//
+#ifndef __PROFILE_H_
+#define __PROFILE_H_
+
+#ifdef PROFILE_VGA
+#define DW 640
+#define DH 480
+#define DH_SCALE 1 // screen lines per source line
+#define V_PORCH 33 // H-Sync pulses from V-Sync to the first line
+#define H_PORCH 48 // samples from H-Sync to the first pixel
+#define H_SYNC 96  // synthetic stream (benchmark, test pattern): H-Sync pulse, front porch and V-Sync pulse in samples
+#define H_FRONT 16
+#define V_SYNC (2 * 800)
+#define BENCH_MBPS 40 // sample rate the decoder must sustain
+#else
+#define DW 640
+#define DH 200
+#define DH_SCALE 2
+#define V_PORCH 36  // H-Sync pulses from V-Sync to the first line
+#define H_PORCH 131 // samples from H-Sync to the first pixel
+#define H_SYNC 40
+#define H_FRONT 60
+#define V_SYNC (3 * 1000)
+#define BENCH_MBPS 16
+#endif
+
+#endif // __PROFILE_H_
@@ -0,0 +1,354 @@
+//
+// Raw signal tap: writes USB transfer slots to a file with io_uring
+//
+// Completed transfer slots are written in place (O_DIRECT, registered buffers)
+// and handed back through the release callback once the write has finished.
+// The file keeps the push order, but slots are released as their writes
+// complete. If storage falls behind, slots are released at once without
+// being written and counted as dropped. Every run of dropped bytes is recorded
+// in <path>.gaps as "offset bytes" (file offset where the samples are
+// missing), so a replay can tell a gap from continuous samples.
+//
+#ifndef __RAW_TAP_H_
+#define __RAW_TAP_H_
+
+#include <stdint.h>
+
+typedef void (*tap_release_fn)(int slot);
+
+typedef struct {
+    uint64_t written;       // bytes written to the file
+    uint64_t dropped;       // bytes not written (storage too slow, short transfer)
+    uint64_t dropped_slots; // transfers not written
+    uint64_t errors;        // failed writes
+} tap_stats_t;
+
+// Prototypes
+//--------------------------------------------------------------------------------
+int tap_open(const char *path, uint8_t *slots, int slot_num, int slot_size, tap_release_fn release);
+void tap_push(int slot, int len);
+void tap_close(void);
+void tap_get_stats(tap_stats_t *stats);
+int tap_is_open(void);
+
+#endif // __RAW_TAP_H_
+#ifdef RAW_TAP_IMPLEMENTATION
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define TAP_BLOCK 4096          // O_DIRECT alignment of lengths and offsets
+#define TAP_WAKEUP ((uint64_t)-1) // user_data of the NOP that stops the writer
+#define TAP_GAP ((uint64_t)-2)    // user_data of the NOP that has new gaps written
+#define TAP_GAPS 64               // gap records waiting for the writer thread
+
+//================================================================================
+// io_uring
+//================================================================================
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+} tap_ring_t;
+
+static int tap_ring_init(tap_ring_t *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = (sq_size > cq_size) ? sq_size : cq_size;
+    }
+
+    uint8_t *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        return -1;
+    }
+    uint8_t *cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            return -1;
+        }
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        return -1;
+    }
+
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+// Queue one SQE and submit it. Single producer.
+static int tap_ring_submit(tap_ring_t *r, struct io_uring_sqe *src) {
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    r->sqes[idx] = *src;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0);
+}
+
+//================================================================================
+// Tap
+//================================================================================
+typedef struct {
+    uint64_t offset; // file offset where the samples are missing
+    uint64_t bytes;
+} tap_gap_t;
+
+static struct {
+    tap_ring_t ring;
+    int fd;
+    FILE *gap_fp; // <path>.gaps
+    int fixed;    // buffers are registered
+    uint8_t *slots;
+    int slot_num;
+    int slot_size;
+    int max_held; // slots that may wait for the writer
+    tap_release_fn release;
+    int writing;     // writes in flight: slots held
+    uint64_t offset; // file offset of the next write
+    tap_gap_t gaps[TAP_GAPS];
+    int gap_num; // not written to gap_fp yet
+    tap_stats_t stats;
+    pthread_mutex_t mtx;
+    pthread_t th;
+    int open;
+} tap;
+
+int tap_is_open() { return tap.open; }
+
+// Record len bytes missing at the current offset; returns 1 if a new record
+// was started. Called with tap.mtx held.
+static int tap_gap_add(int len) {
+    tap_gap_t *last = tap.gap_num ? &tap.gaps[tap.gap_num - 1] : NULL;
+    if (last != NULL && (last->offset == tap.offset || tap.gap_num == TAP_GAPS)) {
+        last->bytes += len; // consecutive drops are one gap (or the list is full)
+        return 0;
+    }
+    tap.gaps[tap.gap_num].offset = tap.offset;
+    tap.gaps[tap.gap_num].bytes = len;
+    tap.gap_num++;
+    return 1;
+}
+
+// Write the pending gap records. Called with tap.mtx held.
+static void tap_gap_flush() {
+    for (int i = 0; i < tap.gap_num; i++) {
+        fprintf(tap.gap_fp, "%llu %llu\n", (unsigned long long)tap.gaps[i].offset, (unsigned long long)tap.gaps[i].bytes);
+    }
+    if (tap.gap_num) {
+        fflush(tap.gap_fp);
+    }
+    tap.gap_num = 0;
+}
+
+//--------------------------------------------------------------------------------
+// Writer thread: reaps write completions, releases the slots and writes the
+// gap records
+//--------------------------------------------------------------------------------
+static void *tap_run(void *arg) {
+    tap_ring_t *r = &tap.ring;
+    int stopping = 0;
+    int done[tap.slot_num];
+
+    while (!stopping || tap.writing > 0) {
+        syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+
+        int done_num = 0;
+        pthread_mutex_lock(&tap.mtx);
+        unsigned head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            if (cqe->user_data == TAP_WAKEUP) {
+                stopping = 1;
+            } else if (cqe->user_data != TAP_GAP) {
+                tap.writing--;
+                if (cqe->res < 0) {
+                    tap.stats.errors++;
+                } else {
+                    tap.stats.written += cqe->res;
+                }
+                done[done_num++] = cqe->user_data;
+            }
+            head++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        tap_gap_flush();
+        pthread_mutex_unlock(&tap.mtx);
+
+        for (int i = 0; i < done_num; i++) {
+            tap.release(done[i]);
+        }
+    }
+
+    return NULL;
+}
+
+//--------------------------------------------------------------------------------
+// Open the tap file. slots must be TAP_BLOCK aligned.
+//--------------------------------------------------------------------------------
+int tap_open(const char *path, uint8_t *slots, int slot_num, int slot_size, tap_release_fn release) {
+    memset(&tap, 0, sizeof(tap));
+    tap.slots = slots;
+    tap.slot_num = slot_num;
+    tap.slot_size = slot_size;
+    tap.max_held = slot_num / 4;
+    tap.release = release;
+    pthread_mutex_init(&tap.mtx, NULL);
+
+    tap.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (tap.fd < 0) {
+        // e.g. tmpfs does not support O_DIRECT
+        tap.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (tap.fd < 0) {
+            perror("Tap: Cannot open file");
+            return -1;
+        }
+        puts("Tap: O_DIRECT is not supported, using buffered writes.");
+    }
+    char gap_path[strlen(path) + sizeof(".gaps")];
+    snprintf(gap_path, sizeof(gap_path), "%s.gaps", path);
+    tap.gap_fp = fopen(gap_path, "w");
+    if (tap.gap_fp == NULL) {
+        perror("Tap: Cannot open the gap file");
+        close(tap.fd);
+        return -1;
+    }
+
+    if (tap_ring_init(&tap.ring, slot_num) < 0) {
+        perror("Tap: io_uring setup failed");
+        close(tap.fd);
+        fclose(tap.gap_fp);
+        return -1;
+    }
+
+    struct iovec iov[slot_num];
+    for (int i = 0; i < slot_num; i++) {
+        iov[i].iov_base = slots + (size_t)slot_size * i;
+        iov[i].iov_len = slot_size;
+    }
+    tap.fixed = syscall(__NR_io_uring_register, tap.ring.fd, IORING_REGISTER_BUFFERS, iov, slot_num) == 0;
+    if (!tap.fixed) {
+        puts("Tap: Cannot register buffers (RLIMIT_MEMLOCK?), using plain writes.");
+    }
+
+    if (pthread_create(&tap.th, NULL, tap_run, NULL) != 0) {
+        perror("Tap: Failed to start writer thread");
+        close(tap.fd);
+        fclose(tap.gap_fp);
+        return -1;
+    }
+
+    tap.open = 1;
+    printf("Tap: Writing raw signal to %s.\n", path);
+    return 0;
+}
+
+//--------------------------------------------------------------------------------
+// Hand over a completed slot. Slots must be pushed in stream order; each one is
+// released exactly once: at once if it is dropped, otherwise from the writer
+// thread when its write has completed.
+//--------------------------------------------------------------------------------
+void tap_push(int slot, int len) {
+    int drop = 0;
+    pthread_mutex_lock(&tap.mtx);
+
+    if (!tap.open) {
+        drop = 1; // closed meanwhile: the writer is gone
+    } else if (tap.writing >= tap.max_held || len <= 0 || len % TAP_BLOCK) {
+        // Storage is behind (or the transfer is short): drop instead of holding the slot
+        drop = 1;
+        tap.stats.dropped += len;
+        tap.stats.dropped_slots++;
+        if (len > 0 && tap_gap_add(len)) {
+            struct io_uring_sqe sqe;
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_NOP; // the writer may be idle: have it write the record
+            sqe.user_data = TAP_GAP;
+            tap_ring_submit(&tap.ring, &sqe);
+        }
+    } else {
+        struct io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = tap.fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe.fd = tap.fd;
+        sqe.addr = (uintptr_t)(tap.slots + (size_t)tap.slot_size * slot);
+        sqe.len = len;
+        sqe.off = tap.offset;
+        sqe.buf_index = tap.fixed ? slot : 0;
+        sqe.user_data = slot;
+        if (tap_ring_submit(&tap.ring, &sqe) < 0) {
+            tap.stats.errors++;
+            tap.stats.dropped += len;
+            tap.stats.dropped_slots++;
+            tap_gap_add(len);
+            drop = 1;
+        } else {
+            tap.offset += len;
+            tap.writing++;
+        }
+    }
+
+    pthread_mutex_unlock(&tap.mtx);
+    if (drop) {
+        tap.release(slot);
+    }
+}
+
+void tap_get_stats(tap_stats_t *stats) {
+    pthread_mutex_lock(&tap.mtx);
+    *stats = tap.stats;
+    pthread_mutex_unlock(&tap.mtx);
+}
+
+//--------------------------------------------------------------------------------
+// Stop the writer once the pending writes have completed
+//--------------------------------------------------------------------------------
+void tap_close() {
+    if (!tap.open) {
+        return;
+    }
+
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_NOP;
+    sqe.user_data = TAP_WAKEUP;
+    pthread_mutex_lock(&tap.mtx);
+    tap.open = 0; // tap_push() drops from now on
+    tap_ring_submit(&tap.ring, &sqe);
+    pthread_mutex_unlock(&tap.mtx);
+
+    pthread_join(tap.th, NULL);
+    tap_gap_flush();
+    fclose(tap.gap_fp);
+    close(tap.ring.fd);
+    close(tap.fd);
+    printf("Tap: %llu bytes written, %llu bytes dropped.\n", (unsigned long long)tap.stats.written, (unsigned long long)tap.stats.dropped);
+}
+
+#endif // RAW_TAP_IMPLEMENTATION
@@ -0,0 +1,668 @@
+//
+// Resumable digital RGB decoder
+//
+// Decodes a stream of "000VHRGB" samples into an 8bpp or 32bpp frame buffer. The
+// decoder is an explicit state machine fed with byte chunks of any size; all
+// state is kept in rgb_decoder_t between calls, so it can be driven from the
+// USB callback, a worker thread or a file.
+//
+// Once the line period and H-Sync pulse width have been the same for lock_lines
+// lines, the decoder locks: it jumps from the end of a line straight over the
+// next H-Sync and checks only a few guard samples around the expected edges.
+// A guard mismatch drops the frame and returns to full scanning.
+//
+// With gated set, the input is the compact stream of the GPIF-gated firmware
+// (firmware/gpif_gated_8.c): one marker sample (H or V low) per sync pulse,
+// followed by width pixels on the active lines. The porches are not sent.
+//
+// The inner loops (sync scan, pixel conversion) are built in several variants
+// (scalar, ARMv6, NEON, AArch64 NEON, SSE2, AVX2) in this one translation unit
+// with per-function target attributes. The best one this CPU supports is
+// selected at run time, so one binary runs on every Pi model.
+//
+#ifndef __RGB_DECODER_H_
+#define __RGB_DECODER_H_
+
+#include <stdint.h>
+#include "stage_prof.h"
+
+#define BIT_VSYNC 4
+#define BIT_HSYNC 3
+#define BIT_R 2
+#define BIT_G 1
+#define BIT_B 0
+
+typedef enum {
+    RGB_WAIT_VSYNC = 0, // wait for the start of the V-Sync pulse (V low)
+    RGB_VSYNC,          // in the V-Sync pulse, wait for its end (V high)
+    RGB_V_PORCH,        // wait for the start of a back porch H-Sync pulse
+    RGB_V_PORCH_HSYNC,  // in a back porch H-Sync pulse
+    RGB_WAIT_HSYNC,     // wait for the start of the H-Sync pulse of a line
+    RGB_HSYNC,          // in the H-Sync pulse of a line
+    RGB_H_PORCH,        // skip the H-Sync back porch
+    RGB_ACTIVE,         // active pixels
+    RGB_LOCKED_GAP,     // locked: jump from the end of a line to the end of the next H-Sync
+    RGB_GATED_LINE,     // gated: after a marker, either a marker or the pixels of a line
+    RGB_GATED_MARKER,   // gated: after the pixels of a line, a marker
+} rgb_state_t;
+
+// Decode kernels of one instruction set
+typedef struct {
+    const char *name;
+    int (*supported)(void); // CPU feature check, NULL if always available in this build
+    // Leading samples with (sample & mask) == level
+    int (*span)(const uint8_t *p, int n, uint8_t mask, uint8_t level);
+    // Samples to colors; the samples have been checked (sync bits high)
+    void (*convert8)(const uint8_t *p, int n, uint8_t *out, const uint8_t palette[8]);
+    void (*convert32)(const uint8_t *p, int n, uint32_t *out, const uint32_t palette[8]);
+} rgb_kernels_t;
+
+typedef struct rgb_decoder rgb_decoder_t;
+struct rgb_decoder {
+    // Timing
+    int width;   // active pixels per line
+    int height;  // active lines per frame
+    int v_porch; // H-Sync pulses between V-Sync and the first active line
+    int h_porch; // samples between the end of H-Sync and the first pixel
+
+    // Output
+    uint8_t palette[8];    // RGB -> color (8bpp)
+    uint32_t palette32[8]; // RGB -> color (32bpp)
+    int bpp;               // bytes per pixel of fb: 1 or 4
+    int raw;               // copy the samples as they are (the display palette maps them)
+    int gated;             // compact stream from the GPIF-gated firmware
+    uint8_t *fb;           // frame buffer being decoded into
+    int pitch;             // bytes per line of fb
+    const rgb_kernels_t *kernels; // rgb_kernels_best() by default
+
+    // Timing lock
+    int lock_lines;    // lines with a stable timing needed to lock, 0 never locks
+    int locked;        // the horizontal blanking is jumped over
+    int line_period;   // samples from one H-Sync edge to the next
+    int hsync_width;   // samples in the H-Sync pulse
+    int stable;        // lines in a row with this period and pulse width
+    uint64_t edge_pos; // stream position of the latest H-Sync edge
+    uint64_t prev_edge_pos;
+
+    // Callbacks (may be NULL)
+    void (*on_vsync)(rgb_decoder_t *dec); // end of V-Sync at dec->vsync_pos; may change fb
+    void (*on_frame)(rgb_decoder_t *dec); // a frame was decoded without losing sync
+    void *user;
+
+    // State
+    rgb_state_t state;
+    int count;          // lines / samples / pixels done in the current state
+    int y;              // current line
+    uint64_t pos;       // stream position of the next chunk
+    uint64_t vsync_pos; // stream position just after the latest V-Sync
+
+    // Statistics
+    uint64_t frames; // frames decoded
+    uint64_t lost;      // frames aborted because sync was lost
+    uint64_t inspected; // samples looked at; the others were skipped
+    uint64_t unlocks;   // locks lost on a guard mismatch (the line is then found by scanning)
+};
+
+// Prototypes
+//--------------------------------------------------------------------------------
+void rgb_decoder_init(rgb_decoder_t *dec, int width, int height, int v_porch, int h_porch, const uint8_t palette[8]);
+void rgb_decoder_feed(rgb_decoder_t *dec, const uint8_t *dat, int len);
+void rgb_decoder_gap(rgb_decoder_t *dec);
+const rgb_kernels_t *rgb_kernels_get(int i);
+const rgb_kernels_t *rgb_kernels_best(void);
+
+#endif // __RGB_DECODER_H_
+#if defined(RGB_DECODER_IMPLEMENTATION) && !defined(__RGB_DECODER_IMPL_)
+#define __RGB_DECODER_IMPL_ // also included by test_pattern.h
+
+#include <stdlib.h>
+#include <string.h>
+
+#define RGB_VMASK (1 << BIT_VSYNC)
+#define RGB_HMASK (1 << BIT_HSYNC)
+#define RGB_VHMASK (RGB_VMASK | RGB_HMASK)
+#define RGB_MIN(a, b) ((a) < (b) ? (a) : (b))
+#define RGB_LOCK_LINES 16
+
+//--------------------------------------------------------------------------------
+// Decode kernels. span() finds the next sync edge (or the end of the good
+// pixels), convert8/32() look the colors up. Each variant falls back to the
+// scalar code for the tail.
+//--------------------------------------------------------------------------------
+#define RGB_BYTES8(x) (0x0101010101010101ULL * (uint8_t)(x))
+
+// Scalar: 8 samples at a time in a 64 bit word
+static int rgb_span_scalar(const uint8_t *p, int n, uint8_t mask, uint8_t level) {
+    const uint64_t m = RGB_BYTES8(mask), l = RGB_BYTES8(level);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        if ((w & m) != l) {
+            break;
+        }
+    }
+    while (i < n && (p[i] & mask) == level) {
+        i++;
+    }
+    return i;
+}
+
+static void rgb_convert8_scalar(const uint8_t *p, int n, uint8_t *out, const uint8_t palette[8]) {
+    for (int i = 0; i < n; i++) {
+        out[i] = palette[p[i] & 7];
+    }
+}
+
+static void rgb_convert32_scalar(const uint8_t *p, int n, uint32_t *out, const uint32_t palette[8]) {
+    for (int i = 0; i < n; i++) {
+        out[i] = palette[p[i] & 7];
+    }
+}
+
+#if defined(__arm__)
+// ARMv6 (Pi Zero/1): 32 bit words, the first mismatch from the bit position
+// (little endian), and 4 pixels stored at once
+static int rgb_span_armv6(const uint8_t *p, int n, uint8_t mask, uint8_t level) {
+    const uint32_t m = 0x01010101U * mask, l = 0x01010101U * level;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        uint32_t w;
+        memcpy(&w, p + i, sizeof(w));
+        uint32_t x = (w & m) ^ l;
+        if (x) {
+            return i + (__builtin_ctz(x) >> 3);
+        }
+    }
+    while (i < n && (p[i] & mask) == level) {
+        i++;
+    }
+    return i;
+}
+
+static void rgb_convert8_armv6(const uint8_t *p, int n, uint8_t *out, const uint8_t palette[8]) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        uint32_t w = palette[p[i] & 7] | palette[p[i + 1] & 7] << 8 | palette[p[i + 2] & 7] << 16 | (uint32_t)palette[p[i + 3] & 7] << 24;
+        memcpy(out + i, &w, sizeof(w));
+    }
+    rgb_convert8_scalar(p + i, n - i, out + i, palette);
+}
+#endif
+
+#if (defined(__arm__) && defined(__ARM_FP) && !defined(__SOFTFP__)) || defined(__aarch64__)
+// NEON (Pi 2/3/4 32 bit, AArch64): 16 samples per compare, table lookups for the colors
+#define RGB_NEON 1
+#if defined(__arm__) && !defined(__ARM_NEON)
+#pragma GCC push_options
+#pragma GCC target("fpu=neon")
+#define RGB_NEON_POP
+#endif
+#include <arm_neon.h>
+
+static int rgb_span_neon(const uint8_t *p, int n, uint8_t mask, uint8_t level) {
+    const uint8x16_t m = vdupq_n_u8(mask), l = vdupq_n_u8(level);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t eq = vceqq_u8(vandq_u8(vld1q_u8(p + i), m), l);
+        // One nibble per sample
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        if (bits != ~0ULL) {
+            return i + (__builtin_ctzll(~bits) >> 2);
+        }
+    }
+    return i + rgb_span_scalar(p + i, n - i, mask, level);
+}
+
+static void rgb_convert8_neon(const uint8_t *p, int n, uint8_t *out, const uint8_t palette[8]) {
+    const uint8x8_t pal = vld1_u8(palette), seven = vdup_n_u8(7);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        vst1_u8(out + i, vtbl1_u8(pal, vand_u8(vld1_u8(p + i), seven)));
+    }
+    rgb_convert8_scalar(p + i, n - i, out + i, palette);
+}
+
+// One table per color byte, interleaved into pixels by the store
+static void rgb_convert32_neon(const uint8_t *p, int n, uint32_t *out, const uint32_t palette[8]) {
+    uint8_t planes[4][8];
+    for (int k = 0; k < 8; k++) {
+        for (int b = 0; b < 4; b++) {
+            planes[b][k] = palette[k] >> (8 * b);
+        }
+    }
+    const uint8x8_t seven = vdup_n_u8(7);
+    const uint8x8_t b0 = vld1_u8(planes[0]), b1 = vld1_u8(planes[1]), b2 = vld1_u8(planes[2]), b3 = vld1_u8(planes[3]);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint8x8_t idx = vand_u8(vld1_u8(p + i), seven);
+        uint8x8x4_t px = {{vtbl1_u8(b0, idx), vtbl1_u8(b1, idx), vtbl1_u8(b2, idx), vtbl1_u8(b3, idx)}};
+        vst4_u8((uint8_t *)(out + i), px);
+    }
+    rgb_convert32_scalar(p + i, n - i, out + i, palette);
+}
+
+#ifdef RGB_NEON_POP
+#pragma GCC pop_options
+#endif
+
+#if defined(__arm__)
+#include <sys/auxv.h>
+#define RGB_HWCAP_NEON (1 << 12) // asm/hwcap.h
+static int rgb_cpu_neon(void) { return (getauxval(AT_HWCAP) & RGB_HWCAP_NEON) != 0; }
+#endif
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+// SSE2 and AVX2 (PCs, e.g. with fx2_emu or for -B)
+#include <immintrin.h>
+
+__attribute__((target("sse2"))) static int rgb_span_sse2(const uint8_t *p, int n, uint8_t mask, uint8_t level) {
+    const __m128i m = _mm_set1_epi8(mask), l = _mm_set1_epi8(level);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, m), l));
+        if (eq != 0xffff) {
+            return i + __builtin_ctz(~eq);
+        }
+    }
+    return i + rgb_span_scalar(p + i, n - i, mask, level);
+}
+
+// No byte shuffle before SSSE3: select each of the 8 colors by compare
+__attribute__((target("sse2"))) static void rgb_convert8_sse2(const uint8_t *p, int n, uint8_t *out, const uint8_t palette[8]) {
+    const __m128i seven = _mm_set1_epi8(7);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i idx = _mm_and_si128(_mm_loadu_si128((const __m128i *)(p + i)), seven);
+        __m128i px = _mm_setzero_si128();
+        for (int k = 0; k < 8; k++) {
+            px = _mm_or_si128(px, _mm_and_si128(_mm_cmpeq_epi8(idx, _mm_set1_epi8(k)), _mm_set1_epi8(palette[k])));
+        }
+        _mm_storeu_si128((__m128i *)(out + i), px);
+    }
+    rgb_convert8_scalar(p + i, n - i, out + i, palette);
+}
+
+__attribute__((target("avx2"))) static int rgb_span_avx2(const uint8_t *p, int n, uint8_t mask, uint8_t level) {
+    const __m256i m = _mm256_set1_epi8(mask), l = _mm256_set1_epi8(level);
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(v, m), l));
+        if (eq != 0xffffffffU) {
+            return i + __builtin_ctz(~eq);
+        }
+    }
+    return i + rgb_span_scalar(p + i, n - i, mask, level);
+}
+
+__attribute__((target("avx2"))) static void rgb_convert8_avx2(const uint8_t *p, int n, uint8_t *out, const uint8_t palette[8]) {
+    uint8_t table[16];
+    memcpy(table, palette, 8);
+    memcpy(table + 8, palette, 8);
+    const __m256i pal = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)table));
+    const __m256i seven = _mm256_set1_epi8(7);
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i idx = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(p + i)), seven);
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_shuffle_epi8(pal, idx));
+    }
+    rgb_convert8_scalar(p + i, n - i, out + i, palette);
+}
+
+__attribute__((target("avx2"))) static void rgb_convert32_avx2(const uint8_t *p, int n, uint32_t *out, const uint32_t palette[8]) {
+    const __m256i pal = _mm256_loadu_si256((const __m256i *)palette);
+    const __m256i seven = _mm256_set1_epi32(7);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i idx = _mm256_and_si256(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(p + i))), seven);
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_permutevar8x32_epi32(pal, idx));
+    }
+    rgb_convert32_scalar(p + i, n - i, out + i, palette);
+}
+
+#if defined(__i386__)
+static int rgb_cpu_sse2(void) { return __builtin_cpu_supports("sse2"); }
+#endif
+static int rgb_cpu_avx2(void) { return __builtin_cpu_supports("avx2"); }
+#endif
+
+// Slowest first: rgb_kernels_best() takes the last supported one
+static const rgb_kernels_t rgb_kernel_table[] = {
+    {"scalar", NULL, rgb_span_scalar, rgb_convert8_scalar, rgb_convert32_scalar},
+#if defined(__arm__)
+    {"armv6", NULL, rgb_span_armv6, rgb_convert8_armv6, rgb_convert32_scalar},
+#ifdef RGB_NEON
+    {"neon", rgb_cpu_neon, rgb_span_neon, rgb_convert8_neon, rgb_convert32_neon},
+#endif
+#elif defined(__aarch64__)
+    {"neon64", NULL, rgb_span_neon, rgb_convert8_neon, rgb_convert32_neon},
+#elif defined(__x86_64__) || defined(__i386__)
+#if defined(__i386__)
+    {"sse2", rgb_cpu_sse2, rgb_span_sse2, rgb_convert8_sse2, rgb_convert32_scalar},
+#else
+    {"sse2", NULL, rgb_span_sse2, rgb_convert8_sse2, rgb_convert32_scalar},
+#endif
+    {"avx2", rgb_cpu_avx2, rgb_span_avx2, rgb_convert8_avx2, rgb_convert32_avx2},
+#endif
+};
+
+// The i-th variant this CPU can run, NULL after the last
+const rgb_kernels_t *rgb_kernels_get(int i) {
+    for (int k = 0; k < sizeof(rgb_kernel_table) / sizeof(rgb_kernel_table[0]); k++) {
+        const rgb_kernels_t *kernels = &rgb_kernel_table[k];
+        if ((kernels->supported == NULL || kernels->supported()) && i-- == 0) {
+            return kernels;
+        }
+    }
+    return NULL;
+}
+
+// The fastest variant, or the one named by RGB_KERNELS (for comparisons)
+const rgb_kernels_t *rgb_kernels_best(void) {
+    static const rgb_kernels_t *best;
+    if (best == NULL) {
+        const char *name = getenv("RGB_KERNELS");
+        const rgb_kernels_t *kernels;
+        for (int i = 0; (kernels = rgb_kernels_get(i)) != NULL; i++) {
+            best = kernels;
+            if (name != NULL && strcmp(name, kernels->name) == 0) {
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+void rgb_decoder_init(rgb_decoder_t *dec, int width, int height, int v_porch, int h_porch, const uint8_t palette[8]) {
+    memset(dec, 0, sizeof(*dec));
+    dec->width = width;
+    dec->height = height;
+    dec->v_porch = v_porch;
+    dec->h_porch = h_porch;
+    dec->bpp = 1;
+    dec->pitch = width;
+    memcpy(dec->palette, palette, sizeof(dec->palette));
+    for (int i = 0; i < 8; i++) {
+        dec->palette32[i] = palette[i];
+    }
+    dec->lock_lines = RGB_LOCK_LINES;
+    dec->kernels = rgb_kernels_best();
+    dec->state = RGB_WAIT_VSYNC;
+}
+
+// Line timing measured at the end of an H-Sync pulse; lock once it is stable
+static void rgb_lock_update(rgb_decoder_t *dec, uint64_t rise_pos) {
+    if (dec->y == 0) {
+        return; // the first line has no previous edge in this frame
+    }
+    int period = dec->edge_pos - dec->prev_edge_pos;
+    int width = rise_pos - dec->edge_pos;
+    if (period == dec->line_period && width == dec->hsync_width) {
+        dec->stable++;
+    } else {
+        dec->line_period = period;
+        dec->hsync_width = width;
+        dec->stable = 1;
+    }
+    // The gap must hold a sample before the edge besides the pulse and the sample after it
+    int gap = period - dec->h_porch - dec->width;
+    if (dec->lock_lines > 0 && dec->stable >= dec->lock_lines && width >= 2 && gap >= width + 2) {
+        dec->locked = 1;
+    }
+}
+
+static void rgb_unlock(rgb_decoder_t *dec) {
+    dec->locked = 0;
+    dec->stable = 0;
+}
+
+// Sync search: samples before the next one with (sample & mask) != level
+static inline int rgb_sync_search(rgb_decoder_t *dec, const uint8_t *p, int n, uint8_t mask, uint8_t level) {
+    PROF_BEGIN_HOT(t);
+    int i = dec->kernels->span(p, n, mask, level);
+    PROF_END_HOT(t, PROF_SYNC_SEARCH);
+    return i;
+}
+
+// Pixels of the current line; returns how many were good (sync bits high)
+static inline int rgb_active_run(rgb_decoder_t *dec, const uint8_t *p, int n) {
+    PROF_BEGIN_HOT(t);
+    uint8_t *line = dec->fb + dec->y * dec->pitch;
+    int i = dec->kernels->span(p, n, RGB_VHMASK, RGB_VHMASK);
+    if (dec->raw) {
+        // Only the sync bits are checked; the display maps the samples
+        memcpy(line + dec->count, p, i);
+    } else if (dec->bpp == 4) {
+        dec->kernels->convert32(p, i, (uint32_t *)line + dec->count, dec->palette32);
+    } else {
+        dec->kernels->convert8(p, i, line + dec->count, dec->palette);
+    }
+    PROF_END_HOT(t, PROF_PIXEL_CONVERT);
+    return i;
+}
+
+// The last line is done
+static inline void rgb_frame_end(rgb_decoder_t *dec) {
+    dec->frames++;
+    dec->state = RGB_WAIT_VSYNC;
+    if (dec->on_frame) {
+        dec->on_frame(dec);
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Decode a chunk. Each sync edge is detected on the first sample after it,
+// which is consumed, exactly as a byte-by-byte pull decoder would do.
+//--------------------------------------------------------------------------------
+void rgb_decoder_feed(rgb_decoder_t *dec, const uint8_t *dat, int len) {
+    const uint8_t *p = dat;
+    const uint8_t *end = dat + len;
+    int skipped = 0; // samples passed over without looking at them
+
+    while (p < end) {
+        switch (dec->state) {
+        case RGB_WAIT_VSYNC:
+            p += rgb_sync_search(dec, p, end - p, RGB_VMASK, RGB_VMASK);
+            if (p < end) {
+                p++;
+                dec->state = RGB_VSYNC;
+            }
+            break;
+
+        case RGB_VSYNC:
+            p += rgb_sync_search(dec, p, end - p, RGB_VMASK, 0);
+            if (p < end) {
+                p++;
+                dec->vsync_pos = dec->pos + (p - dat);
+                if (dec->on_vsync) {
+                    dec->on_vsync(dec);
+                }
+                if (dec->gated) {
+                    dec->state = RGB_GATED_LINE; // the sample was the first line's marker
+                } else {
+                    dec->state = (dec->v_porch > 0) ? RGB_V_PORCH : RGB_WAIT_HSYNC;
+                }
+                dec->count = 0;
+                dec->y = 0;
+            }
+            break;
+
+        case RGB_V_PORCH:
+        case RGB_WAIT_HSYNC:
+            p += rgb_sync_search(dec, p, end - p, RGB_HMASK, RGB_HMASK);
+            if (p < end) {
+                p++;
+                if (dec->state == RGB_V_PORCH) {
+                    dec->state = RGB_V_PORCH_HSYNC;
+                } else {
+                    dec->prev_edge_pos = dec->edge_pos;
+                    dec->edge_pos = dec->pos + (p - dat) - 1;
+                    dec->state = RGB_HSYNC;
+                }
+            }
+            break;
+
+        case RGB_V_PORCH_HSYNC:
+            p += rgb_sync_search(dec, p, end - p, RGB_HMASK, 0);
+            if (p < end) {
+                p++;
+                dec->state = (++dec->count < dec->v_porch) ? RGB_V_PORCH : RGB_WAIT_HSYNC;
+            }
+            break;
+
+        case RGB_HSYNC:
+            p += rgb_sync_search(dec, p, end - p, RGB_HMASK, 0);
+            if (p < end) {
+                p++;
+                rgb_lock_update(dec, dec->pos + (p - dat) - 1);
+                dec->state = RGB_H_PORCH;
+                dec->count = 0;
+            }
+            break;
+
+        case RGB_H_PORCH: {
+            int n = RGB_MIN(end - p, dec->h_porch - dec->count);
+            p += n;
+            skipped += n;
+            dec->count += n;
+            if (dec->count == dec->h_porch) {
+                dec->state = RGB_ACTIVE;
+                dec->count = 0;
+            }
+            break;
+        }
+
+        case RGB_ACTIVE: {
+            int n = RGB_MIN(end - p, dec->width - dec->count);
+            int i = rgb_active_run(dec, p, n);
+            if (i < n) {
+                // Sync is lost, skip this frame. A gated marker is kept: it may be the V-Sync.
+                p += dec->gated ? i : i + 1;
+                dec->lost++;
+                rgb_unlock(dec);
+                dec->state = RGB_WAIT_VSYNC;
+                break;
+            }
+            p += n;
+            dec->count += n;
+            if (dec->count == dec->width) {
+                dec->count = 0;
+                if (++dec->y < dec->height) {
+                    if (dec->gated) {
+                        dec->state = RGB_GATED_MARKER;
+                    } else {
+                        dec->state = dec->locked ? RGB_LOCKED_GAP : RGB_WAIT_HSYNC;
+                    }
+                } else {
+                    rgb_frame_end(dec);
+                }
+            }
+            break;
+        }
+
+        case RGB_LOCKED_GAP: {
+            // Guards: the sample before the H-Sync edge, the edge, the last pulse sample
+            // and the one after it, which ends the pulse (consumed as when scanning)
+            int gap = dec->line_period - dec->h_porch - dec->width;
+            const int guard[4] = {gap - dec->hsync_width - 2, gap - dec->hsync_width - 1, gap - 2, gap - 1};
+            const uint8_t level[4] = {RGB_HMASK, 0, 0, RGB_HMASK};
+            int n = RGB_MIN(end - p, gap - dec->count);
+            int checked = 0;
+            int g;
+            for (g = 0; g < 4; g++) {
+                int i = guard[g] - dec->count;
+                if (i >= 0 && i < n) {
+                    checked++;
+                    if ((p[i] & RGB_HMASK) != level[g]) {
+                        break;
+                    }
+                }
+            }
+            if (g < 4) {
+                // The timing has moved: find this line's H-Sync by scanning from
+                // the failed guard and lock again later.
+                int i = guard[g] - dec->count;
+                dec->unlocks++;
+                rgb_unlock(dec);
+                if (g == 2) {
+                    // Shorter pulse: its end was skipped over, so the pixels of this
+                    // line cannot be placed. Leave the line out, scan for the next one.
+                    p += i + 1;
+                    skipped += i + 1 - checked;
+                    dec->prev_edge_pos = dec->edge_pos;
+                    dec->edge_pos += dec->line_period;
+                    if (++dec->y < dec->height) {
+                        dec->state = RGB_WAIT_HSYNC;
+                    } else {
+                        rgb_frame_end(dec);
+                    }
+                    break;
+                }
+                p += i; // the failed guard is looked at again
+                skipped += i + 1 - checked;
+                if (g == 1) {
+                    dec->state = RGB_WAIT_HSYNC; // late edge
+                } else {
+                    // In the pulse: it started early, or is longer and the edge was on time
+                    dec->prev_edge_pos = dec->edge_pos;
+                    dec->edge_pos = (g == 0) ? dec->pos + (p - dat) : dec->edge_pos + dec->line_period;
+                    dec->state = RGB_HSYNC;
+                }
+                break;
+            }
+            p += n;
+            skipped += n - checked;
+            dec->count += n;
+            if (dec->count == gap) {
+                dec->prev_edge_pos = dec->edge_pos;
+                dec->edge_pos += dec->line_period;
+                dec->state = RGB_H_PORCH;
+                dec->count = 0;
+            }
+            break;
+        }
+
+        case RGB_GATED_LINE:
+        case RGB_GATED_MARKER:
+            if ((*p & RGB_VHMASK) == RGB_VHMASK) {
+                // Pixels: only right after a marker
+                if (dec->state == RGB_GATED_LINE) {
+                    dec->state = RGB_ACTIVE;
+                } else {
+                    dec->lost++;
+                    dec->state = RGB_WAIT_VSYNC;
+                }
+            } else if (!(*p & RGB_VMASK)) {
+                // V-Sync before the last line
+                if (dec->y > 0) {
+                    dec->lost++;
+                }
+                dec->state = RGB_VSYNC;
+            } else {
+                // H-Sync marker
+                p++;
+                dec->state = RGB_GATED_LINE;
+            }
+            break;
+        }
+    }
+
+    dec->inspected += len - skipped;
+    dec->pos += len;
+}
+
+//--------------------------------------------------------------------------------
+// Samples are missing before the next chunk: the frame being decoded is lost.
+// The timing lock is kept; the line period has not changed.
+//--------------------------------------------------------------------------------
+void rgb_decoder_gap(rgb_decoder_t *dec) {
+    if (dec->state != RGB_WAIT_VSYNC) {
+        dec->lost++;
+        dec->state = RGB_WAIT_VSYNC;
+    }
+}
+
+#endif // RGB_DECODER_IMPLEMENTATION
@@ -0,0 +1,230 @@
+//
+// Non-blocking log for the capture threads
+//
+// The USB event thread and the decoder threads must never wait for the
+// console. They push compact binary records (message id, capture index, one
+// value) into a lock-free ring; a low priority thread formats them to stderr
+// or syslog. Repeats are aggregated: the first record of a message is printed
+// at once, further ones are counted and summarized once a second
+// ("USB0: transfer error x37 in the last 1 s") until a second passes without
+// any. If the ring is full, records are dropped and counted.
+//
+// The same thread also runs a periodic callback (the status line), so the
+// capture threads do not print it either.
+//
+#ifndef __RT_LOG_H_
+#define __RT_LOG_H_
+
+#include <stdint.h>
+
+typedef enum {
+    RTLOG_XFER_ERROR,
+    RTLOG_XFER_TIMEOUT,
+    RTLOG_XFER_OVERFLOW,
+    RTLOG_SUBMIT_FAILED,
+    RTLOG_FIFO_OVERFLOW,
+    RTLOG_NO_SIGNAL,
+    RTLOG_SIGNAL_BACK,
+    RTLOG_FIRST_FRAME,
+    RTLOG_WD_STALL,
+    RTLOG_WD_ERRORS,
+    RTLOG_WD_DRAINED,
+    RTLOG_WD_CLEAR_HALT,
+    RTLOG_WD_FIFO_RESET,
+    RTLOG_WD_DEVICE_RESET,
+    RTLOG_WD_RECOVERED,
+    RTLOG_WD_FAILED,
+    RTLOG_IDS
+} rtlog_id_t;
+
+// Prototypes
+//--------------------------------------------------------------------------------
+int rtlog_open(int use_syslog);
+void rtlog(rtlog_id_t id, int index, uint32_t value);
+void rtlog_set_tick(void (*tick)(void));
+void rtlog_flush(void);
+
+#endif // __RT_LOG_H_
+#ifdef RT_LOG_IMPLEMENTATION
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#define RTLOG_RING_SIZE 1024 // power of 2
+#define RTLOG_INDEX_MAX 8
+#define RTLOG_INTERVAL_MS 100
+#define RTLOG_WINDOW_US 1000000
+#define RTLOG_NICE 10
+
+// printf formats taking (index, value)
+static const char *rtlog_format[RTLOG_IDS] = {
+    [RTLOG_XFER_ERROR] = "USB%d: transfer error",
+    [RTLOG_XFER_TIMEOUT] = "USB%d: transfer timed out",
+    [RTLOG_XFER_OVERFLOW] = "USB%d: transfer overflow",
+    [RTLOG_SUBMIT_FAILED] = "USB%d: libusb_submit_transfer failed",
+    [RTLOG_FIFO_OVERFLOW] = "USB%d: FX2 FIFO overflow, samples lost (%u so far)",
+    [RTLOG_NO_SIGNAL] = "USB%d: No signal",
+    [RTLOG_SIGNAL_BACK] = "USB%d: Signal detected",
+    [RTLOG_FIRST_FRAME] = "USB%d: First frame %u ms after the signal returned",
+    [RTLOG_WD_STALL] = "USB%d: Watchdog: EP6 halted",
+    [RTLOG_WD_ERRORS] = "USB%d: Watchdog: %u failed transfers within a second",
+    [RTLOG_WD_DRAINED] = "USB%d: Watchdog: %u transfers not resubmitted",
+    [RTLOG_WD_CLEAR_HALT] = "USB%d: Watchdog: clearing the EP6 halt",
+    [RTLOG_WD_FIFO_RESET] = "USB%d: Watchdog: resetting the FX2 FIFO",
+    [RTLOG_WD_DEVICE_RESET] = "USB%d: Watchdog: resetting the device and reloading the firmware",
+    [RTLOG_WD_RECOVERED] = "USB%d: Watchdog: transfers flowing again after %u ms",
+    [RTLOG_WD_FAILED] = "USB%d: Watchdog: recovery step %u failed",
+};
+
+// Bounded MPSC queue: a slot is free for position pos when seq == pos, and
+// holds the record of pos when seq == pos + 1
+typedef struct {
+    uint32_t seq;
+    uint16_t id;
+    uint16_t index;
+    uint32_t value;
+} rtlog_rec_t;
+
+static rtlog_rec_t rtlog_ring[RTLOG_RING_SIZE];
+static uint32_t rtlog_tail; // next position to write
+static uint32_t rtlog_head; // next position to read (log thread only)
+static uint32_t rtlog_dropped;
+static int rtlog_syslog;
+static void (*volatile rtlog_tick)(void);
+static pthread_mutex_t rtlog_out_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+// Aggregation per message and capture (log thread only)
+static struct {
+    int active;
+    int64_t window_us;
+    uint32_t count;
+    uint32_t value;
+} rtlog_agg[RTLOG_IDS][RTLOG_INDEX_MAX];
+
+static int64_t rtlog_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void rtlog(rtlog_id_t id, int index, uint32_t value) {
+    uint32_t pos = __atomic_load_n(&rtlog_tail, __ATOMIC_RELAXED);
+    rtlog_rec_t *r;
+    while (1) {
+        r = &rtlog_ring[pos % RTLOG_RING_SIZE];
+        int32_t diff = (int32_t)(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&rtlog_tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_add_fetch(&rtlog_dropped, 1, __ATOMIC_RELAXED); // full
+            return;
+        } else {
+            pos = __atomic_load_n(&rtlog_tail, __ATOMIC_RELAXED);
+        }
+    }
+    r->id = id;
+    r->index = (index < RTLOG_INDEX_MAX) ? index : RTLOG_INDEX_MAX - 1;
+    r->value = value;
+    __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+void rtlog_set_tick(void (*tick)(void)) { rtlog_tick = tick; }
+
+static void rtlog_print(const char *fmt, int index, uint32_t value, uint32_t count) {
+    char msg[160];
+    int len = snprintf(msg, sizeof(msg), fmt, index, value);
+    if (count && len >= 0 && len < (int)sizeof(msg)) {
+        snprintf(msg + len, sizeof(msg) - len, " x%u in the last %d s", count, RTLOG_WINDOW_US / 1000000);
+    }
+    if (rtlog_syslog) {
+        syslog(LOG_WARNING, "%s", msg);
+    } else {
+        fprintf(stderr, "\n%s.\n", msg); // after the status line
+    }
+}
+
+// Format the pending records and the summaries that are due
+void rtlog_flush(void) {
+    pthread_mutex_lock(&rtlog_out_mtx);
+    int64_t now = rtlog_us();
+    while (1) {
+        rtlog_rec_t *r = &rtlog_ring[rtlog_head % RTLOG_RING_SIZE];
+        if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != rtlog_head + 1) {
+            break;
+        }
+        typeof(rtlog_agg[0][0]) *a = &rtlog_agg[r->id][r->index];
+        a->value = r->value;
+        if (!a->active) {
+            rtlog_print(rtlog_format[r->id], r->index, r->value, 0);
+            a->active = 1;
+            a->window_us = now;
+            a->count = 0;
+        } else {
+            a->count++;
+        }
+        __atomic_store_n(&r->seq, rtlog_head + RTLOG_RING_SIZE, __ATOMIC_RELEASE);
+        rtlog_head++;
+    }
+
+    for (int id = 0; id < RTLOG_IDS; id++) {
+        for (int i = 0; i < RTLOG_INDEX_MAX; i++) {
+            typeof(rtlog_agg[0][0]) *a = &rtlog_agg[id][i];
+            if (!a->active || now - a->window_us < RTLOG_WINDOW_US) {
+                continue;
+            }
+            if (a->count) {
+                rtlog_print(rtlog_format[id], i, a->value, a->count);
+                a->count = 0;
+                a->window_us = now;
+            } else {
+                a->active = 0; // quiet for a window: print the next one at once
+            }
+        }
+    }
+
+    uint32_t dropped = __atomic_exchange_n(&rtlog_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped) {
+        fprintf(stderr, "\nLog: %u records dropped (ring full).\n", dropped);
+    }
+    pthread_mutex_unlock(&rtlog_out_mtx);
+}
+
+static void *rtlog_run(void *arg) {
+    pthread_setname_np(pthread_self(), "log");
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), RTLOG_NICE); // this thread only
+    while (1) {
+        usleep(RTLOG_INTERVAL_MS * 1000);
+        rtlog_flush();
+        void (*tick)(void) = rtlog_tick;
+        if (tick != NULL) {
+            tick();
+        }
+    }
+    return NULL;
+}
+
+int rtlog_open(int use_syslog) {
+    for (uint32_t i = 0; i < RTLOG_RING_SIZE; i++) {
+        rtlog_ring[i].seq = i;
+    }
+    rtlog_syslog = use_syslog;
+    if (use_syslog) {
+        openlog("digital_rgb_display", LOG_PID, LOG_DAEMON);
+    }
+    pthread_t th;
+    if (pthread_create(&th, NULL, rtlog_run, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(th);
+    return 0;
+}
+
+#endif // RT_LOG_IMPLEMENTATION
@@ -0,0 +1,344 @@
+//
+// Stage profiler: timed scopes around the hot stages, dumped as a Chrome /
+// Perfetto trace (chrome://tracing, https://ui.perfetto.dev)
+//
+// Compiled in only with STAGE_PROF defined ("make PROF=1"); otherwise the
+// macros expand to nothing. Each thread appends its events to its own ring
+// (the oldest are overwritten), so recording takes no locks. An event holds
+// the start time and duration of the scope and, if perf_event_open is
+// permitted, the CPU cycles and optionally the cache misses spent in it (one
+// counter group per thread, read at both ends of the scope).
+//
+//   PROF_BEGIN(t);
+//   ...
+//   PROF_END(t, PROF_SUBMIT);
+//
+// Reading the counters takes a system call, too much for the scopes run for
+// every line. PROF_BEGIN_HOT / PROF_END_HOT time those with a user-space tick
+// counter only (TSC, CNTVCT), converted to nanoseconds when the trace is
+// written.
+//
+// The trace is written on SIGUSR2 and by prof_dump() (at exit).
+//
+#ifndef __STAGE_PROF_H_
+#define __STAGE_PROF_H_
+
+#include <stdint.h>
+
+typedef enum {
+    PROF_USB_COMPLETE,  // USB completion callback
+    PROF_QUEUE_DRAIN,   // decoder thread: feed the completed transfers
+    PROF_SYNC_SEARCH,   // decoder: scan for a sync edge
+    PROF_PIXEL_CONVERT, // decoder: samples of a line to colors
+    PROF_UPLOAD,        // display: frame upload / composition on vsync
+    PROF_SUBMIT,        // USB transfer (re)submission
+    PROF_STAGES
+} prof_stage_t;
+
+#ifdef STAGE_PROF
+typedef struct {
+    int64_t ns;
+    uint64_t count[2]; // cycles, cache misses
+} prof_mark_t;
+
+extern volatile int prof_on;
+
+#define PROF_BEGIN(t)    \
+    prof_mark_t t = {0}; \
+    if (prof_on)         \
+        prof_begin(&t)
+#define PROF_END(t, stage)       \
+    do {                         \
+        if (prof_on && t.ns)     \
+            prof_end(&t, stage); \
+    } while (0)
+#define PROF_BEGIN_HOT(t) int64_t t = prof_on ? prof_ticks() : 0
+#define PROF_END_HOT(t, stage)      \
+    do {                            \
+        if (prof_on && t)           \
+            prof_end_hot(t, stage); \
+    } while (0)
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline int64_t prof_ticks(void) { return __builtin_ia32_rdtsc(); }
+#elif defined(__aarch64__)
+static inline int64_t prof_ticks(void) {
+    int64_t t;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(t));
+    return t;
+}
+#else
+int64_t prof_ticks(void);
+#endif
+
+// Prototypes
+//--------------------------------------------------------------------------------
+int prof_open(const char *path, int cache_misses);
+void prof_begin(prof_mark_t *m);
+void prof_end(const prof_mark_t *m, prof_stage_t stage);
+void prof_end_hot(int64_t start, prof_stage_t stage);
+void prof_dump(void);
+#else
+#define PROF_BEGIN(t)
+#define PROF_END(t, stage)
+#define PROF_BEGIN_HOT(t)
+#define PROF_END_HOT(t, stage)
+#endif
+
+#endif // __STAGE_PROF_H_
+#if defined(STAGE_PROF_IMPLEMENTATION) && defined(STAGE_PROF) && !defined(__STAGE_PROF_IMPL_)
+#define __STAGE_PROF_IMPL_ // also included by the MGL and decoder headers
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__arm__)
+#include <sys/auxv.h>
+#endif
+
+#define PROF_EVENTS 65536 // per thread
+#define PROF_THREADS_MAX 32
+
+typedef struct {
+    int64_t ns;      // ticks for a hot scope
+    uint32_t dur_ns; // ticks for a hot scope
+    uint16_t stage;
+    uint16_t hot;
+    uint64_t count[2];
+} prof_event_t;
+
+typedef struct {
+    int tid;
+    char name[16];
+    int fd;         // counter group leader, -1 without counters
+    uint64_t head;  // events written; published with release
+    prof_event_t ev[PROF_EVENTS];
+} prof_thread_t;
+
+static const char *prof_stage_name[PROF_STAGES] = {"usb complete", "queue drain", "sync search", "pixel convert", "upload", "submit"};
+
+volatile int prof_on;
+static const char *prof_path;
+static int prof_misses;
+static prof_thread_t *prof_threads[PROF_THREADS_MAX];
+static int prof_thread_num;
+static __thread prof_thread_t *prof_self;
+static __thread int prof_self_failed;
+static volatile sig_atomic_t prof_dump_requested;
+static pthread_mutex_t prof_dump_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int64_t prof_start_ns, prof_start_ticks; // both clocks at prof_open()
+
+static int64_t prof_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#if defined(__arm__)
+#define PROF_HWCAP_EVTSTRM (1 << 21) // asm/hwcap.h: the kernel runs the generic timer
+static int prof_cntvct;
+
+// CNTVCT where the generic timer is there (Pi 2 and later), else the clock
+int64_t prof_ticks(void) {
+    if (prof_cntvct) {
+        int64_t t;
+        __asm__ volatile("mrrc p15, 1, %Q0, %R0, c14" : "=r"(t));
+        return t;
+    }
+    return prof_ns();
+}
+#elif !defined(__x86_64__) && !defined(__i386__) && !defined(__aarch64__)
+int64_t prof_ticks(void) { return prof_ns(); }
+#endif
+
+static int prof_counter_open(uint64_t config, int group) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_hv = 1;
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+    if (fd < 0) {
+        attr.exclude_kernel = 1; // perf_event_paranoid 2: user space only
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+    }
+    return fd;
+}
+
+// The calling thread's ring and counters, created on its first event
+static prof_thread_t *prof_thread() {
+    if (prof_self != NULL || prof_self_failed) {
+        return prof_self;
+    }
+    int i = __atomic_fetch_add(&prof_thread_num, 1, __ATOMIC_RELAXED);
+    prof_thread_t *t = (i < PROF_THREADS_MAX) ? calloc(1, sizeof(*t)) : NULL;
+    if (t == NULL) {
+        prof_self_failed = 1;
+        return NULL;
+    }
+    t->tid = syscall(SYS_gettid);
+    pthread_getname_np(pthread_self(), t->name, sizeof(t->name));
+    t->fd = prof_counter_open(PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (t->fd < 0) {
+        fprintf(stderr, "Prof: No cycle counter for thread %d (%s).\n", t->tid, t->name);
+    } else if (prof_misses && prof_counter_open(PERF_COUNT_HW_CACHE_MISSES, t->fd) < 0) {
+        fprintf(stderr, "Prof: No cache miss counter for thread %d.\n", t->tid);
+    }
+    __atomic_store_n(&prof_threads[i], t, __ATOMIC_RELEASE);
+    prof_self = t;
+    return t;
+}
+
+static void prof_read(prof_thread_t *t, uint64_t count[2]) {
+    uint64_t buf[3] = {0}; // nr, cycles, cache misses
+    if (t->fd < 0 || read(t->fd, buf, sizeof(buf)) < (ssize_t)(2 * sizeof(uint64_t))) {
+        buf[1] = buf[2] = 0;
+    }
+    count[0] = buf[1];
+    count[1] = buf[2];
+}
+
+void prof_begin(prof_mark_t *m) {
+    prof_thread_t *t = prof_thread();
+    if (t != NULL) {
+        prof_read(t, m->count);
+    }
+    m->ns = prof_ns();
+}
+
+void prof_end(const prof_mark_t *m, prof_stage_t stage) {
+    int64_t now = prof_ns();
+    prof_thread_t *t = prof_self;
+    if (t == NULL) {
+        return;
+    }
+    prof_event_t *e = &t->ev[t->head % PROF_EVENTS];
+    prof_read(t, e->count);
+    e->count[0] -= m->count[0];
+    e->count[1] -= m->count[1];
+    e->ns = m->ns;
+    e->dur_ns = now - m->ns;
+    e->stage = stage;
+    e->hot = 0;
+    __atomic_store_n(&t->head, t->head + 1, __ATOMIC_RELEASE);
+}
+
+void prof_end_hot(int64_t start, prof_stage_t stage) {
+    int64_t now = prof_ticks();
+    prof_thread_t *t = prof_thread();
+    if (t == NULL) {
+        return;
+    }
+    prof_event_t *e = &t->ev[t->head % PROF_EVENTS];
+    e->ns = start;
+    e->dur_ns = now - start;
+    e->stage = stage;
+    e->hot = 1;
+    __atomic_store_n(&t->head, t->head + 1, __ATOMIC_RELEASE);
+}
+
+//--------------------------------------------------------------------------------
+// Trace JSON: one complete ("X") event per scope, thread names as metadata.
+// Events being overwritten while the ring is dumped may come out mixed.
+//--------------------------------------------------------------------------------
+void prof_dump(void) {
+    if (prof_path == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&prof_dump_mtx);
+    FILE *fp = fopen(prof_path, "w");
+    if (fp == NULL) {
+        perror("Prof: Cannot write the trace");
+        pthread_mutex_unlock(&prof_dump_mtx);
+        return;
+    }
+    int pid = getpid();
+    uint64_t total = 0;
+    // Ticks to nanoseconds: the rate since prof_open()
+    int64_t ticks = prof_ticks() - prof_start_ticks;
+    double ns_per_tick = (ticks > 0) ? (double)(prof_ns() - prof_start_ns) / ticks : 1;
+    const char *sep = "";
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    int num = __atomic_load_n(&prof_thread_num, __ATOMIC_RELAXED);
+    for (int i = 0; i < num && i < PROF_THREADS_MAX; i++) {
+        prof_thread_t *t = __atomic_load_n(&prof_threads[i], __ATOMIC_ACQUIRE);
+        if (t == NULL) {
+            continue;
+        }
+        fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", sep, pid, t->tid, t->name);
+        sep = ",";
+        uint64_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+        for (uint64_t n = (head > PROF_EVENTS) ? head - PROF_EVENTS : 0; n < head; n++) {
+            const prof_event_t *e = &t->ev[n % PROF_EVENTS];
+            double ns = e->ns, dur_ns = e->dur_ns;
+            if (e->hot) {
+                ns = prof_start_ns + (e->ns - prof_start_ticks) * ns_per_tick;
+                dur_ns *= ns_per_tick;
+            }
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", prof_stage_name[e->stage],
+                    pid, t->tid, ns / 1000.0, dur_ns / 1000.0);
+            if (t->fd >= 0 && !e->hot) {
+                fprintf(fp, ",\"args\":{\"cycles\":%llu", (unsigned long long)e->count[0]);
+                if (prof_misses) {
+                    fprintf(fp, ",\"cache_misses\":%llu", (unsigned long long)e->count[1]);
+                }
+                fprintf(fp, "}");
+            }
+            fprintf(fp, "}");
+        }
+        total += head - ((head > PROF_EVENTS) ? head - PROF_EVENTS : 0);
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    printf("\nProf: %llu events written to %s.\n", (unsigned long long)total, prof_path);
+    pthread_mutex_unlock(&prof_dump_mtx);
+}
+
+static void prof_signal(int sig) { prof_dump_requested = 1; }
+
+// Writes the trace when SIGUSR2 asks for it (not from the signal handler)
+static void *prof_run(void *arg) {
+    pthread_setname_np(pthread_self(), "prof");
+    while (1) {
+        usleep(100000);
+        if (prof_dump_requested) {
+            prof_dump_requested = 0;
+            prof_dump();
+        }
+    }
+    return NULL;
+}
+
+int prof_open(const char *path, int cache_misses) {
+    prof_path = path;
+    prof_misses = cache_misses;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = prof_signal;
+    sigaction(SIGUSR2, &sa, NULL);
+    pthread_t th;
+    if (pthread_create(&th, NULL, prof_run, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(th);
+
+#if defined(__arm__)
+    prof_cntvct = (getauxval(AT_HWCAP) & PROF_HWCAP_EVTSTRM) != 0;
+#endif
+    prof_start_ticks = prof_ticks();
+    prof_start_ns = prof_ns();
+    prof_on = 1;
+    printf("Prof: Recording stages%s, kill -USR2 %d writes %s.\n", cache_misses ? " with cache misses" : "", getpid(), path);
+    return 0;
+}
+
+#endif // STAGE_PROF_IMPLEMENTATION
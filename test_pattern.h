@@ -0,0 +1,72 @@
+//
+// Synthetic sample streams with the source timing of the build profile
+// (profile.h), for the decoder benchmark (-B) and fx2_emu
+//
+// A frame is the V-Sync pulse and PATTERN_LINES lines, each an H-Sync pulse,
+// the back porch, DW pixels (black outside the active lines) and the front
+// porch, in the sample format of rgb_decoder.h.
+//
+#ifndef __TEST_PATTERN_H_
+#define __TEST_PATTERN_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "profile.h"
+#include "rgb_decoder.h"
+
+#define PATTERN_LINES (V_PORCH + DH + 4) // H-Sync pulses per frame
+#define PATTERN_FRAME_LEN (V_SYNC + PATTERN_LINES * (H_SYNC + H_PORCH + DW + H_FRONT))
+
+// Color (3 bit RGB) of the active pixel x, y in frame number frame
+typedef uint8_t (*pattern_pixel_t)(int x, int y, int frame);
+
+static inline uint8_t pattern_random(int x, int y, int frame) { return rand() & 7; }
+
+// Color bars moving one bar per frame
+static inline uint8_t pattern_bars(int x, int y, int frame) { return (x * 8 / DW + frame) & 7; }
+
+// One frame of samples (PATTERN_FRAME_LEN bytes); returns its length
+static inline size_t pattern_frame(uint8_t *buf, pattern_pixel_t pixel, int frame) {
+    const uint8_t vh = (1 << BIT_VSYNC) | (1 << BIT_HSYNC);
+    uint8_t *p = buf;
+    for (int i = 0; i < V_SYNC; i++) {
+        *p++ = 1 << BIT_HSYNC; // V-Sync pulse
+    }
+    for (int y = 0; y < PATTERN_LINES; y++) {
+        for (int i = 0; i < H_SYNC; i++) {
+            *p++ = 1 << BIT_VSYNC; // H-Sync pulse
+        }
+        for (int i = 0; i < H_PORCH; i++) {
+            *p++ = vh;
+        }
+        int active = (y >= V_PORCH && y < V_PORCH + DH);
+        for (int x = 0; x < DW; x++) {
+            *p++ = vh | (active ? pixel(x, y - V_PORCH, frame) : 0);
+        }
+        for (int i = 0; i < H_FRONT; i++) {
+            *p++ = vh;
+        }
+    }
+    return p - buf;
+}
+
+// The same frame as gpif_gated_8 sends it: a marker per sync pulse, pixels on
+// the active lines; returns its length
+static inline size_t pattern_gated_frame(const uint8_t *frame, uint8_t *buf) {
+    const uint8_t *in = frame + V_SYNC;
+    uint8_t *p = buf;
+    *p++ = 1 << BIT_HSYNC; // V-Sync marker
+    for (int y = 0; y < PATTERN_LINES; y++) {
+        *p++ = 1 << BIT_VSYNC;      // H-Sync marker
+        in += H_SYNC + 1 + H_PORCH; // pixels start after the sample ending H-Sync and the porch
+        if (y >= V_PORCH && y < V_PORCH + DH) {
+            memcpy(p, in, DW);
+            p += DW;
+        }
+        in += DW + H_FRONT - 1;
+    }
+    return p - buf;
+}
+
+#endif // __TEST_PATTERN_H_
@@ -0,0 +1,258 @@
+//
+// Decoder self-test: chunk boundaries
+//
+// rgb_decoder_feed() must decode a stream the same way however it is cut into
+// chunks. A few small synthetic frames (full and gated stream) are fed in
+// chunks of every size from 1 byte to the whole stream, with every decode
+// kernel this CPU supports, scanning and timing-locked, and each run must
+// produce the same frames, in the same order, as a single feed. The single
+// feeds of the full stream must match the frames of the original blocking
+// decoder (a port of the READ() loop of the first digital_rgb_display.c), the
+// gated ones the scalar kernel's scanning decode.
+//
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define RGB_DECODER_IMPLEMENTATION
+#include "rgb_decoder.h"
+
+#define W 70 // wider than a vector of any kernel, with a tail
+#define H 6
+#define V_PORCH 3
+#define H_PORCH 5
+#define H_SYNC 4
+#define H_FRONT 3
+#define V_SYNC 50
+#define FRAMES 3
+#define FRAMES_MAX 16
+
+static const uint8_t palette[8] = {10, 11, 12, 13, 14, 15, 16, 17};
+
+// Frames decoded in one run: a checksum of the frame buffer each
+typedef struct {
+    uint32_t sum[FRAMES_MAX];
+    int num;
+} run_t;
+
+static uint8_t fb[W * H * 4];
+
+static void run_add(run_t *run, const uint8_t *frame, int bpp) {
+    uint32_t sum = 2166136261U; // FNV-1a
+    for (int i = 0; i < W * H * bpp; i++) {
+        sum = (sum ^ frame[i]) * 16777619U;
+    }
+    if (run->num < FRAMES_MAX) {
+        run->sum[run->num++] = sum;
+    }
+}
+
+static void on_frame(rgb_decoder_t *dec) {
+    run_add(dec->user, fb, dec->bpp);
+    memset(fb, 0, sizeof(fb));
+}
+
+//--------------------------------------------------------------------------------
+// Reference: the original blocking decoder, pulling one sample at a time with
+// READ(). Only the end of the stream is new: READ() jumps out of the loops.
+//--------------------------------------------------------------------------------
+static const uint8_t *ref_p, *ref_end;
+static jmp_buf ref_eof;
+static uint8_t ref_fb[W * H * 4];
+
+static uint32_t ref_read(void) {
+    if (ref_p == ref_end) {
+        longjmp(ref_eof, 1);
+    }
+    return *ref_p++;
+}
+#define READ() ref_read()
+
+static void ref_decode(int bpp, const uint8_t *stream, int len, run_t *run) {
+    uint32_t d = 0;
+    uint32_t vmask = 1 << BIT_VSYNC;
+    uint32_t hmask = 1 << BIT_HSYNC;
+    uint32_t vhmask = vmask | hmask;
+    memset(run, 0, sizeof(*run));
+    memset(ref_fb, 0, sizeof(ref_fb));
+    ref_p = stream;
+    ref_end = stream + len;
+    if (setjmp(ref_eof)) {
+        return;
+    }
+    while (1) {
+        // Wait V-Sync
+        while (READ() & vmask)
+            ; // wait untill low
+        while (!(READ() & vmask))
+            ; // wait untill hi
+
+        // Skip V-Sync back porch
+        for (int i = 0; i < V_PORCH; i++) {
+            while (READ() & hmask)
+                ; // wait untill low
+            while (!(READ() & hmask))
+                ; // wait untill hi
+        }
+
+        int x, y;
+        for (y = 0; y < H; y++) {
+            // Wait H-Sync
+            while (READ() & hmask)
+                ; // wait untill low
+            while (!(READ() & hmask))
+                ; // wait untill hi
+
+            // Skip H-Sync back porch
+            for (x = 0; x < H_PORCH; x++) {
+                READ();
+            }
+
+            uint8_t *p = &ref_fb[y * W * bpp];
+            for (x = 0; x < W; x++) {
+                d = READ();
+                if ((~d) & vhmask) {
+                    y = H + 1; // Sync is lost, skip this frame
+                    break;
+                }
+                if (bpp == 4) {
+                    uint32_t c = palette[d & 7];
+                    memcpy(p, &c, 4);
+                    p += 4;
+                } else {
+                    *p++ = palette[d & 7];
+                }
+            }
+        }
+        if (y == H) {
+            run_add(run, ref_fb, bpp);
+            memset(ref_fb, 0, sizeof(ref_fb));
+        }
+    }
+}
+
+// FRAMES frames with random pixels and a partial one; gated: as gpif_gated_8 sends them.
+// jitter: every third line ends up to 2 samples early or late, or has a longer H-Sync.
+static int make_stream(uint8_t *buf, int gated, int jitter) {
+    static const int front_jitter[5] = {-2, 2, 0, -1, 0};
+    static const int sync_jitter[5] = {0, 0, 1, 0, 0};
+    const uint8_t vh = (1 << BIT_VSYNC) | (1 << BIT_HSYNC);
+    uint8_t *p = buf;
+    int lines = 0;
+    srand(1);
+    for (int f = 0; f <= FRAMES; f++) {
+        for (int i = 0; i < (gated ? 1 : V_SYNC); i++) {
+            *p++ = 1 << BIT_HSYNC; // V-Sync
+        }
+        for (int y = 0; y < V_PORCH + (f < FRAMES ? H + 2 : H / 2); y++) {
+            int active = (y >= V_PORCH && y < V_PORCH + H);
+            int j = (jitter && ++lines % 3 == 0) ? (lines / 3) % 4 : 4;
+            for (int i = 0; i < (gated ? 1 : H_SYNC + sync_jitter[j]); i++) {
+                *p++ = 1 << BIT_VSYNC; // H-Sync
+            }
+            for (int i = 0; i < (gated ? 0 : 1 + H_PORCH); i++) {
+                *p++ = vh; // the sample ending H-Sync, then the porch
+            }
+            for (int x = 0; x < ((gated && !active) ? 0 : W); x++) {
+                *p++ = vh | (active ? rand() & 7 : 0);
+            }
+            for (int i = 0; i < (gated ? 0 : H_FRONT + front_jitter[j]); i++) {
+                *p++ = vh;
+            }
+        }
+    }
+    return p - buf;
+}
+
+static void decode(const rgb_kernels_t *kernels, int bpp, int lock, int gated, const uint8_t *stream, int len, int chunk, run_t *run,
+                   rgb_decoder_t *dec) {
+    rgb_decoder_init(dec, W, H, V_PORCH, H_PORCH, palette);
+    dec->kernels = kernels;
+    dec->fb = fb;
+    dec->bpp = bpp;
+    dec->pitch = W * bpp;
+    dec->lock_lines = lock ? 2 : 0;
+    dec->gated = gated;
+    dec->on_frame = on_frame;
+    dec->user = run;
+    memset(run, 0, sizeof(*run));
+    memset(fb, 0, sizeof(fb));
+    for (int pos = 0; pos < len; pos += chunk) {
+        rgb_decoder_feed(dec, stream + pos, (len - pos < chunk) ? len - pos : chunk);
+    }
+}
+
+int main() {
+    // Full stream, gated stream, full stream with line jitter
+    static uint8_t stream[3][64 * 1024];
+    int len[3] = {make_stream(stream[0], 0, 0), make_stream(stream[1], 1, 0), make_stream(stream[2], 0, 1)};
+    static const struct {
+        const char *name;
+        int bpp, lock, gated, jitter;
+    } modes[] = {
+        {"8bpp scanning", 1, 0, 0, 0},        {"8bpp locked", 1, 1, 0, 0},         {"32bpp scanning", 4, 0, 0, 0},
+        {"32bpp locked", 4, 1, 0, 0},         {"8bpp gated", 1, 0, 1, 0},          {"32bpp gated", 4, 0, 1, 0},
+        {"8bpp scanning, jitter", 1, 0, 0, 1}, {"8bpp locked, jitter", 1, 1, 0, 1}, {"32bpp locked, jitter", 4, 1, 0, 1},
+    };
+    int failed = 0;
+    run_t ref[2];          // scalar scanning of the gated stream, 8bpp and 32bpp
+    run_t blocking[3][2];  // reference decoder, full stream and with jitter, 8bpp and 32bpp
+    for (int si = 0; si < 3; si += 2) {
+        for (int b = 0; b < 2; b++) {
+            ref_decode(b ? 4 : 1, stream[si], len[si], &blocking[si][b]);
+            if (blocking[si][b].num != FRAMES) {
+                printf("FAIL: reference decoder: %d frames\n", blocking[si][b].num);
+                failed++;
+            }
+        }
+    }
+    const rgb_kernels_t *kernels;
+    for (int k = 0; (kernels = rgb_kernels_get(k)) != NULL; k++) {
+        for (int m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+            int si = modes[m].jitter ? 2 : modes[m].gated;
+            const uint8_t *s = stream[si];
+            int n = len[si];
+            run_t want, got;
+            rgb_decoder_t dec;
+            decode(kernels, modes[m].bpp, modes[m].lock, modes[m].gated, s, n, n, &want, &dec);
+            uint64_t locked_inspected = dec.inspected;
+            uint64_t unlocks = dec.unlocks;
+            run_t *r = &ref[modes[m].bpp == 4];
+            if (!modes[m].gated) {
+                r = &blocking[si][modes[m].bpp == 4];
+            } else if (k == 0 && !modes[m].lock) {
+                *r = want;
+            }
+            int ok = (want.num == FRAMES && dec.lost == 0);
+            if (!ok) {
+                printf("FAIL: %s %s: %d frames, %d lost\n", kernels->name, modes[m].name, want.num, (int)dec.lost);
+            }
+            if (ok && memcmp(want.sum, r->sum, sizeof(want.sum[0]) * FRAMES) != 0) {
+                printf("FAIL: %s %s decodes other frames than %s\n", kernels->name, modes[m].name,
+                       modes[m].gated ? "scalar scanning" : "the reference decoder");
+                ok = 0;
+            }
+            for (int chunk = 1; ok && chunk < n; chunk++) {
+                decode(kernels, modes[m].bpp, modes[m].lock, modes[m].gated, s, n, chunk, &got, &dec);
+                if (got.num != want.num || memcmp(got.sum, want.sum, sizeof(want.sum[0]) * want.num) != 0 || dec.lost != 0) {
+                    printf("FAIL: %s %s: %d frames in chunks of %d bytes, %d in one\n", kernels->name, modes[m].name, got.num, chunk, want.num);
+                    ok = 0;
+                }
+            }
+            if (ok && modes[m].lock && locked_inspected >= (uint64_t)n) {
+                printf("FAIL: %s %s did not lock\n", kernels->name, modes[m].name);
+                ok = 0;
+            }
+            // Jitter: the lock is lost and found again, but no frame
+            if (ok && modes[m].lock && modes[m].jitter && unlocks == 0) {
+                printf("FAIL: %s %s never unlocked\n", kernels->name, modes[m].name);
+                ok = 0;
+            }
+            if (ok) {
+                printf("ok: %s %s (%d frames, chunks of 1..%d bytes)\n", kernels->name, modes[m].name, want.num, n);
+            }
+            failed += !ok;
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,137 @@
+//
+// Frame pacer self-test
+//
+// A source and a display that are not locked are simulated for two minutes:
+// the frame completions and the vsyncs both jitter. Paced with the two rates,
+// the repeats or drops must come once per drift period (as many as the rates
+// call for, none closer than half the drift period to the next) and no frame
+// may be shown later than two source frames after its completion. The latest
+// frame on each vsync (no rates) is run for comparison.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#define FRAME_POOL_IMPLEMENTATION
+#include "frame_pool.h"
+#define FRAME_PACER_IMPLEMENTATION
+#include "frame_pacer.h"
+
+#define SECONDS 120
+#define WARMUP 60 // vsyncs before the events are counted
+
+typedef struct {
+    int events;      // repeats and drops
+    int min_spacing; // vsyncs between two events, the fewest
+    double latency;  // completion to vsync of a shown frame, the longest (us)
+} result_t;
+
+static uint32_t rnd = 1;
+
+// Uniform in [-amp, amp]
+static double jitter(double amp) {
+    rnd = rnd * 1103515245 + 12345;
+    return amp * (((rnd >> 8) & 0xffff) / 32767.5 - 1.0);
+}
+
+static void simulate(double src_hz, double disp_hz, double offset_us, double jitter_us, double vsync_jitter_us, int paced, result_t *r) {
+    static double done_us[SECONDS * 100]; // completion time of each frame
+    frame_pool_t pool;
+    frame_pacer_t pacer = {0};
+    rnd = 1;
+    frame_pool_init(&pool, 6, 1, NULL);
+    if (paced) {
+        frame_pacer_set(&pacer, src_hz, disp_hz);
+    }
+    double src_us = 1000000.0 / src_hz, disp_us = 1000000.0 / disp_hz;
+    frame_t *shown = NULL;
+    uint64_t shown_seq = 0;
+    int last_event = -1;
+    int k = 0, j = 0;
+    double next_done = offset_us + jitter(jitter_us);
+    double next_vsync = disp_us + jitter(vsync_jitter_us);
+    r->events = 0;
+    r->min_spacing = 1 << 30;
+    r->latency = 0;
+
+    while (next_vsync < SECONDS * 1000000.0) {
+        if (next_done < next_vsync) {
+            frame_t *f = frame_pool_get(&pool);
+            frame_pool_publish(&pool, f);
+            done_us[f->seq] = next_done;
+            frame_pacer_push(&pacer, f, (int64_t)next_done);
+            k++;
+            next_done = offset_us + k * src_us + jitter(jitter_us);
+            continue;
+        }
+
+        int dropped;
+        frame_t *f = frame_pacer_take(&pacer, (int64_t)next_vsync, &dropped);
+        int event = 0;
+        if (f) {
+            event = (shown && f->seq != shown_seq + 1); // drop
+            if (shown) {
+                frame_release(shown);
+            }
+            shown = f;
+            shown_seq = f->seq;
+            if (j >= WARMUP && next_vsync - done_us[f->seq] > r->latency) {
+                r->latency = next_vsync - done_us[f->seq];
+            }
+        } else {
+            event = (shown != NULL); // repeat
+        }
+        if (event && j >= WARMUP) {
+            if (last_event >= 0 && j - last_event < r->min_spacing) {
+                r->min_spacing = j - last_event;
+            }
+            last_event = j;
+            r->events++;
+        }
+        j++;
+        next_vsync = (j + 1) * disp_us + jitter(vsync_jitter_us);
+    }
+    frame_pool_free(&pool);
+}
+
+int main() {
+    static const struct {
+        double src_hz, disp_hz;
+    } rates[] = {
+        {60.0, 59.94}, // source faster: drops
+        {59.94, 60.0}, // source slower: repeats
+        {50.0, 60.0},  // every sixth vsync a repeat
+        {60.0, 60.0},  // no drift
+    };
+    static const double offsets_us[] = {200, 8000}; // completions next to the vsyncs, and between them
+    int failed = 0;
+    for (int i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+        for (int o = 0; o < sizeof(offsets_us) / sizeof(offsets_us[0]); o++) {
+            double src_hz = rates[i].src_hz, disp_hz = rates[i].disp_hz;
+            double drift = (src_hz > disp_hz) ? src_hz - disp_hz : disp_hz - src_hz;
+            double want = drift * (SECONDS - (double)WARMUP / disp_hz);
+            int spacing = (drift > 0) ? (int)(disp_hz / drift / 2) : 0;
+            result_t paced, latest;
+            simulate(src_hz, disp_hz, offsets_us[o], 3000, 500, 1, &paced);
+            simulate(src_hz, disp_hz, offsets_us[o], 3000, 500, 0, &latest);
+            int ok = 1;
+            if (paced.events < want - 1 || paced.events > want + 1) {
+                printf("FAIL: %.2f Hz on %.2f Hz: %d repeats or drops, %.0f expected\n", src_hz, disp_hz, paced.events, want);
+                ok = 0;
+            }
+            if (paced.events > 1 && paced.min_spacing < spacing) {
+                printf("FAIL: %.2f Hz on %.2f Hz: repeats or drops %d vsyncs apart\n", src_hz, disp_hz, paced.min_spacing);
+                ok = 0;
+            }
+            if (paced.latency > 2 * 1000000.0 / src_hz) {
+                printf("FAIL: %.2f Hz on %.2f Hz: a frame shown %.1f ms after its completion\n", src_hz, disp_hz, paced.latency / 1000);
+                ok = 0;
+            }
+            if (ok) {
+                printf("ok: %.2f Hz on %.2f Hz, offset %.1f ms: %d repeats or drops, %d+ vsyncs apart, latency <= %.1f ms (latest frame: %d)\n",
+                       src_hz, disp_hz, offsets_us[o] / 1000, paced.events, (paced.events > 1) ? paced.min_spacing : 0, paced.latency / 1000,
+                       latest.events);
+            }
+            failed += !ok;
+        }
+    }
+    return failed ? 1 : 0;
+}
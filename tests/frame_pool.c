@@ -0,0 +1,238 @@
+//
+// Frame pool self-test
+//
+// A subscriber that keeps every frame published to it must run the pool out:
+// frame_pool_get() then returns NULL and counts it in exhausted, and the
+// frames it holds are not exclusive to the producer. A frame must come back
+// from frame_pool_get() only once its last reference is released, whoever
+// holds it. Several threads then get frames, take and drop references and
+// pass frames to each other for release: no frame may ever be handed out
+// twice, and every frame must be free at the end.
+//
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define FRAME_POOL_IMPLEMENTATION
+#include "frame_pool.h"
+
+#define FRAMES 4
+#define FRAME_SIZE 64
+#define THREADS 4
+#define ROUNDS 200000
+#define SLOTS 3 // frames passed between the threads
+#define STRESS_FRAMES 6 // fewer than the threads and the slots can hold
+
+// Subscriber that keeps the frames until told otherwise
+typedef struct {
+    frame_t *held[FRAME_POOL_MAX];
+    int num;
+} keeper_t;
+
+static void keep(frame_t *f, void *user) {
+    keeper_t *k = user;
+    frame_ref(f);
+    k->held[k->num++] = f;
+}
+
+// Producer step: a free frame, published and released again; NULL if exhausted
+static frame_t *produce(frame_pool_t *pool) {
+    frame_t *f = frame_pool_get(pool);
+    if (f) {
+        frame_pool_publish(pool, f);
+        frame_release(f);
+    }
+    return f;
+}
+
+static int all_free(frame_pool_t *pool) {
+    for (int i = 0; i < pool->num; i++) {
+        if (__atomic_load_n(&pool->frames[i].refs, __ATOMIC_ACQUIRE) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int test_exhaustion() {
+    frame_pool_t pool;
+    keeper_t k = {0};
+    int ok = 1;
+    frame_pool_init(&pool, FRAMES, FRAME_SIZE, NULL);
+    frame_pool_subscribe(&pool, keep, &k);
+    for (int i = 0; i < FRAMES; i++) {
+        frame_t *f = frame_pool_get(&pool);
+        if (f == NULL) {
+            printf("FAIL: exhaustion: no frame after %d of %d\n", i, FRAMES);
+            return 0;
+        }
+        if (!frame_exclusive(f)) {
+            printf("FAIL: exhaustion: a new frame is shared\n");
+            ok = 0;
+        }
+        frame_pool_publish(&pool, f);
+        if (frame_exclusive(f)) {
+            printf("FAIL: exhaustion: the subscriber's reference is not counted\n");
+            ok = 0;
+        }
+        frame_release(f);
+    }
+    for (int i = 0; i < 3; i++) {
+        if (produce(&pool) != NULL) {
+            printf("FAIL: exhaustion: a frame held by the subscriber was handed out\n");
+            ok = 0;
+        }
+    }
+    if (pool.exhausted != 3 || k.num != FRAMES) {
+        printf("FAIL: exhaustion: %llu exhausted, %d frames held, expected 3 and %d\n", (unsigned long long)pool.exhausted, k.num, FRAMES);
+        ok = 0;
+    }
+    if (ok) {
+        printf("ok: exhaustion (%d frames held by a subscriber, %llu exhausted)\n", k.num, (unsigned long long)pool.exhausted);
+    }
+    frame_pool_free(&pool);
+    return ok;
+}
+
+static int test_recycle() {
+    frame_pool_t pool;
+    keeper_t a = {0}, b = {0};
+    int ok = 1;
+    frame_pool_init(&pool, FRAMES, FRAME_SIZE, NULL);
+    frame_pool_subscribe(&pool, keep, &a);
+    frame_pool_subscribe(&pool, keep, &b);
+    while (produce(&pool) != NULL) {
+    }
+
+    // Every frame is held by both subscribers: a frame is free only once both let it go
+    uint64_t seq = pool.seq;
+    frame_t *f = a.held[1];
+    uint8_t *data = f->data;
+    frame_release(a.held[1]);
+    if (frame_pool_get(&pool) != NULL) {
+        printf("FAIL: recycle: a frame was handed out with a reference left\n");
+        ok = 0;
+    }
+    frame_release(b.held[1]);
+    frame_t *g = frame_pool_get(&pool);
+    if (g != f || g->data != data || !frame_exclusive(g)) {
+        printf("FAIL: recycle: the frame released last was not handed out again\n");
+        ok = 0;
+    }
+    if (frame_pool_get(&pool) != NULL) {
+        printf("FAIL: recycle: a second frame was handed out\n");
+        ok = 0;
+    }
+    a.num = b.num = 0;
+    frame_pool_publish(&pool, g);
+    if (g->seq != seq + 1 || a.num != 1 || b.num != 1) {
+        printf("FAIL: recycle: the frame was not published again\n");
+        ok = 0;
+    }
+    if (ok) {
+        printf("ok: recycle (frame %d back after its last release, published as %llu)\n", (int)(g - pool.frames), (unsigned long long)g->seq);
+    }
+    frame_pool_free(&pool);
+    return ok;
+}
+
+//--------------------------------------------------------------------------------
+// Stress: each thread fills the frames it gets with its own id and checks it is
+// still there after taking and dropping references, which fails if another
+// thread got the same frame. Frames go through the shared slots, so the last
+// release is often on another thread than the get.
+//--------------------------------------------------------------------------------
+static frame_pool_t stress_pool;
+static frame_t *slots[SLOTS];
+static uint64_t stress_nulls;
+
+typedef struct {
+    int id;
+    int gets;
+    int corrupt;
+} worker_t;
+
+static void *stress_run(void *arg) {
+    worker_t *w = arg;
+    uint32_t rnd = w->id + 1;
+    for (int i = 0; i < ROUNDS; i++) {
+        rnd = rnd * 1103515245 + 12345;
+        frame_t *f = frame_pool_get(&stress_pool);
+        if (f == NULL) {
+            __atomic_add_fetch(&stress_nulls, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        w->gets++;
+        memset(f->data, w->id, FRAME_SIZE);
+        int refs = (rnd >> 16) % 4;
+        for (int r = 0; r < refs; r++) {
+            frame_ref(f);
+        }
+        for (int r = 0; r < refs; r++) {
+            frame_release(f);
+        }
+        for (int b = 0; b < FRAME_SIZE; b++) {
+            if (f->data[b] != w->id) {
+                w->corrupt++;
+                break;
+            }
+        }
+        if ((rnd >> 20) & 1) {
+            // Pass it on; release whatever was in the slot
+            frame_t *old = __atomic_exchange_n(&slots[(rnd >> 21) % SLOTS], f, __ATOMIC_ACQ_REL);
+            if (old) {
+                frame_release(old);
+            }
+        } else {
+            frame_release(f);
+        }
+    }
+    return NULL;
+}
+
+static int test_stress() {
+    pthread_t th[THREADS];
+    worker_t w[THREADS];
+    int ok = 1;
+    frame_pool_init(&stress_pool, STRESS_FRAMES, FRAME_SIZE, NULL);
+    for (int i = 0; i < THREADS; i++) {
+        w[i] = (worker_t){.id = i + 1};
+        pthread_create(&th[i], NULL, stress_run, &w[i]);
+    }
+    int gets = 0, corrupt = 0;
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(th[i], NULL);
+        gets += w[i].gets;
+        corrupt += w[i].corrupt;
+    }
+    for (int s = 0; s < SLOTS; s++) {
+        if (slots[s]) {
+            frame_release(slots[s]);
+        }
+    }
+    if (corrupt) {
+        printf("FAIL: stress: %d frames were handed out twice\n", corrupt);
+        ok = 0;
+    }
+    if (!all_free(&stress_pool)) {
+        printf("FAIL: stress: frames still held at the end\n");
+        ok = 0;
+    }
+    if (stress_pool.exhausted != stress_nulls) {
+        printf("FAIL: stress: %llu exhausted, %llu NULL frames\n", (unsigned long long)stress_pool.exhausted, (unsigned long long)stress_nulls);
+        ok = 0;
+    }
+    if (ok) {
+        printf("ok: stress (%d threads, %d frames got, %llu exhausted)\n", THREADS, gets, (unsigned long long)stress_pool.exhausted);
+    }
+    frame_pool_free(&stress_pool);
+    return ok;
+}
+
+int main() {
+    int failed = 0;
+    failed += !test_exhaustion();
+    failed += !test_recycle();
+    failed += !test_stress();
+    return failed ? 1 : 0;
+}
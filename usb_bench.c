@@ -0,0 +1,390 @@
+//
+// USB bulk-IN throughput benchmark
+//
+// The transfer setup of digital_rgb_display's USB thread (a ring of bulk
+// transfers, resubmitted from the completion callback on one event thread),
+// but the data is thrown away. Sweeps the number of transfers in flight, the
+// transfer size, zero-copy buffers (libusb_dev_mem_alloc, usbfs mmap) against
+// malloc'ed ones and the event thread priority (SCHED_FIFO), and reports the
+// sustained MB/s, the completion-interval jitter and the process CPU usage
+// for each configuration.
+//
+// Works with the FX2 (the firmware is loaded first) or any other bulk IN
+// source, e.g. the kernel's g_zero gadget on dummy_hcd:
+//   sudo modprobe dummy_hcd && sudo modprobe g_zero
+//   sudo ./usb_bench -u 0525:a4a0:81
+//
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
+#define FX2_USB_IMPLEMENTATION
+#include "fx2_usb.h"
+
+#define WARMUP_MS 1000
+#define XFR_MAX 128
+#define EVENT_PRIORITY 50 // SCHED_FIFO, as the kernel's threaded IRQs
+
+static const int xfr_nums[] = {8, 32, 64, 128};
+static const int rx_sizes[] = {16 * 1024, 64 * 1024, 256 * 1024};
+
+static libusb_device_handle *handle;
+static unsigned char ep = IN_EP;
+
+#define N(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+static int64_t timemicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//----------------------------------------------------------------------
+// One configuration
+//----------------------------------------------------------------------
+typedef struct {
+    int xfr_num;
+    int rx_size;
+    int zero_copy;
+    int priority;
+} bench_config_t;
+
+static struct libusb_transfer *xfr[XFR_MAX];
+static volatile int run_flag;
+static volatile int measuring;
+static int pending;       // transfers submitted; touched by the event thread only once it runs
+static volatile int lost; // the device is gone
+static uint64_t total_size, errors;
+static struct {
+    int64_t last_us;
+    uint64_t n;
+    double sum, sq, max; // completion intervals, msec
+} interval;
+
+static void bench_callback(struct libusb_transfer *x) {
+    if (x->status == LIBUSB_TRANSFER_COMPLETED) {
+        if (measuring) {
+            total_size += x->actual_length;
+            int64_t now = timemicros();
+            if (interval.last_us) {
+                double ms = (now - interval.last_us) / 1000.0;
+                interval.n++;
+                interval.sum += ms;
+                interval.sq += ms * ms;
+                if (ms > interval.max) {
+                    interval.max = ms;
+                }
+            }
+            interval.last_us = now;
+        }
+    } else if (x->status == LIBUSB_TRANSFER_NO_DEVICE) {
+        lost = 1;
+    } else if (x->status != LIBUSB_TRANSFER_CANCELLED) {
+        errors++;
+    }
+    if (!run_flag || lost || libusb_submit_transfer(x) < 0) {
+        pending--;
+    }
+}
+
+// Event thread: runs until every transfer is back
+static void *event_run(void *arg) {
+    while (pending > 0) {
+        struct timeval wait = {0, 100000};
+        libusb_handle_events_timeout_completed(NULL, &wait, NULL);
+    }
+    return NULL;
+}
+
+static void buffers_free(const bench_config_t *cfg) {
+    for (int i = 0; i < cfg->xfr_num; i++) {
+        if (xfr[i] == NULL) {
+            continue;
+        }
+        if (xfr[i]->buffer != NULL) {
+            if (cfg->zero_copy) {
+                libusb_dev_mem_free(handle, xfr[i]->buffer, cfg->rx_size);
+            } else {
+                free(xfr[i]->buffer);
+            }
+        }
+        libusb_free_transfer(xfr[i]);
+        xfr[i] = NULL;
+    }
+}
+
+// Returns -1 if the configuration cannot run here (skipped), -2 if the device is gone
+static int bench_run(const bench_config_t *cfg, int sec, double *mbs) {
+    const char *skip = NULL;
+    for (int i = 0; i < cfg->xfr_num && skip == NULL; i++) {
+        xfr[i] = libusb_alloc_transfer(0);
+        unsigned char *buf = NULL;
+        if (xfr[i] == NULL) {
+            skip = "out of memory";
+            break;
+        }
+        if (cfg->zero_copy) {
+            buf = libusb_dev_mem_alloc(handle, cfg->rx_size); // limited by usbfs_memory_mb
+            skip = (buf == NULL) ? "no zero-copy memory" : NULL;
+        } else if (posix_memalign((void **)&buf, 4096, cfg->rx_size) != 0) {
+            buf = NULL;
+            skip = "out of memory";
+        }
+        libusb_fill_bulk_transfer(xfr[i], handle, ep, buf, cfg->rx_size, bench_callback, NULL, 0 /* no timeout */);
+    }
+
+    run_flag = 1;
+    measuring = 0;
+    lost = 0;
+    total_size = errors = 0;
+    memset(&interval, 0, sizeof(interval));
+    pending = 0;
+    for (int i = 0; i < cfg->xfr_num && skip == NULL; i++) {
+        if (libusb_submit_transfer(xfr[i]) < 0) {
+            skip = "submit failed";
+            break;
+        }
+        pending++;
+    }
+
+    pthread_t event_th;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (cfg->priority) {
+        struct sched_param param = {.sched_priority = EVENT_PRIORITY};
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+    int ret = pthread_create(&event_th, &attr, event_run, NULL);
+    if (ret != 0 && cfg->priority) {
+        skip = (ret == EPERM) ? "SCHED_FIFO not permitted" : "thread not created";
+        pthread_attr_destroy(&attr);
+        pthread_attr_init(&attr);
+        ret = pthread_create(&event_th, &attr, event_run, NULL); // only to drain
+    }
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        fprintf(stderr, "Bench: Cannot create the event thread.\n");
+        exit(1);
+    }
+
+    struct rusage ru0, ru1;
+    int64_t start = 0, end = 0;
+    if (skip == NULL) {
+        usleep(WARMUP_MS * 1000); // FIFO fill, transfer ramp-up
+        getrusage(RUSAGE_SELF, &ru0);
+        start = timemicros();
+        measuring = 1;
+        for (int64_t t = 0; t < sec * 1000000LL && !lost; t = timemicros() - start) {
+            usleep(100000);
+        }
+        measuring = 0;
+        end = timemicros();
+        getrusage(RUSAGE_SELF, &ru1);
+    }
+
+    // Stop and wait for the cancelled transfers
+    run_flag = 0;
+    for (int i = 0; i < cfg->xfr_num; i++) {
+        if (xfr[i] != NULL) {
+            libusb_cancel_transfer(xfr[i]);
+        }
+    }
+    pthread_join(event_th, NULL);
+    buffers_free(cfg);
+
+    printf("Bench: %3d x %3d KB  %-9s %-6s ", cfg->xfr_num, cfg->rx_size / 1024, cfg->zero_copy ? "zero-copy" : "copy",
+           cfg->priority ? "fifo" : "normal");
+    if (lost) {
+        printf("device lost\n");
+        return -2;
+    }
+    if (skip != NULL) {
+        printf("skipped (%s)\n", skip);
+        return -1;
+    }
+    double wall = (end - start) / 1000000.0;
+    double cpu = (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec) + (ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec) / 1000000.0 +
+                 (ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec) + (ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec) / 1000000.0;
+    *mbs = total_size / wall / 1024.0 / 1024.0;
+    double mean = interval.n ? interval.sum / interval.n : 0;
+    double sd = interval.n ? sqrt(fmax(0, interval.sq / interval.n - mean * mean)) : 0;
+    printf("%8.3f MB/s, completions every %.2f ms (sd %.2f, max %.2f), CPU %.1f%%, %llu errors\n",
+           *mbs, mean, sd, interval.max, cpu / wall * 100.0, (unsigned long long)errors);
+    fflush(stdout);
+    return 0;
+}
+
+//----------------------------------------------------------------------
+// Device
+//----------------------------------------------------------------------
+// The FX2 with one of the built-in bulk firmware variants
+static int open_fx2(const char *path, int v) {
+    handle = usb_open_device(path);
+    if (handle == NULL) {
+        fprintf(stderr, "Bench: FX2 %s not found.\n", path ? path : "");
+        return -1;
+    }
+    libusb_set_auto_detach_kernel_driver(handle, 1);
+    if (libusb_claim_interface(handle, 0) < 0 || libusb_set_interface_alt_setting(handle, 0, 1) < 0) {
+        fprintf(stderr, "Bench: Cannot claim the FX2.\n");
+        return -1;
+    }
+    if (usb_load_firmware(handle, firmware_variant[v].image) < 0) {
+        fprintf(stderr, "Bench: Firmware download failed.\n");
+        return -1;
+    }
+    // Reset the data toggles for the new firmware
+    if (libusb_set_interface_alt_setting(handle, 0, 1) < 0) {
+        fprintf(stderr, "Bench: Cannot set the alternate setting.\n");
+        return -1;
+    }
+    printf("Bench: FX2 with firmware %s (%s), EP 0x%02x.\n", firmware_variant[v].name, firmware_variant[v].desc, ep);
+    return 0;
+}
+
+// Any bulk IN source, "vid:pid[:ep]" in hex, interface 0 as configured
+static int open_other(const char *arg) {
+    unsigned vid, pid, in_ep = 0x81;
+    if (sscanf(arg, "%x:%x:%x", &vid, &pid, &in_ep) < 2) {
+        fprintf(stderr, "Bench: Use vid:pid[:ep] in hex, e.g. 0525:a4a0:81 for g_zero.\n");
+        return -1;
+    }
+    handle = libusb_open_device_with_vid_pid(NULL, vid, pid);
+    if (handle == NULL) {
+        fprintf(stderr, "Bench: %04x:%04x not found.\n", vid, pid);
+        return -1;
+    }
+    libusb_set_auto_detach_kernel_driver(handle, 1);
+    if (libusb_claim_interface(handle, 0) < 0) {
+        fprintf(stderr, "Bench: Cannot claim interface 0 of %04x:%04x.\n", vid, pid);
+        return -1;
+    }
+    ep = LIBUSB_ENDPOINT_IN | (in_ep & 0x0f);
+    printf("Bench: %04x:%04x, EP 0x%02x.\n", vid, pid, ep);
+    return 0;
+}
+
+//----------------------------------------------------------------------
+// Main
+//----------------------------------------------------------------------
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-d path] [-f name] [-u vid:pid[:ep]] [-t sec] [-n xfrs] [-s KB] [-z 0|1] [-p 0|1]\n", prog);
+    fprintf(stderr, "  -d path  FX2 at bus-port path (e.g. 1-1.3). Default: the first FX2 found.\n");
+    fprintf(stderr, "  -f name  Firmware variant (bulk only):");
+    for (int v = 0; v < FIRMWARE_VARIANTS; v++) {
+        if (!firmware_variant[v].iso) {
+            fprintf(stderr, " %s", firmware_variant[v].name);
+        }
+    }
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -u id    Another bulk IN source instead of the FX2 (no firmware), e.g. 0525:a4a0:81 (g_zero)\n");
+    fprintf(stderr, "  -t sec   Seconds measured per configuration (default 5, after %d ms warm-up)\n", WARMUP_MS);
+    fprintf(stderr, "  -n xfrs  Only this many transfers in flight (default: sweep 8 32 64 128)\n");
+    fprintf(stderr, "  -s KB    Only this transfer size (default: sweep 16 64 256)\n");
+    fprintf(stderr, "  -z 0|1   Only malloc'ed (0) or zero-copy (1) buffers (default: both)\n");
+    fprintf(stderr, "  -p 0|1   Only the normal (0) or SCHED_FIFO (1) event thread (default: both)\n");
+}
+
+int main(int argc, char *argv[]) {
+    char *path = NULL, *other = NULL;
+    int v = 0, sec = 5;
+    int fix_xfr = 0, fix_size = 0, fix_zc = -1, fix_prio = -1;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:f:u:t:n:s:z:p:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            path = optarg;
+            break;
+        case 'f':
+            for (v = 0; v < FIRMWARE_VARIANTS; v++) {
+                if (strcmp(optarg, firmware_variant[v].name) == 0 && !firmware_variant[v].iso) {
+                    break;
+                }
+            }
+            if (v == FIRMWARE_VARIANTS) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'u':
+            other = optarg;
+            break;
+        case 't':
+            sec = atoi(optarg);
+            break;
+        case 'n':
+            fix_xfr = atoi(optarg);
+            break;
+        case 's':
+            fix_size = atoi(optarg) * 1024;
+            break;
+        case 'z':
+            fix_zc = atoi(optarg);
+            break;
+        case 'p':
+            fix_prio = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (sec <= 0 || fix_xfr < 0 || fix_xfr > XFR_MAX || fix_size < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (libusb_init(NULL) < 0 || (other ? open_other(other) : open_fx2(path, v)) < 0) {
+        return 1;
+    }
+
+    int best = -1;
+    double best_mbs = 0;
+    bench_config_t configs[N(xfr_nums) * N(rx_sizes) * 4];
+    int config_num = 0;
+    for (int p = 0; p < 2; p++) {
+        for (int z = 0; z < 2; z++) {
+            for (int s = 0; s < N(rx_sizes); s++) {
+                for (int n = 0; n < N(xfr_nums); n++) {
+                    if ((fix_xfr && n > 0) || (fix_size && s > 0) || (fix_zc >= 0 && z != fix_zc) || (fix_prio >= 0 && p != fix_prio)) {
+                        continue;
+                    }
+                    configs[config_num++] = (bench_config_t){fix_xfr ? fix_xfr : xfr_nums[n], fix_size ? fix_size : rx_sizes[s], z, p};
+                }
+            }
+        }
+    }
+
+    printf("Bench: %d configurations, %d s each.\n", config_num, sec);
+    for (int i = 0; i < config_num; i++) {
+        double mbs;
+        int ret = bench_run(&configs[i], sec, &mbs);
+        if (ret == -2) {
+            break;
+        }
+        if (ret == 0 && mbs > best_mbs) {
+            best_mbs = mbs;
+            best = i;
+        }
+    }
+    if (best >= 0) {
+        bench_config_t *b = &configs[best];
+        printf("Bench: Best %.3f MB/s with %d x %d KB, %s, %s event thread.\n", best_mbs, b->xfr_num, b->rx_size / 1024,
+               b->zero_copy ? "zero-copy" : "copy", b->priority ? "SCHED_FIFO" : "normal");
+    }
+
+    libusb_release_interface(handle, 0);
+    libusb_close(handle);
+    libusb_exit(NULL);
+    return 0;
+}